@@ -0,0 +1,251 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+// Measures how weedless scales with the number of imports, on synthetic
+// binaries from 10 up to 1M imports:
+//  - decode-*:    getBindingInfo over all three bind streams, once per
+//                 scanner level (scalar, sse2, avx2) the CPU supports
+//  - rebind:      decoding plus rebindSymbols on an in-memory image
+//  - patch-mmap:  patchMachO on a file, with the mmap backend
+//  - patch-pread: patchMachO on a file, with the pread backend
+
+// weedless
+#include "bind.h"
+#include "config.h"
+#include "fixtures.h"
+#include "loadcommands.h"
+#include "machodefs.h"
+#include "macho.h"
+#include "scan.h"
+
+// stl
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// c
+#include <unistd.h>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Dylibs of the fixtures, the hook dylib gets the next ordinal.
+constexpr std::size_t kDylibs = 8;
+// One in this many imports is hooked.
+constexpr std::size_t kHookInterval = 100;
+
+struct Fixture
+{
+  std::size_t imports;
+  std::vector<std::uint8_t> image;
+  std::vector<std::string> hooks;
+  std::size_t bindStreamsSize;
+};
+
+Fixture makeFixture(std::size_t imports, std::size_t nameLength)
+{
+  weedless::fixtures::FixtureOptions options;
+  options.dylibs = kDylibs;
+  options.nameLength = nameLength;
+  options.lazyBinds = imports / 2;
+  options.nonLazyBinds = imports - imports / 2;
+
+  Fixture fixture{imports, weedless::fixtures::generateMachO(options), {}, 0};
+  for (std::size_t index = 0; index < options.lazyBinds; index += kHookInterval) {
+    fixture.hooks.push_back(weedless::fixtures::getLazyName(index, nameLength));
+  }
+  for (std::size_t index = 0; index < options.nonLazyBinds; index += kHookInterval) {
+    fixture.hooks.push_back(weedless::fixtures::getNonLazyName(index, nameLength));
+  }
+  return fixture;
+}
+
+const struct dyld_info_command& getDyldInfo(const std::vector<std::uint8_t>& image)
+{
+  const auto& header = *(const struct mach_header_64*)image.data();
+  const auto* dyldInfo = weedless::LoadCommandIndex(weedless::LoadCommands(header, image.size())).dyldInfo;
+  if (!dyldInfo) {
+    throw std::runtime_error("Fixture has no LC_DYLD_INFO_ONLY.");
+  }
+  return *dyldInfo;
+}
+
+weedless::config::Config makeConfig(const Fixture& fixture)
+{
+  weedless::config::Config config;
+  config.dylibs.push_back({"hooks", "libhooks.dylib", "@executable_path/libhooks.dylib"});
+  for (const auto& hook: fixture.hooks) {
+    config.addHook(hook, 0);
+  }
+  return config;
+}
+
+void writeFile(const std::filesystem::path& path, const std::vector<std::uint8_t>& bytes)
+{
+  std::ofstream stream(path, std::ios::binary | std::ios::trunc);
+  stream.write((const char*)bytes.data(), bytes.size());
+  if (!stream) {
+    throw std::runtime_error("Unable to write " + path.string());
+  }
+}
+
+// Average seconds per call of `run`, repeated for at least `minTime`
+// seconds. `setup` runs before every call and isn't timed.
+template <typename Setup, typename Run>
+double measure(double minTime, Setup&& setup, Run&& run)
+{
+  Clock::duration total{};
+  std::size_t iterations = 0;
+  do {
+    setup();
+    const auto start = Clock::now();
+    run();
+    total += Clock::now() - start;
+    iterations++;
+  } while (std::chrono::duration<double>(total).count() < minTime);
+  return std::chrono::duration<double>(total).count() / iterations;
+}
+
+void report(const char* name, std::size_t imports, std::size_t bytes, double seconds)
+{
+  std::printf("%-14s %8zu imports %11.3f ms %14.0f symbols/s %10.1f MB/s\n",
+      name, imports, seconds * 1e3, imports / seconds, bytes / seconds / 1e6);
+  std::fflush(stdout);
+}
+
+bool isSameBinding(const weedless::BindingInfo& a, const weedless::BindingInfo& b)
+{
+  return a.segmentOffset == b.segmentOffset && a.symbolOffset == b.symbolOffset &&
+         a.ordinalOffset == b.ordinalOffset && a.bindOffset == b.bindOffset &&
+         a.dylibIndex == b.dylibIndex && a.ordinalSize == b.ordinalSize &&
+         a.segmentIndex == b.segmentIndex && a.symbolFlags == b.symbolFlags && 
+         a.stream == b.stream;
+}
+
+void benchmark(const Fixture& fixture, double minTime, const std::filesystem::path& scratch)
+{
+  const auto* original = fixture.image.data();
+  const auto& dyldInfo = getDyldInfo(fixture.image);
+
+  // Every level has to decode exactly what the scalar one does.
+  std::vector<weedless::BindingInfo> expected;
+  for (auto level = weedless::scan::Level::Scalar; 
+       level <= weedless::scan::getSupportedLevel(); 
+       level = weedless::scan::Level((int)level + 1)) {
+    weedless::scan::setLevel(level);
+    std::vector<weedless::BindingInfo> decoded;
+    const auto decode = measure(minTime, []{}, [&]() {
+      decoded = weedless::getBindingInfo<weedless::MachO64>(original, fixture.image.size(), dyldInfo);
+    });
+    if (decoded.size() != fixture.imports) {
+      throw std::runtime_error("Decoded " + std::to_string(decoded.size()) + " imports instead of " + 
+                               std::to_string(fixture.imports));
+    }
+    if (level == weedless::scan::Level::Scalar) {
+      expected = std::move(decoded);
+    } else if (!std::equal(decoded.begin(), decoded.end(), expected.begin(), expected.end(), isSameBinding)) {
+      throw std::runtime_error(std::string("Decoding differs at level ") + weedless::scan::getLevelName(level));
+    }
+    const auto name = std::string("decode-") + weedless::scan::getLevelName(level);
+    report(name.c_str(), fixture.imports, fixture.bindStreamsSize, decode);
+  }
+
+  weedless::SymbolOrdinals hookOrdinals;
+  for (const auto& hook: fixture.hooks) {
+    hookOrdinals.emplace(hook, kDylibs + 1);
+  }
+  std::vector<std::uint8_t> image(fixture.image.size());
+  const auto rebind = measure(minTime, 
+    [&]() { std::memcpy(image.data(), original, image.size()); },
+    [&]() {
+      const auto& info = getDyldInfo(image);
+      const auto bindingInfos = weedless::getBindingInfo<weedless::MachO64>(image.data(), image.size(), info);
+      weedless::rebindSymbols(image.data(), info, bindingInfos, hookOrdinals);
+    });
+  report("rebind", fixture.imports, fixture.bindStreamsSize, rebind);
+
+  const auto config = makeConfig(fixture);
+  for (const auto backend: {weedless::IoBackend::Mmap, weedless::IoBackend::Pread}) {
+    const auto patch = measure(minTime, 
+      [&]() { writeFile(scratch, fixture.image); },
+      [&]() { weedless::patchMachO(config, scratch, backend); });
+    if (!weedless::isPatched(config, scratch)) {
+      throw std::runtime_error("Patched fixture is missing hooks.");
+    }
+    report(backend == weedless::IoBackend::Mmap ? "patch-mmap" : "patch-pread", 
+           fixture.imports, fixture.image.size(), patch);
+  }
+}
+
+void printUsage()
+{
+  std::cerr << "Usage: weedless-benchmark [--max-imports N] [--min-time seconds] [--name-length N]" << std::endl;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  std::size_t maxImports = 1000000;
+  double minTime = 0.2;
+  std::size_t nameLength = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--max-imports") == 0 && i + 1 < argc) {
+      maxImports = std::stoull(argv[++i]);
+    } else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+      minTime = std::stod(argv[++i]);
+    } else if (strcmp(argv[i], "--name-length") == 0 && i + 1 < argc) {
+      nameLength = std::stoull(argv[++i]);
+    } else {
+      printUsage();
+      return 1;
+    }
+  }
+
+  const auto scratch = std::filesystem::temp_directory_path() / 
+    ("weedless-benchmark-" + std::to_string(getpid()));
+  int exitCode = 0;
+  try {
+    for (std::size_t imports = 10; imports <= maxImports; imports *= 10) {
+      auto fixture = makeFixture(imports, nameLength);
+      const auto& dyldInfo = getDyldInfo(fixture.image);
+      fixture.bindStreamsSize = dyldInfo.bind_size + dyldInfo.weak_bind_size + dyldInfo.lazy_bind_size;
+      benchmark(fixture, minTime, scratch);
+    }
+  } catch (const std::exception& e) {
+    std::cerr << "FAIL " << e.what() << std::endl;
+    exitCode = 1;
+  }
+
+  std::error_code error;
+  std::filesystem::remove(scratch, error);
+  return exitCode;
+}
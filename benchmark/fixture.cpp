@@ -0,0 +1,178 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+// Writes a synthetic Mach-O (or hook dylib) for testing and benchmarking
+// weedless.
+
+// weedless
+#include "fixtures.h"
+#include "machodefs.h"
+
+// stl
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+void printUsage()
+{
+  std::cerr << "Usage: weedless-fixture [options] <output>" << std::endl
+            << "  --dylibs N       dylibs to link against (3)" << std::endl
+            << "  --lazy N         lazy binds (4)" << std::endl
+            << "  --non-lazy N     regular binds (4)" << std::endl
+            << "  --weak N         weak binds (0)" << std::endl
+            << "  --padding N      free bytes behind the load commands (1024)" << std::endl
+            << "  --uleb           encode all ordinals as ULEB" << std::endl
+            << "  --name-length N  pad symbol names to N characters (0)" << std::endl
+            << "  --chained F      use chained fixups with imports format F (1-3)" << std::endl
+            << "  --fat            universal binary with x86_64 and arm64 slices" << std::endl
+            << "  --fat64          like --fat, with 64-bit fat headers" << std::endl
+            << "  --32             32-bit images, i386 (and armv7 with --fat)" << std::endl
+            << "  --exports LIST   write a dylib exporting these comma separated symbols" << std::endl
+            << "  --install-name N install name of the dylib" << std::endl
+            << "  --dyld-info      store the dylib's export trie in LC_DYLD_INFO_ONLY" << std::endl;
+}
+
+std::vector<std::string> splitList(const std::string& list)
+{
+  std::vector<std::string> items;
+  std::size_t start = 0;
+  for (auto end = list.find(','); end != std::string::npos; end = list.find(',', start)) {
+    items.push_back(list.substr(start, end - start));
+    start = end + 1;
+  }
+  items.push_back(list.substr(start));
+  return items;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  weedless::fixtures::FixtureOptions options;
+  weedless::fixtures::DylibOptions dylibOptions;
+  bool dylib = false;
+  bool fat = false;
+  bool fat64 = false;
+  bool is32Bit = false;
+  std::string output;
+
+  for (int i = 1; i < argc; i++) {
+    auto string = [&]() -> std::string {
+      if (++i == argc) {
+        printUsage();
+        std::exit(1);
+      }
+      return argv[i];
+    };
+    auto number = [&]() -> std::size_t {
+      return std::stoull(string());
+    };
+
+    if (strcmp(argv[i], "--dylibs") == 0) {
+      options.dylibs = number();
+    } else if (strcmp(argv[i], "--lazy") == 0) {
+      options.lazyBinds = number();
+    } else if (strcmp(argv[i], "--non-lazy") == 0) {
+      options.nonLazyBinds = number();
+    } else if (strcmp(argv[i], "--weak") == 0) {
+      options.weakBinds = number();
+    } else if (strcmp(argv[i], "--padding") == 0) {
+      options.padding = number();
+    } else if (strcmp(argv[i], "--uleb") == 0) {
+      options.ulebOrdinals = true;
+    } else if (strcmp(argv[i], "--name-length") == 0) {
+      options.nameLength = number();
+    } else if (strcmp(argv[i], "--chained") == 0) {
+      options.chainedFormat = number();
+    } else if (strcmp(argv[i], "--fat") == 0) {
+      fat = true;
+    } else if (strcmp(argv[i], "--fat64") == 0) {
+      fat = fat64 = true;
+    } else if (strcmp(argv[i], "--32") == 0) {
+      is32Bit = true;
+    } else if (strcmp(argv[i], "--exports") == 0) {
+      dylibOptions.exports = splitList(string());
+      dylib = true;
+    } else if (strcmp(argv[i], "--install-name") == 0) {
+      dylibOptions.installName = string();
+    } else if (strcmp(argv[i], "--dyld-info") == 0) {
+      dylibOptions.dyldInfo = true;
+    } else if (output.empty()) {
+      output = argv[i];
+    } else {
+      printUsage();
+      return 1;
+    }
+  }
+
+  if (output.empty()) {
+    printUsage();
+    return 1;
+  }
+
+  // The second slice of fat files.
+  std::int32_t armType = CPU_TYPE_ARM64;
+  std::int32_t armSubtype = CPU_SUBTYPE_ARM64_ALL;
+  if (is32Bit) {
+    options.cputype = dylibOptions.cputype = CPU_TYPE_I386;
+    options.cpusubtype = dylibOptions.cpusubtype = CPU_SUBTYPE_X86_ALL;
+    armType = CPU_TYPE_ARM;
+    armSubtype = CPU_SUBTYPE_ARM_V7;
+  }
+
+  try {
+    std::vector<std::uint8_t> file;
+    if (dylib && fat) {
+      auto arm = dylibOptions;
+      arm.cputype = armType;
+      arm.cpusubtype = armSubtype;
+      file = weedless::fixtures::generateFat(
+          {weedless::fixtures::generateDylib(dylibOptions), weedless::fixtures::generateDylib(arm)}, fat64);
+    } else if (dylib) {
+      file = weedless::fixtures::generateDylib(dylibOptions);
+    } else if (fat) {
+      auto arm = options;
+      arm.cputype = armType;
+      arm.cpusubtype = armSubtype;
+      file = weedless::fixtures::generateFat(
+          {weedless::fixtures::generateMachO(options), weedless::fixtures::generateMachO(arm)}, fat64);
+    } else {
+      file = weedless::fixtures::generateMachO(options);
+    }
+
+    std::ofstream stream(output, std::ios::binary);
+    stream.write((const char*)file.data(), file.size());
+    if (!stream) {
+      throw std::runtime_error("Unable to write " + output);
+    }
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,665 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "fixtures.h"
+
+// c
+#include <cstring>
+
+// stl
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+
+// weedless
+#include "loadcommands.h"
+#include "machodefs.h"
+
+namespace weedless::fixtures {
+namespace {
+
+constexpr std::size_t kPageSize = 0x1000;
+
+// Where images are loaded, 64-bit ones above 4G like ld64 does.
+template <typename Layout>
+constexpr std::uint64_t kBaseAddress = Layout::kPointerSize == 8 ? 0x100000000ull : 0x1000;
+
+std::size_t alignUp(std::size_t value, std::size_t alignment)
+{
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+void appendUleb(std::vector<std::uint8_t>& out, std::uint64_t value)
+{
+  do {
+    std::uint8_t byte = value & 0x7f;
+    value >>= 7;
+    if (value) {
+      byte |= 0x80;
+    }
+    out.push_back(byte);
+  } while (value);
+}
+
+void appendString(std::vector<std::uint8_t>& out, const std::string& string)
+{
+  out.insert(out.end(), string.begin(), string.end());
+  out.push_back(0);
+}
+
+// Names stay unique as the padding follows the index.
+std::string padName(std::string name, std::size_t nameLength)
+{
+  if (name.size() < nameLength) {
+    name += '_';
+  }
+  for (char c = 'a'; name.size() < nameLength; c = c == 'z' ? 'a' : c + 1) {
+    name += c;
+  }
+  return name;
+}
+
+template <typename T>
+void appendRaw(std::vector<std::uint8_t>& out, const T& value)
+{
+  const auto* bytes = (const std::uint8_t*)&value;
+  out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+void appendBigEndian32(std::vector<std::uint8_t>& out, std::uint32_t value)
+{
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    out.push_back(value >> shift);
+  }
+}
+
+void appendBigEndian64(std::vector<std::uint8_t>& out, std::uint64_t value)
+{
+  appendBigEndian32(out, value >> 32);
+  appendBigEndian32(out, (std::uint32_t)value);
+}
+
+void appendOrdinal(std::vector<std::uint8_t>& out, std::uint64_t ordinal, bool uleb)
+{
+  if (!uleb && ordinal <= BIND_IMMEDIATE_MASK) {
+    out.push_back(BIND_OPCODE_SET_DYLIB_ORDINAL_IMM | ordinal);
+  } else {
+    out.push_back(BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB);
+    appendUleb(out, ordinal);
+  }
+}
+
+void padTo8(std::vector<std::uint8_t>& out)
+{
+  out.resize(alignUp(out.size(), 8));
+}
+
+bool is64Bit(std::int32_t cputype)
+{
+  return cputype & CPU_ARCH_ABI64;
+}
+
+std::size_t getOrdinal(const FixtureOptions& options, std::size_t index)
+{
+  return index % options.dylibs + 1;
+}
+
+// Regular binds grouped by dylib, sharing one ordinal opcode per group
+// like ld64 emits them.
+template <typename Layout>
+std::vector<std::uint8_t> makeBindStream(const FixtureOptions& options)
+{
+  std::vector<std::uint8_t> stream;
+  if (!options.nonLazyBinds) {
+    return stream;
+  }
+
+  stream.push_back(BIND_OPCODE_SET_TYPE_IMM | BIND_TYPE_POINTER);
+  for (std::size_t ordinal = 1; ordinal <= std::min(options.dylibs, options.nonLazyBinds); ordinal++) {
+    appendOrdinal(stream, ordinal, options.ulebOrdinals);
+    for (std::size_t index = ordinal - 1; index < options.nonLazyBinds; index += options.dylibs) {
+      stream.push_back(BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM);
+      appendString(stream, getNonLazyName(index, options.nameLength));
+      stream.push_back(BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB | 1);
+      appendUleb(stream, Layout::kPointerSize * (options.lazyBinds + index));
+      stream.push_back(BIND_OPCODE_DO_BIND);
+    }
+  }
+  stream.push_back(BIND_OPCODE_DONE);
+  return stream;
+}
+
+template <typename Layout>
+std::vector<std::uint8_t> makeWeakBindStream(const FixtureOptions& options)
+{
+  std::vector<std::uint8_t> stream;
+  if (!options.weakBinds) {
+    return stream;
+  }
+
+  for (std::size_t index = 0; index < options.weakBinds; index++) {
+    stream.push_back(BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM);
+    appendString(stream, getWeakName(index, options.nameLength));
+    stream.push_back(BIND_OPCODE_SET_TYPE_IMM | BIND_TYPE_POINTER);
+    stream.push_back(BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB | 1);
+    appendUleb(stream, Layout::kPointerSize * (options.lazyBinds + options.nonLazyBinds + index));
+    stream.push_back(BIND_OPCODE_DO_BIND);
+  }
+  stream.push_back(BIND_OPCODE_DONE);
+  return stream;
+}
+
+// One self-contained record per lazy bind, each ending in DONE.
+template <typename Layout>
+std::vector<std::uint8_t> makeLazyBindStream(const FixtureOptions& options)
+{
+  std::vector<std::uint8_t> stream;
+  for (std::size_t index = 0; index < options.lazyBinds; index++) {
+    stream.push_back(BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB | 1);
+    appendUleb(stream, Layout::kPointerSize * index);
+    appendOrdinal(stream, getOrdinal(options, index), options.ulebOrdinals);
+    stream.push_back(BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM);
+    appendString(stream, getLazyName(index, options.nameLength));
+    stream.push_back(BIND_OPCODE_DO_BIND);
+    stream.push_back(BIND_OPCODE_DONE);
+  }
+  return stream;
+}
+
+template <typename Import>
+void appendChainedImport(
+    std::vector<std::uint8_t>& imports, 
+    std::size_t ordinal, 
+    std::size_t nameOffset)
+{
+  Import import{};
+  import.lib_ordinal = ordinal;
+  import.name_offset = nameOffset;
+  appendRaw(imports, import);
+}
+
+// Imports table without any chains, which is all weedless looks at.
+std::vector<std::uint8_t> makeChainedFixups(const FixtureOptions& options)
+{
+  std::vector<std::uint8_t> imports;
+  std::vector<std::uint8_t> symbols{0};
+  const auto count = options.lazyBinds + options.nonLazyBinds;
+  for (std::size_t index = 0; index < count; index++) {
+    const bool lazy = index < options.lazyBinds;
+    const auto ordinal = getOrdinal(options, lazy ? index : index - options.lazyBinds);
+    switch (options.chainedFormat) {
+      case DYLD_CHAINED_IMPORT:
+        appendChainedImport<struct dyld_chained_import>(imports, ordinal, symbols.size());
+        break;
+      case DYLD_CHAINED_IMPORT_ADDEND:
+        appendChainedImport<struct dyld_chained_import_addend>(imports, ordinal, symbols.size());
+        break;
+      case DYLD_CHAINED_IMPORT_ADDEND64:
+        appendChainedImport<struct dyld_chained_import_addend64>(imports, ordinal, symbols.size());
+        break;
+      default:
+        throw std::runtime_error("Unknown chained imports format.");
+    }
+    appendString(symbols, lazy 
+      ? getLazyName(index, options.nameLength) 
+      : getNonLazyName(index - options.lazyBinds, options.nameLength));
+  }
+
+  struct dyld_chained_fixups_header header{};
+  header.starts_offset = sizeof(header);
+  // An empty dyld_chained_starts_in_image (no segments).
+  header.imports_offset = sizeof(header) + 8;
+  header.symbols_offset = header.imports_offset + imports.size();
+  header.imports_count = count;
+  header.imports_format = options.chainedFormat;
+
+  std::vector<std::uint8_t> fixups;
+  appendRaw(fixups, header);
+  fixups.resize(header.imports_offset);
+  fixups.insert(fixups.end(), imports.begin(), imports.end());
+  fixups.insert(fixups.end(), symbols.begin(), symbols.end());
+  padTo8(fixups);
+  return fixups;
+}
+
+struct TrieNode
+{
+  bool terminal = false;
+  std::vector<std::pair<std::string, std::unique_ptr<TrieNode>>> children;
+  std::size_t offset = 0;
+};
+
+// The node for the sorted `names` in [begin, end), which all share their
+// first `depth` characters.
+std::unique_ptr<TrieNode> makeTrieNode(
+    const std::vector<std::string>& names, 
+    std::size_t begin, 
+    std::size_t end, 
+    std::size_t depth)
+{
+  auto node = std::make_unique<TrieNode>();
+  if (begin < end && names[begin].size() == depth) {
+    node->terminal = true;
+    begin++;
+  }
+  while (begin < end) {
+    auto groupEnd = begin + 1;
+    while (groupEnd < end && names[groupEnd][depth] == names[begin][depth]) {
+      groupEnd++;
+    }
+    // Sorted, so the first and last name bound the group's common prefix.
+    const auto& first = names[begin];
+    const auto& last = names[groupEnd - 1];
+    auto prefix = depth + 1;
+    while (prefix < first.size() && prefix < last.size() && first[prefix] == last[prefix]) {
+      prefix++;
+    }
+    node->children.emplace_back(
+        first.substr(depth, prefix - depth), makeTrieNode(names, begin, groupEnd, prefix));
+    begin = groupEnd;
+  }
+  return node;
+}
+
+// Child offsets are padded to a fixed size, so nodes can be laid out
+// before their offsets are known.
+constexpr std::uint32_t kTrieOffsetSize = 4;
+
+void appendTrieNode(const TrieNode& node, std::vector<std::uint8_t>& out, std::uint64_t address)
+{
+  if (node.terminal) {
+    std::vector<std::uint8_t> info;
+    appendUleb(info, EXPORT_SYMBOL_FLAGS_KIND_REGULAR);
+    appendUleb(info, address);
+    appendUleb(out, info.size());
+    out.insert(out.end(), info.begin(), info.end());
+  } else {
+    out.push_back(0);
+  }
+  out.push_back(node.children.size());
+  for (const auto& child: node.children) {
+    appendString(out, child.first);
+    for (std::uint32_t index = 0; index < kTrieOffsetSize; index++) {
+      const std::uint8_t byte = (child.second->offset >> (7 * index)) & 0x7f;
+      out.push_back(index + 1 == kTrieOffsetSize ? byte : byte | 0x80);
+    }
+  }
+}
+
+void layOutTrie(TrieNode& node, std::size_t& offset, std::uint64_t address)
+{
+  std::vector<std::uint8_t> bytes;
+  appendTrieNode(node, bytes, address);
+  node.offset = offset;
+  offset += bytes.size();
+  for (auto& child: node.children) {
+    layOutTrie(*child.second, offset, address);
+  }
+}
+
+void writeTrie(const TrieNode& node, std::vector<std::uint8_t>& out, std::uint64_t address)
+{
+  appendTrieNode(node, out, address);
+  for (const auto& child: node.children) {
+    writeTrie(*child.second, out, address);
+  }
+}
+
+// Every export points at the start of __TEXT, weedless only looks at the
+// names.
+std::vector<std::uint8_t> makeExportTrie(std::vector<std::string> names)
+{
+  constexpr std::uint64_t kAddress = 0x1000;
+  std::sort(names.begin(), names.end());
+  names.erase(std::unique(names.begin(), names.end()), names.end());
+  if (std::find(names.begin(), names.end(), std::string()) != names.end()) {
+    throw std::runtime_error("Exports need a name.");
+  }
+
+  std::vector<std::uint8_t> trie;
+  if (names.empty()) {
+    return trie;
+  }
+  auto root = makeTrieNode(names, 0, names.size(), 0);
+  std::size_t size = 0;
+  layOutTrie(*root, size, kAddress);
+  writeTrie(*root, trie, kAddress);
+  padTo8(trie);
+  return trie;
+}
+
+// Load commands are padded to the pointer size of `Layout`.
+template <typename Layout>
+class CommandWriter
+{
+public:
+  template <typename Command>
+  void add(const Command& command, const std::string& string = {})
+  {
+    const auto start = bytes.size();
+    appendRaw(bytes, command);
+    if (!string.empty()) {
+      appendString(bytes, string);
+    }
+    bytes.resize(alignUp(bytes.size(), Layout::kPointerSize));
+    ((struct load_command*)(bytes.data() + start))->cmdsize = bytes.size() - start;
+    count++;
+  }
+
+  const std::vector<std::uint8_t>& getBytes() const { return bytes; }
+  std::uint32_t getCount() const { return count; }
+
+private:
+  std::vector<std::uint8_t> bytes;
+  std::uint32_t count = 0;
+};
+
+template <typename Layout>
+typename Layout::Segment makeSegment(const char* name, std::uint64_t offset, std::uint64_t size)
+{
+  typename Layout::Segment segment{};
+  segment.cmd = Layout::kSegmentCommand;
+  strncpy(segment.segname, name, sizeof(segment.segname));
+  segment.vmaddr = kBaseAddress<Layout> + offset;
+  segment.vmsize = alignUp(size, kPageSize);
+  segment.fileoff = offset;
+  segment.filesize = size;
+  return segment;
+}
+
+// The executable of generateMachO, with the layout of its cputype.
+template <typename Layout>
+std::vector<std::uint8_t> generateImage(const FixtureOptions& options)
+{
+  if (options.dylibs == 0) {
+    throw std::runtime_error("Fixtures need at least one dylib.");
+  }
+  if (options.chainedFormat && options.weakBinds) {
+    throw std::runtime_error("Weak binds can't be combined with chained fixups.");
+  }
+
+  std::vector<std::uint8_t> bindStream, weakBindStream, lazyBindStream, chainedFixups;
+  if (options.chainedFormat) {
+    chainedFixups = makeChainedFixups(options);
+  } else {
+    bindStream = makeBindStream<Layout>(options);
+    weakBindStream = makeWeakBindStream<Layout>(options);
+    lazyBindStream = makeLazyBindStream<Layout>(options);
+    padTo8(bindStream);
+    padTo8(weakBindStream);
+    padTo8(lazyBindStream);
+  }
+
+  std::vector<std::uint8_t> symbols;
+  std::vector<std::uint8_t> strings{' ', 0};
+  std::uint32_t symbolCount = 0;
+  auto addUndefinedSymbol = [&](const std::string& name) {
+    typename Layout::Symbol symbol{};
+    symbol.n_un.n_strx = strings.size();
+    symbol.n_type = N_UNDF | N_EXT;
+    appendString(strings, name);
+    appendRaw(symbols, symbol);
+    symbolCount++;
+  };
+  for (std::size_t index = 0; index < options.lazyBinds; index++) {
+    addUndefinedSymbol(getLazyName(index, options.nameLength));
+  }
+  for (std::size_t index = 0; index < options.nonLazyBinds; index++) {
+    addUndefinedSymbol(getNonLazyName(index, options.nameLength));
+  }
+  for (std::size_t index = 0; index < options.weakBinds; index++) {
+    addUndefinedSymbol(getWeakName(index, options.nameLength));
+  }
+  padTo8(strings);
+
+  // The load commands have a fixed size, so lay out the file with a dry run.
+  auto buildCommands = [&](std::size_t textSize, std::size_t dataSize, std::size_t linkeditSize) {
+    const auto linkeditOffset = textSize + dataSize;
+    const auto bindOffset = linkeditOffset;
+    const auto weakBindOffset = bindOffset + bindStream.size();
+    const auto lazyBindOffset = weakBindOffset + weakBindStream.size();
+    const auto fixupsOffset = lazyBindOffset + lazyBindStream.size();
+    const auto symbolsOffset = fixupsOffset + chainedFixups.size();
+    const auto stringsOffset = symbolsOffset + symbols.size();
+
+    CommandWriter<Layout> commands;
+    commands.add(makeSegment<Layout>(SEG_TEXT, 0, textSize));
+    commands.add(makeSegment<Layout>("__DATA", textSize, dataSize));
+    commands.add(makeSegment<Layout>(SEG_LINKEDIT, linkeditOffset, linkeditSize));
+
+    if (options.chainedFormat) {
+      struct linkedit_data_command fixups{};
+      fixups.cmd = LC_DYLD_CHAINED_FIXUPS;
+      fixups.dataoff = fixupsOffset;
+      fixups.datasize = chainedFixups.size();
+      commands.add(fixups);
+    } else {
+      struct dyld_info_command dyldInfo{};
+      dyldInfo.cmd = LC_DYLD_INFO_ONLY;
+      if (!bindStream.empty()) {
+        dyldInfo.bind_off = bindOffset;
+        dyldInfo.bind_size = bindStream.size();
+      }
+      if (!weakBindStream.empty()) {
+        dyldInfo.weak_bind_off = weakBindOffset;
+        dyldInfo.weak_bind_size = weakBindStream.size();
+      }
+      if (!lazyBindStream.empty()) {
+        dyldInfo.lazy_bind_off = lazyBindOffset;
+        dyldInfo.lazy_bind_size = lazyBindStream.size();
+      }
+      commands.add(dyldInfo);
+    }
+
+    struct symtab_command symtab{};
+    symtab.cmd = LC_SYMTAB;
+    symtab.symoff = symbolsOffset;
+    symtab.nsyms = symbolCount;
+    symtab.stroff = stringsOffset;
+    symtab.strsize = strings.size();
+    commands.add(symtab);
+
+    struct dysymtab_command dysymtab{};
+    dysymtab.cmd = LC_DYSYMTAB;
+    dysymtab.nundefsym = symbolCount;
+    commands.add(dysymtab);
+
+    struct dylinker_command dylinker{};
+    dylinker.cmd = LC_LOAD_DYLINKER;
+    dylinker.name.offset = sizeof(dylinker);
+    commands.add(dylinker, "/usr/lib/dyld");
+
+    for (std::size_t ordinal = 1; ordinal <= options.dylibs; ordinal++) {
+      struct dylib_command dylib{};
+      dylib.cmd = LC_LOAD_DYLIB;
+      dylib.dylib.name.offset = sizeof(dylib);
+      dylib.dylib.timestamp = 2;
+      dylib.dylib.current_version = 0x10000;
+      dylib.dylib.compatibility_version = 0x10000;
+      commands.add(dylib, getDylibName(ordinal));
+    }
+    return commands;
+  };
+
+  const auto commandsSize = buildCommands(0, 0, 0).getBytes().size();
+  const auto textSize = alignUp(sizeof(typename Layout::Header) + commandsSize + options.padding, kPageSize);
+  const auto pointerCount = options.lazyBinds + options.nonLazyBinds + options.weakBinds;
+  const auto dataSize = alignUp(std::max<std::size_t>(pointerCount * Layout::kPointerSize, 8), kPageSize);
+  const auto linkeditSize = bindStream.size() + weakBindStream.size() + lazyBindStream.size() + 
+                            chainedFixups.size() + symbols.size() + strings.size();
+  const auto commands = buildCommands(textSize, dataSize, linkeditSize);
+
+  typename Layout::Header header{};
+  header.magic = Layout::kMagic;
+  header.cputype = options.cputype;
+  header.cpusubtype = options.cpusubtype;
+  header.filetype = MH_EXECUTE;
+  header.ncmds = commands.getCount();
+  header.sizeofcmds = commands.getBytes().size();
+  header.flags = MH_PIE;
+
+  std::vector<std::uint8_t> image;
+  image.reserve(textSize + dataSize + linkeditSize);
+  appendRaw(image, header);
+  image.insert(image.end(), commands.getBytes().begin(), commands.getBytes().end());
+  image.resize(textSize + dataSize);
+  for (const auto* part: {&bindStream, &weakBindStream, &lazyBindStream, &chainedFixups, &symbols, &strings}) {
+    image.insert(image.end(), part->begin(), part->end());
+  }
+  return image;
+}
+
+// The dylib of generateDylib, with the layout of its cputype.
+template <typename Layout>
+std::vector<std::uint8_t> generateDylibImage(const DylibOptions& options)
+{
+  const auto trie = makeExportTrie(options.exports);
+
+  auto buildCommands = [&](std::size_t textSize) {
+    CommandWriter<Layout> commands;
+    commands.add(makeSegment<Layout>(SEG_TEXT, 0, textSize));
+    commands.add(makeSegment<Layout>(SEG_LINKEDIT, textSize, trie.size()));
+
+    struct dylib_command id{};
+    id.cmd = LC_ID_DYLIB;
+    id.dylib.name.offset = sizeof(id);
+    id.dylib.timestamp = 2;
+    id.dylib.current_version = 0x10000;
+    id.dylib.compatibility_version = 0x10000;
+    commands.add(id, options.installName);
+
+    if (options.dyldInfo) {
+      struct dyld_info_command dyldInfo{};
+      dyldInfo.cmd = LC_DYLD_INFO_ONLY;
+      dyldInfo.export_off = trie.empty() ? 0 : textSize;
+      dyldInfo.export_size = trie.size();
+      commands.add(dyldInfo);
+    } else {
+      struct linkedit_data_command exportsTrie{};
+      exportsTrie.cmd = LC_DYLD_EXPORTS_TRIE;
+      exportsTrie.dataoff = trie.empty() ? 0 : textSize;
+      exportsTrie.datasize = trie.size();
+      commands.add(exportsTrie);
+    }
+    return commands;
+  };
+
+  const auto commandsSize = buildCommands(0).getBytes().size();
+  const auto textSize = alignUp(sizeof(typename Layout::Header) + commandsSize, kPageSize);
+  const auto commands = buildCommands(textSize);
+
+  typename Layout::Header header{};
+  header.magic = Layout::kMagic;
+  header.cputype = options.cputype;
+  header.cpusubtype = options.cpusubtype;
+  header.filetype = MH_DYLIB;
+  header.ncmds = commands.getCount();
+  header.sizeofcmds = commands.getBytes().size();
+
+  std::vector<std::uint8_t> image;
+  appendRaw(image, header);
+  image.insert(image.end(), commands.getBytes().begin(), commands.getBytes().end());
+  image.resize(textSize);
+  image.insert(image.end(), trie.begin(), trie.end());
+  return image;
+}
+}
+
+FixtureOptions::FixtureOptions()
+  : cputype(CPU_TYPE_X86_64), cpusubtype(CPU_SUBTYPE_X86_64_ALL)
+{
+}
+
+DylibOptions::DylibOptions()
+  : cputype(CPU_TYPE_X86_64), cpusubtype(CPU_SUBTYPE_X86_64_ALL)
+{
+}
+
+std::string getLazyName(std::size_t index, std::size_t nameLength)
+{
+  return padName("_lazy" + std::to_string(index), nameLength);
+}
+
+std::string getNonLazyName(std::size_t index, std::size_t nameLength)
+{
+  return padName("_got" + std::to_string(index), nameLength);
+}
+
+std::string getWeakName(std::size_t index, std::size_t nameLength)
+{
+  return padName("_weak" + std::to_string(index), nameLength);
+}
+
+std::string getDylibName(std::size_t ordinal)
+{
+  return "/usr/lib/libdep" + std::to_string(ordinal) + ".dylib";
+}
+
+std::vector<std::uint8_t> generateMachO(const FixtureOptions& options)
+{
+  return is64Bit(options.cputype) ? generateImage<MachO64>(options) : generateImage<MachO32>(options);
+}
+
+std::vector<std::uint8_t> generateDylib(const DylibOptions& options)
+{
+  return is64Bit(options.cputype) ? generateDylibImage<MachO64>(options) : generateDylibImage<MachO32>(options);
+}
+
+std::vector<std::uint8_t> generateFat(
+    const std::vector<std::vector<std::uint8_t>>& slices, 
+    bool fat64)
+{
+  constexpr std::size_t kSliceAlignment = 0x4000;
+
+  std::vector<std::uint8_t> file;
+  appendBigEndian32(file, fat64 ? FAT_MAGIC_64 : FAT_MAGIC);
+  appendBigEndian32(file, slices.size());
+
+  std::vector<std::size_t> offsets;
+  std::size_t offset = kSliceAlignment;
+  for (const auto& slice: slices) {
+    // Both layouts start alike.
+    const auto* header = (const struct mach_header*)slice.data();
+    offsets.push_back(offset);
+    appendBigEndian32(file, header->cputype);
+    appendBigEndian32(file, header->cpusubtype);
+    if (fat64) {
+      appendBigEndian64(file, offset);
+      appendBigEndian64(file, slice.size());
+      appendBigEndian32(file, 14);
+      appendBigEndian32(file, 0);
+    } else {
+      appendBigEndian32(file, offset);
+      appendBigEndian32(file, slice.size());
+      appendBigEndian32(file, 14);
+    }
+    offset = alignUp(offset + slice.size(), kSliceAlignment);
+  }
+
+  for (std::size_t index = 0; index < slices.size(); index++) {
+    file.resize(offsets[index]);
+    file.insert(file.end(), slices[index].begin(), slices[index].end());
+  }
+  return file;
+}
+}
@@ -0,0 +1,96 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+// stl
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace weedless::fixtures {
+
+struct FixtureOptions
+{
+  // Number of dylibs the image links against.
+  std::size_t dylibs = 3;
+  // Imports bound through the lazy, regular and weak bind streams. Lazy
+  // and regular imports are spread over the dylibs round robin.
+  std::size_t lazyBinds = 4;
+  std::size_t nonLazyBinds = 4;
+  std::size_t weakBinds = 0;
+  // Free space behind the load commands.
+  std::size_t padding = 0x400;
+  // Encode every ordinal as ULEB, even those that fit in an immediate.
+  bool ulebOrdinals = false;
+  // Pad symbol names to at least this many characters, like the long
+  // mangled names of C++ and Swift.
+  std::size_t nameLength = 0;
+  // Import through LC_DYLD_CHAINED_FIXUPS with this imports format
+  // (DYLD_CHAINED_IMPORT*) instead of bind opcodes. Weak binds are not
+  // supported there.
+  std::uint32_t chainedFormat = 0;
+  std::int32_t cputype;
+  std::int32_t cpusubtype;
+
+  FixtureOptions();
+};
+
+// Symbol names of the generated imports.
+std::string getLazyName(std::size_t index, std::size_t nameLength = 0);
+std::string getNonLazyName(std::size_t index, std::size_t nameLength = 0);
+std::string getWeakName(std::size_t index, std::size_t nameLength = 0);
+
+struct DylibOptions
+{
+  // Symbols the dylib exports.
+  std::vector<std::string> exports;
+  std::string installName = "@executable_path/libhooks.dylib";
+  // Store the export trie in LC_DYLD_INFO_ONLY, like older linkers, instead
+  // of LC_DYLD_EXPORTS_TRIE.
+  bool dyldInfo = false;
+  std::int32_t cputype;
+  std::int32_t cpusubtype;
+
+  DylibOptions();
+};
+
+// Install name of the (1-based) dylib ordinal.
+std::string getDylibName(std::size_t ordinal);
+
+// Builds a minimal but well-formed executable, 64-bit or 32-bit as its
+// cputype is: __TEXT, __DATA and __LINKEDIT segments, LC_DYLD_INFO_ONLY
+// (or LC_DYLD_CHAINED_FIXUPS), a symbol table with one undefined symbol
+// per import, and a pointer in __DATA for every bind.
+std::vector<std::uint8_t> generateMachO(const FixtureOptions& options);
+
+// Builds a minimal dylib, 64-bit or 32-bit as its cputype is: __TEXT and
+// __LINKEDIT segments, LC_ID_DYLIB and an export trie with every export.
+std::vector<std::uint8_t> generateDylib(const DylibOptions& options);
+
+// Wraps thin images in a universal binary, slices 16K aligned.
+std::vector<std::uint8_t> generateFat(
+    const std::vector<std::vector<std::uint8_t>>& slices, 
+    bool fat64 = false);
+}
@@ -0,0 +1,85 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+// stl
+#include <cstddef>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// weedless
+#include "macho.h"
+
+namespace weedless {
+
+  namespace config {
+    struct Config;
+  };
+
+  class WarmState;
+
+  struct BatchOptions {
+    // Maximum number of threads.
+    std::size_t jobs = 1;
+    // Only check which targets are up to date, without writing anything.
+    bool check = false;
+    // When set, patched targets are written to this directory instead of
+    // being patched in place.
+    std::filesystem::path outputDirectory;
+    IoBackend io = IoBackend::Mmap;
+    // Record in-place patches in undo journals next to their targets, so
+    // unpatch can revert them.
+    bool journal = false;
+    // Hardlink dylibs into place instead of cloning them.
+    bool hardlink = false;
+    // Shared between batches that run concurrently (in the server), to
+    // reuse what earlier batches found and to serialize writes per path.
+    WarmState* warm = nullptr;
+  };
+
+  struct TargetResult {
+    std::filesystem::path target;
+    // Where the patched target is written, the target itself by default.
+    std::filesystem::path output;
+    // Empty when the target was patched successfully.
+    std::string error;
+    // Whether the target or one of its dylibs was (or, when checking,
+    // would be) written.
+    bool changed = false;
+    // Bytes read and written by the pread backend.
+    IoStats io;
+
+    bool ok() const { return error.empty(); }
+  };
+
+  // Installs the dylibs and patches every target of every config. A
+  // failing target doesn't stop the others.
+  std::vector<TargetResult> patchTargets(
+      const std::vector<config::Config>& configs,
+      const BatchOptions& options);
+  std::vector<TargetResult> patchTargets(
+      const std::vector<const config::Config*>& configs,
+      const BatchOptions& options);
+}
@@ -0,0 +1,88 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+// stl
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+struct dyld_info_command;
+
+namespace weedless {
+
+enum class BindStream : std::uint8_t { Bind, WeakBind, LazyBind };
+
+// A symbol bound through one of the dyld info opcode streams. Offsets are
+// relative to the mach header of the image.
+struct BindingInfo
+{
+  // Where the symbol is bound first.
+  std::uint64_t segmentOffset;
+  // NUL-terminated symbol name.
+  std::uint32_t symbolOffset;
+  // SET_DYLIB_* opcode in effect for the symbol, 0 when there is none
+  // (weak binds are looked up by name only).
+  std::uint32_t ordinalOffset;
+  // First DO_BIND* opcode for the symbol.
+  std::uint32_t bindOffset;
+  // Ordinal in effect, special ordinals are negative.
+  std::int32_t dylibIndex;
+  // Size of the ordinal opcode including its ULEB.
+  std::uint8_t ordinalSize;
+  std::uint8_t segmentIndex;
+  std::uint8_t symbolFlags;
+  BindStream stream;
+};
+
+// Maps symbol names to the ordinal they should be bound from.
+using SymbolOrdinals = std::unordered_map<std::string_view, std::size_t>;
+
+// Decodes the bind, weak bind and lazy bind streams of an image in one go.
+// Instantiated for MachO64 and MachO32 (see loadcommands.h), which differ
+// in how far binds advance.
+template <typename Layout>
+std::vector<BindingInfo> getBindingInfo(
+    const std::uint8_t* machHeader, 
+    std::size_t machOSize,
+    const struct dyld_info_command& dyldInfo);
+
+inline const char* getSymbolName(const std::uint8_t* machHeader, const BindingInfo& info)
+{
+  return (const char*)machHeader + info.symbolOffset;
+}
+
+// Points every binding of a hooked symbol to its new ordinal. Bindings
+// are patched in place where the opcodes allow it. Otherwise the bind
+// stream is re-encoded and returned; the caller has to store it in place
+// of the old one (which is left untouched).
+std::optional<std::vector<std::uint8_t>> rebindSymbols(
+    std::uint8_t* machHeader,
+    const struct dyld_info_command& dyldInfo,
+    const std::vector<BindingInfo>& bindingInfos,
+    const SymbolOrdinals& hookOrdinals);
+}
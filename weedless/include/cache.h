@@ -0,0 +1,54 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+// stl
+#include <filesystem>
+#include <optional>
+
+// weedless
+#include "index.h"
+
+namespace weedless {
+
+// Keeps image indexes in a directory, one file per binary. An entry is
+// named after the hash of the binary's path and is only used while the
+// binary's size, mtime and inode still match the ones it was built from.
+class IndexCache
+{
+public:
+  explicit IndexCache(std::filesystem::path directory);
+
+  // Returns the cached index of `target`, indexing (and caching) it on a miss.
+  ImageIndex get(const std::filesystem::path& target) const;
+
+  std::optional<ImageIndex> lookup(const std::filesystem::path& target) const;
+  void store(const std::filesystem::path& target, const ImageIndex& index) const;
+
+private:
+  std::filesystem::path getEntryPath(const std::filesystem::path& target) const;
+
+  std::filesystem::path directory;
+};
+}
@@ -0,0 +1,108 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+// stl
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// weedless
+#include "hash.h"
+#include "loadcommands.h"
+
+namespace weedless {
+
+// Removes LC_CODE_SIGNATURE from a thin image and zeroes the signature,
+// which stays behind as padding at the end of __LINKEDIT. Returns false
+// when the image wasn't signed. `Header` is mach_header_64 or mach_header.
+template <typename Header>
+bool stripCodeSignature(Header& machHeader, std::size_t machoSize);
+
+// Appends an empty LC_CODE_SIGNATURE behind the load commands, into the
+// zeros between them and the first section.
+template <typename Header>
+struct linkedit_data_command& addCodeSignatureCommand(Header& machHeader, std::size_t machoSize);
+
+// Whether the image has an ad-hoc signature that covers the image up to
+// the signature, and matches every page patching can write.
+template <typename Layout>
+bool isAdHocSigned(const std::uint8_t* image, std::size_t imageSize, const LoadCommands<Layout>& commands);
+
+// Builds ad-hoc signatures the way `codesign -s -` does: a SHA-256 code
+// directory, an empty requirement set and an empty CMS blob. The
+// identifier, entitlements and the hashes of the Info.plist and resources
+// are kept from the previous signature, as are the hashes of the pages
+// patching can't have written.
+class AdHocSigner
+{
+public:
+  // Copies what is kept from the current signature of the image, if any.
+  // `identifier` is used for images that aren't signed yet.
+  template <typename Layout>
+  AdHocSigner(
+      const std::uint8_t* image, 
+      std::size_t imageSize, 
+      const LoadCommands<Layout>& commands, 
+      const std::string& identifier);
+
+  std::uint32_t getPageSize() const { return 1u << pageShift; }
+
+  // Size of the signature of code ending at `codeLimit`.
+  std::size_t getSize(std::uint64_t codeLimit) const;
+
+  // Fills `hashes`, one per page of code ending at `codeLimit`, with the
+  // hashes kept from the previous signature. Returns the pages that have
+  // to be hashed.
+  template <typename Layout>
+  std::vector<std::size_t> reuseHashes(
+      const LoadCommands<Layout>& commands, 
+      std::uint64_t codeLimit, 
+      std::vector<Sha256>& hashes) const;
+
+  // Writes the signature of code ending at `codeLimit`, getSize bytes.
+  void write(std::uint8_t* out, std::uint64_t codeLimit, const std::vector<Sha256>& hashes) const;
+
+private:
+  std::uint32_t getSpecialSlotCount() const;
+
+  struct Blob
+  {
+    std::uint32_t slot;
+    std::vector<std::uint8_t> bytes;
+  };
+
+  std::string identifier;
+  std::uint8_t pageShift = 12;
+  std::uint64_t execSegBase = 0;
+  std::uint64_t execSegLimit = 0;
+  std::uint64_t execSegFlags = 0;
+  // Entitlements, in slot order.
+  std::vector<Blob> blobs;
+  // Hashes of the files outside of the binary, by special slot.
+  std::vector<std::pair<std::uint32_t, Sha256>> fileHashes;
+  std::uint64_t previousCodeLimit = 0;
+  std::vector<Sha256> previousHashes;
+};
+}
@@ -22,48 +22,124 @@
 
 #pragma once
 
-#include <algorithm>
+#include <cstdint>
 #include <filesystem>
-#include <vector>
 #include <string>
+#include <string_view>
+#include <vector>
+
+#include "patterns.h"
 
 namespace weedless::config 
 
 {
+  // Stores every distinct string once, back to back, and hands out dense
+  // ids for them. Views stay valid until the next add.
+  class StringTable {
+  public:
+    std::uint32_t add(std::string_view string);
+    // The id of `string`, or `npos` when it was never added.
+    std::uint32_t find(std::string_view string) const;
+
+    std::string_view get(std::uint32_t id) const 
+    {
+      return std::string_view(data).substr(offsets[id], offsets[id + 1] - offsets[id]);
+    }
+
+    std::size_t size() const { return offsets.size() - 1; }
+
+    static constexpr std::uint32_t npos = UINT32_MAX;
+
+  private:
+    std::size_t findSlot(std::string_view string, std::size_t hash) const;
+    void rehash(std::size_t slotCount);
+
+    std::string data;
+    // Offsets of every string in `data`, plus its end.
+    std::vector<std::uint32_t> offsets {0};
+    // Open addressing table of string ids + 1, 0 marks an empty slot.
+    std::vector<std::uint32_t> slots;
+  };
+
   struct Dylib {
     std::string name; 
     std::filesystem::path path;
     std::string installName;
   };
 
+  // What happens to the code signature of a patched slice.
+  enum class CodeSignature {
+    // Left as is, and no longer valid after patching.
+    Keep,
+    // Removed, for signing with another tool afterwards.
+    Strip,
+    // Replaced by an ad-hoc signature, as `codesign -s -` does.
+    AdHoc,
+  };
+
   struct Hook {
-    std::string symbol;
-    std::string dylibName;
+    // Id of the symbol (or pattern) in `Config::symbols`.
+    std::uint32_t symbol;
+    // Index of the dylib in `Config::dylibs`.
+    std::uint32_t dylib;
+    PatternKind kind = PatternKind::Exact;
   };
 
   struct Config {
     
-    const Dylib* getDylibByName(const std::string& name) const 
+    std::string_view getSymbol(const Hook& hook) const 
     {
-      auto it = 
-        std::find_if(
-            dylibs.cbegin(),
-            dylibs.cend(),
-            [&name](const auto& dylib)
-            {
-              return dylib.name == name;
-            });
-      if (it == dylibs.cend()) {
-        return nullptr;
-      }
-      return &*it;
+      return symbols.get(hook.symbol);
     }
 
+    const Dylib& getDylib(const Hook& hook) const 
+    {
+      return dylibs[hook.dylib];
+    }
+
+    void addHook(std::string_view symbol, std::uint32_t dylib, PatternKind kind = PatternKind::Exact)
+    {
+      hooks.push_back({symbols.add(symbol), dylib, kind});
+    }
+
+    // The hook a symbol matches by pattern, or nullptr. Exact hooks take
+    // precedence over patterns and aren't considered here.
+    const Hook* matchPattern(std::string_view symbol) const 
+    {
+      const auto pattern = patterns.match(symbol);
+      return pattern == SymbolMatcher::npos ? nullptr : &hooks[patternHooks[pattern]];
+    }
+
+    // Compiles the hooks that aren't exact into `patterns`, and adds a
+    // warning for every conflict between them. `read` already does this.
+    void compilePatterns();
+
     std::vector<Dylib> dylibs; 
     std::vector<Hook> hooks; 
-    std::filesystem::path target;
+    StringTable symbols;
+    std::vector<std::filesystem::path> targets;
+    // Directories (e.g. app bundles) whose Mach-Os are patched when they
+    // import a hooked symbol.
+    std::vector<std::filesystem::path> directories;
+    // Architectures (e.g. "x86_64", "arm64") to patch in fat binaries.
+    // All slices are patched when empty.
+    std::vector<std::string> archs;
+    CodeSignature codeSignature = CodeSignature::Keep;
+
+    // Hooks matched by pattern, the later of several matching hooks wins.
+    SymbolMatcher patterns;
+    // Hook index by pattern index.
+    std::vector<std::uint32_t> patternHooks;
+    std::vector<std::string> warnings;
   };
 
-  weedless::config::Config read(const std::filesystem::path& path);
-}
+  // Streams the config in, so memory use only depends on the number of
+  // distinct symbols and not on the size of the document. Relative paths
+  // in the config are relative to `workingDirectory`.
+  weedless::config::Config read(
+      const std::filesystem::path& path,
+      const std::filesystem::path& workingDirectory = std::filesystem::current_path());
 
+  // Parses "keep", "strip" or "adhoc".
+  CodeSignature getCodeSignature(std::string_view name);
+}
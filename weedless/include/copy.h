@@ -0,0 +1,45 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+// stl
+#include <filesystem>
+
+namespace weedless {
+
+enum class CloneMethod { Reflink, CopyRange, Copy };
+
+// Creates `destination` (which must not exist yet) with the contents and
+// permissions of `source`. Shares the data blocks when the filesystem
+// supports it, falls back to an in-kernel copy and then to a plain copy.
+CloneMethod cloneFile(
+    const std::filesystem::path& source, 
+    const std::filesystem::path& destination);
+
+// Flushes a file (or directory entry changes) to disk.
+void syncFile(const std::filesystem::path& path);
+
+// A unique path next to `path`, for writing a file that replaces it.
+std::filesystem::path getTempPath(const std::filesystem::path& path);
+}
@@ -0,0 +1,78 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+// stl
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace weedless {
+
+// A dylib's export trie, read in place. Lookups only follow the path of
+// the symbol and check every offset against the trie, so a malformed
+// trie fails instead of reading past it.
+class ExportTrie
+{
+public:
+  ExportTrie(const std::uint8_t* data, std::size_t size) : data(data), size(size) {}
+
+  bool contains(std::string_view symbol) const;
+
+private:
+  const std::uint8_t* data;
+  std::size_t size;
+};
+
+// The export tries of every slice of a dylib. The tries point into
+// a read-only mapping of the file, kept alive by `owner`.
+class DylibExports
+{
+public:
+  struct Slice
+  {
+    std::int32_t cputype;
+    std::int32_t cpusubtype;
+    ExportTrie trie;
+  };
+
+  DylibExports(std::shared_ptr<const void> owner, std::vector<Slice> slices)
+    : owner(std::move(owner)), slices(std::move(slices)) {}
+
+  const std::vector<Slice>& getSlices() const { return slices; }
+
+  // Names of the architectures in `archs` whose slice doesn't export
+  // `symbol` or that have no slice at all, empty when every one exports
+  // it. All slices are checked when `archs` is empty.
+  std::vector<std::string> findMissing(
+      std::string_view symbol, 
+      const std::vector<std::string>& archs = {}) const;
+
+private:
+  std::shared_ptr<const void> owner;
+  std::vector<Slice> slices;
+};
+}
@@ -0,0 +1,70 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+// stl
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+// weedless
+#include "machodefs.h"
+
+namespace weedless {
+
+// An entry of the LC_DYLD_CHAINED_FIXUPS imports table. It points straight
+// into the mapped binary, so changing the ordinal patches the file.
+class ChainedImport
+{
+public:
+  ChainedImport(std::uint8_t* entry, std::uint32_t format, const char* symbolName)
+    : entry(entry), format(format), symbolName(symbolName) {}
+
+  const char* getSymbolName() const { return symbolName; }
+
+  // Special ordinals (main executable, flat lookup, ...) are negative.
+  int getDylibIndex() const;
+  void setDylibIndex(std::uint64_t index);
+
+private:
+  std::uint8_t* entry;
+  std::uint32_t format;
+  const char* symbolName;
+};
+
+// Calls `fn` for every import in the chained fixups blob (the data an
+// LC_DYLD_CHAINED_FIXUPS command points at), in table order.
+void forEachChainedImport(
+    std::uint8_t* fixups, 
+    std::size_t fixupsSize,
+    const std::function<void(ChainedImport&)>& fn);
+
+// Same for the chained fixups `command` of an image points at, which have
+// to lie within the image.
+void forEachChainedImport(
+    std::uint8_t* image, 
+    std::size_t imageSize,
+    const struct linkedit_data_command& command,
+    const std::function<void(ChainedImport&)>& fn);
+}
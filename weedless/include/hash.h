@@ -0,0 +1,78 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+// stl
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+namespace weedless {
+
+// Streaming 64-bit XXH64 hash.
+class Hasher
+{
+public:
+  explicit Hasher(std::uint64_t seed = 0);
+
+  void update(const void* data, std::size_t size);
+  std::uint64_t digest() const;
+
+private:
+  std::uint64_t state[4];
+  std::uint8_t buffer[32];
+  std::size_t buffered = 0;
+  std::uint64_t total = 0;
+  std::uint64_t seed;
+};
+
+inline std::uint64_t hashBytes(const void* data, std::size_t size, std::uint64_t seed = 0)
+{
+  Hasher hasher(seed);
+  hasher.update(data, size);
+  return hasher.digest();
+}
+
+using Sha256 = std::array<std::uint8_t, 32>;
+
+// SHA-256, as used by code signatures.
+Sha256 sha256(const void* data, std::size_t size);
+
+// Fixed width, lowercase hex representation of a hash.
+std::string toHex(std::uint64_t hash);
+
+// Identifies the contents of a file.
+struct FileDigest
+{
+  std::uint64_t size;
+  std::uint64_t hash;
+
+  bool operator==(const FileDigest& other) const { return size == other.size && hash == other.hash; }
+  bool operator!=(const FileDigest& other) const { return !(*this == other); }
+};
+
+FileDigest digestFile(const std::filesystem::path& path);
+}
@@ -0,0 +1,142 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+// stl
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace weedless {
+
+// Identifies a version of a file on disk without reading it.
+struct FileStamp
+{
+  std::uint64_t size;
+  std::int64_t mtime;
+  std::uint64_t inode;
+  std::uint64_t device;
+
+  static FileStamp of(const std::filesystem::path& path);
+
+  bool operator==(const FileStamp& other) const
+  {
+    return size == other.size && mtime == other.mtime &&
+           inode == other.inode && device == other.device;
+  }
+  bool operator!=(const FileStamp& other) const { return !(*this == other); }
+};
+
+enum class ImportKind : std::uint8_t { Bind, WeakBind, LazyBind, Chained };
+
+// Serialized entries of an index, strings are offsets into its string table.
+struct IndexSlice
+{
+  std::int32_t cputype;
+  std::int32_t cpusubtype;
+  std::uint32_t firstDylib;
+  std::uint32_t dylibCount;
+  std::uint32_t firstImport;
+  std::uint32_t importCount;
+};
+
+struct IndexImport
+{
+  std::uint32_t symbol;
+  std::int32_t dylibIndex;
+  std::uint8_t kind;
+  std::uint8_t reserved[3];
+};
+
+// The dylibs and imported symbols of every slice of a binary. Everything is
+// stored in one flat, position independent buffer, which is also the
+// format of the on-disk cache, so a cached index is used straight from
+// its mapping.
+class ImageIndex
+{
+public:
+  struct Import
+  {
+    std::string_view symbol;
+    // Ordinal the symbol is bound from, special ordinals are negative.
+    std::int32_t dylibIndex;
+    ImportKind kind;
+  };
+
+  struct Slice
+  {
+    std::int32_t cputype;
+    std::int32_t cpusubtype;
+  };
+
+  // Takes ownership of a serialized index, validating it.
+  ImageIndex(std::shared_ptr<const void> owner, const std::uint8_t* data, std::size_t size);
+
+  const FileStamp& getStamp() const;
+  std::size_t getSliceCount() const;
+  Slice getSlice(std::size_t slice) const;
+
+  // Install names of the slice's dylibs, in ordinal order (starting at 1).
+  std::vector<std::string_view> getDylibs(std::size_t slice) const;
+  std::vector<Import> getImports(std::size_t slice) const;
+
+  const std::uint8_t* data() const { return bytes; }
+  std::size_t size() const { return length; }
+
+private:
+  std::shared_ptr<const void> owner;
+  const std::uint8_t* bytes;
+  std::size_t length;
+};
+
+class ImageIndexBuilder
+{
+public:
+  explicit ImageIndexBuilder(const FileStamp& stamp) : stamp(stamp) {}
+
+  void addSlice(std::int32_t cputype, std::int32_t cpusubtype);
+  // Dylibs and imports are added to the last slice.
+  void addDylib(std::string_view installName);
+  void addImport(std::string_view symbol, std::int32_t dylibIndex, ImportKind kind);
+
+  ImageIndex finish() const;
+
+private:
+  std::uint32_t intern(std::string_view string);
+
+  FileStamp stamp;
+  std::vector<IndexSlice> slices;
+  std::vector<std::uint32_t> dylibs;
+  std::vector<IndexImport> imports;
+  std::string strings;
+  std::unordered_map<std::string, std::uint32_t> stringOffsets;
+};
+
+const char* getImportKindName(ImportKind kind);
+}
@@ -23,15 +23,43 @@
 #pragma once
 
 // stl
+#include <filesystem>
 #include <string>
 #include <vector>
 
+// weedless
+#include "hash.h"
 
 namespace weedless {
 
   namespace config {
     struct Config;
+    struct Dylib;
   };
 
-void installDylibs(const config::Config& config);
+// Location a dylib gets installed to when injected into `target`.
+std::filesystem::path getInstallPath(
+    const config::Dylib& dylib, 
+    const std::filesystem::path& target);
+
+// Whether `destination` already holds the dylib, whose contents are
+// described by `digest`.
+bool isDylibInstalled(
+    const config::Dylib& dylib, 
+    const std::filesystem::path& destination,
+    const FileDigest& digest);
+
+// Puts the dylib at `destination` unless it's already there, replacing
+// any other file atomically. It's cloned (or copied) into place, or
+// hardlinked when `hardlink` is set and the filesystem allows it.
+// Returns whether anything was written.
+bool installDylib(
+    const config::Dylib& dylib, 
+    const std::filesystem::path& destination,
+    const FileDigest& digest,
+    bool hardlink = false);
+
+bool installDylibs(
+    const config::Config& config, 
+    const std::filesystem::path& target);
 }
@@ -0,0 +1,49 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+// stl
+#include <cstddef>
+#include <filesystem>
+#include <vector>
+
+// weedless
+#include "partial.h"
+
+namespace weedless {
+
+// Every in-place patch can be recorded in an undo journal next to its
+// target: the bytes each patch replaced and wrote, and the file size
+// before and after. Reverting only reads and writes those bytes.
+
+std::filesystem::path getJournalPath(const std::filesystem::path& target);
+
+// Records the edits `file` is about to sync. Has to be called before the
+// sync, a patch that never made it to disk is skipped when reverting.
+void appendJournal(const std::filesystem::path& target, PartialFile& file);
+
+// Reverts every patch recorded in the journal of `target`, newest first,
+// and removes the journal. Nothing is written when the target changed
+// since it was patched. Returns false when there is no journal.
+bool unpatch(const std::filesystem::path& target, IoStats* stats = nullptr);
+}
@@ -0,0 +1,192 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+// stl
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+
+// weedless
+#include "machodefs.h"
+
+namespace weedless {
+
+// The layouts of 64-bit and 32-bit images. Parsing and patching are
+// templates over the layout, instantiated once for each, and a slice
+// picks its instantiation by its magic.
+struct MachO64
+{
+  using Header = struct mach_header_64;
+  using Segment = struct segment_command_64;
+  using Section = struct section_64;
+  using Symbol = struct nlist_64;
+  static constexpr std::uint32_t kMagic = MH_MAGIC_64;
+  static constexpr std::uint32_t kSegmentCommand = LC_SEGMENT_64;
+  // Pointers in bind targets, load commands are aligned to them too.
+  static constexpr std::uint32_t kPointerSize = 8;
+};
+
+struct MachO32
+{
+  using Header = struct mach_header;
+  using Segment = struct segment_command;
+  using Section = struct section;
+  using Symbol = struct nlist;
+  static constexpr std::uint32_t kMagic = MH_MAGIC;
+  static constexpr std::uint32_t kSegmentCommand = LC_SEGMENT;
+  static constexpr std::uint32_t kPointerSize = 4;
+};
+
+// The load commands of an image. Every command is checked against the
+// image once, when the view is made: commands have to lie within
+// `sizeofcmds` and the image, be aligned to the pointer size, and the
+// commands weedless reads have to be large enough for their structs, with
+// the __LINKEDIT data of dyld info and linkedit data commands within the
+// image. Iterating then never reads outside of the image and never
+// allocates.
+//
+// The view covers the commands at the time it was made, commands appended
+// later need a new view.
+template <typename Layout>
+class LoadCommands
+{
+public:
+  LoadCommands(const typename Layout::Header& machHeader, std::size_t imageSize);
+
+  // Iterates over the commands of the given types as `CommandType`, or
+  // over all commands when no types are given.
+  template <typename CommandType, std::uint32_t... Types>
+  class Iterator
+  {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = CommandType*;
+    using difference_type = std::ptrdiff_t;
+    using pointer = CommandType**;
+    using reference = CommandType*;
+
+    Iterator(std::uint8_t* command, std::uint32_t remaining) 
+      : command(command), remaining(remaining) 
+    {
+      skipOthers();
+    }
+
+    CommandType* operator*() const { return (CommandType*)command; }
+
+    Iterator& operator++()
+    {
+      next();
+      skipOthers();
+      return *this;
+    }
+
+    bool operator==(const Iterator& other) const { return remaining == other.remaining; }
+    bool operator!=(const Iterator& other) const { return remaining != other.remaining; }
+
+  private:
+    static bool matches(std::uint32_t cmd)
+    {
+      return sizeof...(Types) == 0 || ((cmd == Types) || ...);
+    }
+
+    void next()
+    {
+      command += ((const struct load_command*)command)->cmdsize;
+      remaining--;
+    }
+
+    void skipOthers()
+    {
+      while (remaining != 0 && !matches(((const struct load_command*)command)->cmd)) {
+        next();
+      }
+    }
+
+    std::uint8_t* command;
+    std::uint32_t remaining;
+  };
+
+  template <typename CommandType, std::uint32_t... Types>
+  class Range
+  {
+  public:
+    Range(std::uint8_t* first, std::uint32_t count) : first(first), count(count) {}
+
+    Iterator<CommandType, Types...> begin() const { return {first, count}; }
+    Iterator<CommandType, Types...> end() const { return {nullptr, 0}; }
+
+  private:
+    std::uint8_t* first;
+    std::uint32_t count;
+  };
+
+  Range<struct load_command> all() const { return {first, count}; }
+
+  // Size of all commands together, `sizeofcmds`.
+  std::uint32_t getSize() const { return size; }
+
+  template <typename CommandType, std::uint32_t... Types>
+  Range<CommandType, Types...> ofType() const 
+  {
+    static_assert(sizeof...(Types) > 0, "Use all() to iterate over every command.");
+    return {first, count};
+  }
+
+private:
+  std::uint8_t* first;
+  std::uint32_t count;
+  std::uint32_t size;
+};
+
+LoadCommands(const struct mach_header_64&, std::size_t) -> LoadCommands<MachO64>;
+LoadCommands(const struct mach_header&, std::size_t) -> LoadCommands<MachO32>;
+
+// The commands patching and indexing look at, found in a single walk.
+template <typename Layout>
+struct LoadCommandIndex
+{
+  explicit LoadCommandIndex(const LoadCommands<Layout>& commands);
+
+  typename Layout::Segment* text = nullptr;
+  typename Layout::Segment* linkedit = nullptr;
+  struct dyld_info_command* dyldInfo = nullptr;
+  struct linkedit_data_command* chainedFixups = nullptr;
+  struct linkedit_data_command* exportsTrie = nullptr;
+  struct linkedit_data_command* codeSignature = nullptr;
+};
+
+// Size of the header and load commands together.
+template <typename Layout>
+std::size_t getCommandsEnd(const LoadCommands<Layout>& commands)
+{
+  return sizeof(typename Layout::Header) + commands.getSize();
+}
+
+// Dylib commands are checked to hold a NUL-terminated name.
+inline const char* getDylibName(const struct dylib_command& command)
+{
+  return (const char*)&command + command.dylib.name.offset;
+}
+}
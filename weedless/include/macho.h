@@ -22,12 +22,140 @@
 
 #pragma once
 
+// stl
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+// weedless
+#include "exports.h"
+#include "index.h"
+#include "loadcommands.h"
+#include "partial.h"
+
 namespace weedless {
 
   namespace config {
     struct Config;
   };
 
-  void patchMachO(const config::Config& config);
+  enum class IoBackend {
+    // Maps the whole file and syncs it back.
+    Mmap,
+    // Reads only the headers and __LINKEDIT and writes back only the
+    // changed bytes, for huge binaries or slow volumes.
+    Pread,
+  };
+
+  // Returns false when the target was already patched, in which case
+  // nothing is written. `stats` is only filled in by the pread backend.
+  // With `journal`, the patch is recorded in the undo journal of the
+  // target first (see journal.h), which implies the pread backend.
+  bool patchMachO(
+      const config::Config& config, 
+      const std::filesystem::path& target,
+      IoBackend backend = IoBackend::Mmap,
+      IoStats* stats = nullptr,
+      bool journal = false);
+
+  // Writes the patched target to `output`, leaving the target untouched.
+  // The output is replaced atomically, it's never left half-written.
+  // Returns false when the output already was patched and isn't stale, in
+  // which case nothing is written.
+  bool patchMachOTo(
+      const config::Config& config, 
+      const std::filesystem::path& target,
+      const std::filesystem::path& output,
+      IoBackend backend = IoBackend::Mmap,
+      IoStats* stats = nullptr);
+
+  // Whether `output` is missing or older than `target`, so it can't have
+  // been written from the target as it is now.
+  bool isOutputStale(
+      const std::filesystem::path& target,
+      const std::filesystem::path& output);
+
+  // Whether `target` already has all dylibs injected and all hooks applied.
+  bool isPatched(
+      const config::Config& config, 
+      const std::filesystem::path& target);
+
+  // Name of an architecture as used by the `archs` config key.
+  std::string getArchName(std::int32_t cputype, std::int32_t cpusubtype);
+
+  // Names of the architectures of every slice of a binary. Only its
+  // headers are read.
+  std::vector<std::string> getArchNames(const std::filesystem::path& target);
+
+  // Reads the dylibs and imports of every 64-bit and 32-bit slice of a
+  // binary.
+  ImageIndex indexMachO(const std::filesystem::path& target);
+
+  // Maps a dylib and finds the export trie of each of its slices.
+  DylibExports readExports(const std::filesystem::path& dylib);
+
+  // A binary that is opened and parsed once, then patched with any number
+  // of configs. Patches are applied to a copy in memory, commit writes all
+  // of them back at once, with a single sync. Only the headers, load
+  // commands and __LINKEDIT are read, like the pread backend does, and
+  // the binary is only opened for writing by commit.
+  class MachOImage
+  {
+  public:
+    // `name` identifies the binary in new code signatures, it defaults to
+    // the file name.
+    explicit MachOImage(const std::filesystem::path& path, std::string name = {});
+    ~MachOImage();
+
+    MachOImage(MachOImage&&) noexcept;
+    MachOImage& operator=(MachOImage&&) noexcept;
+
+    const std::filesystem::path& getPath() const { return path; }
+
+    // Number of slices, 1 for thin files.
+    std::size_t getSliceCount() const;
+    std::int32_t getCpuType(std::size_t slice) const;
+    std::int32_t getCpuSubtype(std::size_t slice) const;
+
+    // Whether a slice has the 64-bit layout, the others have the 32-bit one.
+    bool is64Bit(std::size_t slice) const;
+
+    // The load commands of a slice with the given layout (MachO64 or
+    // MachO32), as patched so far. The view is invalidated by apply and
+    // rollback.
+    template <typename Layout>
+    LoadCommands<Layout> getLoadCommands(std::size_t slice);
+
+    // The dylibs and imports of every slice, as patched so far.
+    ImageIndex getIndex();
+
+    bool isPatched(const config::Config& config);
+
+    // Patches the image in memory. Returns false when it already was
+    // patched. When patching fails, every patch since the last commit is
+    // rolled back before the error is thrown.
+    bool apply(const config::Config& config);
+
+    // Drops every patch since the last commit.
+    void rollback();
+
+    // Writes back the patches since the last commit. Returns false when
+    // there were none, in which case nothing is written. With `journal`,
+    // they are recorded in the undo journal of the image first.
+    bool commit(IoStats* stats = nullptr, bool journal = false);
+
+    // The edits commit would write, and the size of the image after them.
+    std::vector<FileEdit> getEdits();
+    std::size_t getSize() const;
+
+  private:
+    std::filesystem::path path;
+    std::string name;
+    FileStamp stamp;
+    std::unique_ptr<PartialFile> file;
+    bool dirty = false;
+  };
 }
 
@@ -0,0 +1,407 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+// The Mach-O structures and constants weedless uses. The system headers
+// are used where they exist (macOS), other platforms get definitions with
+// the same names and layout, so weedless builds and runs anywhere.
+
+#if __has_include(<mach-o/loader.h>)
+
+// mach-o
+#include <mach-o/fat.h>
+#include <mach-o/loader.h>
+#include <mach-o/nlist.h>
+
+#else
+
+// c
+#include <cstdint>
+
+typedef int cpu_type_t;
+typedef int cpu_subtype_t;
+typedef int vm_prot_t;
+
+#define CPU_ARCH_MASK           0xff000000
+#define CPU_ARCH_ABI64          0x01000000
+#define CPU_ARCH_ABI64_32       0x02000000
+
+#define CPU_TYPE_X86            ((cpu_type_t) 7)
+#define CPU_TYPE_I386           CPU_TYPE_X86
+#define CPU_TYPE_X86_64         (CPU_TYPE_X86 | CPU_ARCH_ABI64)
+#define CPU_TYPE_ARM            ((cpu_type_t) 12)
+#define CPU_TYPE_ARM64          (CPU_TYPE_ARM | CPU_ARCH_ABI64)
+#define CPU_TYPE_ARM64_32       (CPU_TYPE_ARM | CPU_ARCH_ABI64_32)
+
+#define CPU_SUBTYPE_MASK        0xff000000
+#define CPU_SUBTYPE_X86_ALL     ((cpu_subtype_t) 3)
+#define CPU_SUBTYPE_X86_64_ALL  ((cpu_subtype_t) 3)
+#define CPU_SUBTYPE_X86_64_H    ((cpu_subtype_t) 8)
+#define CPU_SUBTYPE_ARM_ALL     ((cpu_subtype_t) 0)
+#define CPU_SUBTYPE_ARM_V7      ((cpu_subtype_t) 9)
+#define CPU_SUBTYPE_ARM_V7S     ((cpu_subtype_t) 11)
+#define CPU_SUBTYPE_ARM_V7K     ((cpu_subtype_t) 12)
+#define CPU_SUBTYPE_ARM64_ALL   ((cpu_subtype_t) 0)
+#define CPU_SUBTYPE_ARM64E      ((cpu_subtype_t) 2)
+
+// fat.h, fat headers are always big endian.
+#define FAT_MAGIC     0xcafebabe
+#define FAT_CIGAM     0xbebafeca
+#define FAT_MAGIC_64  0xcafebabf
+#define FAT_CIGAM_64  0xbfbafeca
+
+struct fat_header {
+  uint32_t magic;
+  uint32_t nfat_arch;
+};
+
+struct fat_arch {
+  cpu_type_t cputype;
+  cpu_subtype_t cpusubtype;
+  uint32_t offset;
+  uint32_t size;
+  uint32_t align;
+};
+
+struct fat_arch_64 {
+  cpu_type_t cputype;
+  cpu_subtype_t cpusubtype;
+  uint64_t offset;
+  uint64_t size;
+  uint32_t align;
+  uint32_t reserved;
+};
+
+// loader.h
+struct mach_header {
+  uint32_t magic;
+  cpu_type_t cputype;
+  cpu_subtype_t cpusubtype;
+  uint32_t filetype;
+  uint32_t ncmds;
+  uint32_t sizeofcmds;
+  uint32_t flags;
+};
+
+struct mach_header_64 {
+  uint32_t magic;
+  cpu_type_t cputype;
+  cpu_subtype_t cpusubtype;
+  uint32_t filetype;
+  uint32_t ncmds;
+  uint32_t sizeofcmds;
+  uint32_t flags;
+  uint32_t reserved;
+};
+
+#define MH_MAGIC      0xfeedface
+#define MH_CIGAM      0xcefaedfe
+#define MH_MAGIC_64   0xfeedfacf
+#define MH_CIGAM_64   0xcffaedfe
+
+#define MH_EXECUTE    0x2
+#define MH_DYLIB      0x6
+#define MH_BUNDLE     0x8
+#define MH_PIE        0x200000
+
+struct load_command {
+  uint32_t cmd;
+  uint32_t cmdsize;
+};
+
+#define LC_REQ_DYLD                   0x80000000
+#define LC_SEGMENT                    0x1
+#define LC_SYMTAB                     0x2
+#define LC_DYSYMTAB                   0xb
+#define LC_LOAD_DYLIB                 0xc
+#define LC_ID_DYLIB                   0xd
+#define LC_LOAD_DYLINKER              0xe
+#define LC_LOAD_WEAK_DYLIB            (0x18 | LC_REQ_DYLD)
+#define LC_SEGMENT_64                 0x19
+#define LC_UUID                       0x1b
+#define LC_RPATH                      (0x1c | LC_REQ_DYLD)
+#define LC_CODE_SIGNATURE             0x1d
+#define LC_SEGMENT_SPLIT_INFO         0x1e
+#define LC_REEXPORT_DYLIB             (0x1f | LC_REQ_DYLD)
+#define LC_DYLD_INFO                  0x22
+#define LC_DYLD_INFO_ONLY             (0x22 | LC_REQ_DYLD)
+#define LC_LOAD_UPWARD_DYLIB          (0x23 | LC_REQ_DYLD)
+#define LC_FUNCTION_STARTS            0x26
+#define LC_MAIN                       (0x28 | LC_REQ_DYLD)
+#define LC_DATA_IN_CODE               0x29
+#define LC_DYLIB_CODE_SIGN_DRS        0x2B
+#define LC_LINKER_OPTIMIZATION_HINT   0x2E
+#define LC_BUILD_VERSION              0x32
+#define LC_DYLD_EXPORTS_TRIE          (0x33 | LC_REQ_DYLD)
+#define LC_DYLD_CHAINED_FIXUPS        (0x34 | LC_REQ_DYLD)
+
+union lc_str {
+  uint32_t offset;
+};
+
+struct segment_command {
+  uint32_t cmd;
+  uint32_t cmdsize;
+  char segname[16];
+  uint32_t vmaddr;
+  uint32_t vmsize;
+  uint32_t fileoff;
+  uint32_t filesize;
+  vm_prot_t maxprot;
+  vm_prot_t initprot;
+  uint32_t nsects;
+  uint32_t flags;
+};
+
+struct segment_command_64 {
+  uint32_t cmd;
+  uint32_t cmdsize;
+  char segname[16];
+  uint64_t vmaddr;
+  uint64_t vmsize;
+  uint64_t fileoff;
+  uint64_t filesize;
+  vm_prot_t maxprot;
+  vm_prot_t initprot;
+  uint32_t nsects;
+  uint32_t flags;
+};
+
+struct section {
+  char sectname[16];
+  char segname[16];
+  uint32_t addr;
+  uint32_t size;
+  uint32_t offset;
+  uint32_t align;
+  uint32_t reloff;
+  uint32_t nreloc;
+  uint32_t flags;
+  uint32_t reserved1;
+  uint32_t reserved2;
+};
+
+struct section_64 {
+  char sectname[16];
+  char segname[16];
+  uint64_t addr;
+  uint64_t size;
+  uint32_t offset;
+  uint32_t align;
+  uint32_t reloff;
+  uint32_t nreloc;
+  uint32_t flags;
+  uint32_t reserved1;
+  uint32_t reserved2;
+  uint32_t reserved3;
+};
+
+#define SEG_TEXT      "__TEXT"
+#define SEG_LINKEDIT  "__LINKEDIT"
+
+struct dylib {
+  union lc_str name;
+  uint32_t timestamp;
+  uint32_t current_version;
+  uint32_t compatibility_version;
+};
+
+struct dylib_command {
+  uint32_t cmd;
+  uint32_t cmdsize;
+  struct dylib dylib;
+};
+
+struct dylinker_command {
+  uint32_t cmd;
+  uint32_t cmdsize;
+  union lc_str name;
+};
+
+struct symtab_command {
+  uint32_t cmd;
+  uint32_t cmdsize;
+  uint32_t symoff;
+  uint32_t nsyms;
+  uint32_t stroff;
+  uint32_t strsize;
+};
+
+struct dysymtab_command {
+  uint32_t cmd;
+  uint32_t cmdsize;
+  uint32_t ilocalsym;
+  uint32_t nlocalsym;
+  uint32_t iextdefsym;
+  uint32_t nextdefsym;
+  uint32_t iundefsym;
+  uint32_t nundefsym;
+  uint32_t tocoff;
+  uint32_t ntoc;
+  uint32_t modtaboff;
+  uint32_t nmodtab;
+  uint32_t extrefsymoff;
+  uint32_t nextrefsyms;
+  uint32_t indirectsymoff;
+  uint32_t nindirectsyms;
+  uint32_t extreloff;
+  uint32_t nextrel;
+  uint32_t locreloff;
+  uint32_t nlocrel;
+};
+
+struct linkedit_data_command {
+  uint32_t cmd;
+  uint32_t cmdsize;
+  uint32_t dataoff;
+  uint32_t datasize;
+};
+
+struct dyld_info_command {
+  uint32_t cmd;
+  uint32_t cmdsize;
+  uint32_t rebase_off;
+  uint32_t rebase_size;
+  uint32_t bind_off;
+  uint32_t bind_size;
+  uint32_t weak_bind_off;
+  uint32_t weak_bind_size;
+  uint32_t lazy_bind_off;
+  uint32_t lazy_bind_size;
+  uint32_t export_off;
+  uint32_t export_size;
+};
+
+#define BIND_TYPE_POINTER                                         1
+
+#define BIND_SPECIAL_DYLIB_SELF                                   0
+#define BIND_SPECIAL_DYLIB_MAIN_EXECUTABLE                        -1
+#define BIND_SPECIAL_DYLIB_FLAT_LOOKUP                            -2
+#define BIND_SPECIAL_DYLIB_WEAK_LOOKUP                            -3
+
+#define BIND_SYMBOL_FLAGS_WEAK_IMPORT                             0x1
+#define BIND_SYMBOL_FLAGS_NON_WEAK_DEFINITION                     0x8
+
+#define BIND_OPCODE_MASK                                          0xF0
+#define BIND_IMMEDIATE_MASK                                       0x0F
+#define BIND_OPCODE_DONE                                          0x00
+#define BIND_OPCODE_SET_DYLIB_ORDINAL_IMM                         0x10
+#define BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB                        0x20
+#define BIND_OPCODE_SET_DYLIB_SPECIAL_IMM                         0x30
+#define BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM                 0x40
+#define BIND_OPCODE_SET_TYPE_IMM                                  0x50
+#define BIND_OPCODE_SET_ADDEND_SLEB                               0x60
+#define BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB                   0x70
+#define BIND_OPCODE_ADD_ADDR_ULEB                                 0x80
+#define BIND_OPCODE_DO_BIND                                       0x90
+#define BIND_OPCODE_DO_BIND_ADD_ADDR_ULEB                         0xA0
+#define BIND_OPCODE_DO_BIND_ADD_ADDR_IMM_SCALED                   0xB0
+#define BIND_OPCODE_DO_BIND_ULEB_TIMES_SKIPPING_ULEB              0xC0
+#define BIND_OPCODE_THREADED                                      0xD0
+#define BIND_SUBOPCODE_THREADED_SET_BIND_ORDINAL_TABLE_SIZE_ULEB  0x00
+#define BIND_SUBOPCODE_THREADED_APPLY                             0x01
+
+#define EXPORT_SYMBOL_FLAGS_KIND_MASK                             0x03
+#define EXPORT_SYMBOL_FLAGS_KIND_REGULAR                          0x00
+#define EXPORT_SYMBOL_FLAGS_KIND_THREAD_LOCAL                     0x01
+#define EXPORT_SYMBOL_FLAGS_KIND_ABSOLUTE                         0x02
+#define EXPORT_SYMBOL_FLAGS_WEAK_DEFINITION                       0x04
+#define EXPORT_SYMBOL_FLAGS_REEXPORT                              0x08
+#define EXPORT_SYMBOL_FLAGS_STUB_AND_RESOLVER                     0x10
+
+// nlist.h
+struct nlist {
+  union {
+    uint32_t n_strx;
+  } n_un;
+  uint8_t n_type;
+  uint8_t n_sect;
+  int16_t n_desc;
+  uint32_t n_value;
+};
+
+struct nlist_64 {
+  union {
+    uint32_t n_strx;
+  } n_un;
+  uint8_t n_type;
+  uint8_t n_sect;
+  uint16_t n_desc;
+  uint64_t n_value;
+};
+
+#define N_UNDF  0x0
+#define N_EXT   0x01
+
+#endif
+
+// Chained fixups were added to the SDK later than the rest.
+#if __has_include(<mach-o/fixup-chains.h>)
+
+// mach-o
+#include <mach-o/fixup-chains.h>
+
+#else
+
+// c
+#include <cstdint>
+
+struct dyld_chained_fixups_header {
+  uint32_t fixups_version;
+  uint32_t starts_offset;
+  uint32_t imports_offset;
+  uint32_t symbols_offset;
+  uint32_t imports_count;
+  uint32_t imports_format;
+  uint32_t symbols_format;
+};
+
+enum {
+  DYLD_CHAINED_IMPORT          = 1,
+  DYLD_CHAINED_IMPORT_ADDEND   = 2,
+  DYLD_CHAINED_IMPORT_ADDEND64 = 3,
+};
+
+struct dyld_chained_import {
+  uint32_t lib_ordinal :  8,
+           weak_import :  1,
+           name_offset : 23;
+};
+
+struct dyld_chained_import_addend {
+  uint32_t lib_ordinal :  8,
+           weak_import :  1,
+           name_offset : 23;
+  int32_t addend;
+};
+
+struct dyld_chained_import_addend64 {
+  uint64_t lib_ordinal : 16,
+           weak_import :  1,
+           reserved    : 15,
+           name_offset : 32;
+  uint64_t addend;
+};
+
+#endif
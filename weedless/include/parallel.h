@@ -0,0 +1,85 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+// stl
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace weedless {
+
+// Number of workers to use when the user didn't ask for a specific amount.
+inline std::size_t defaultJobs()
+{
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Runs `fn(index)` for every index in [0, count) on at most `jobs` threads.
+// The first exception thrown by `fn` is rethrown once all workers are done.
+template <typename Fn>
+void parallelFor(std::size_t count, std::size_t jobs, Fn&& fn)
+{
+  jobs = std::min(std::max<std::size_t>(jobs, 1), count);
+  if (jobs <= 1) {
+    for (std::size_t index = 0; index < count; index++) {
+      fn(index);
+    }
+    return;
+  }
+
+  std::atomic<std::size_t> next {0};
+  std::exception_ptr error;
+  std::mutex errorMutex;
+
+  auto worker = [&]() {
+    for (auto index = next++; index < count; index = next++) {
+      try {
+        fn(index);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(errorMutex);
+        if (!error) { error = std::current_exception(); }
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  workers.reserve(jobs - 1);
+  for (std::size_t i = 1; i < jobs; i++) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread: workers) {
+    thread.join();
+  }
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+}
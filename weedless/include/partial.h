@@ -0,0 +1,114 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+// stl
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+namespace weedless {
+
+struct IoStats
+{
+  std::uint64_t bytesRead = 0;
+  std::uint64_t bytesWritten = 0;
+};
+
+// A run of bytes that differs from the file on disk.
+struct FileEdit
+{
+  std::uint64_t offset;
+  // Empty for bytes past the end of the file on disk.
+  std::vector<std::uint8_t> before;
+  std::vector<std::uint8_t> after;
+};
+
+// A file that is only read where it's needed. The whole file is reserved
+// in memory without committing it, ranges are read on request with pread
+// and sync writes back only the bytes that changed since.
+//
+// Everything outside of the loaded ranges reads as zeros and writes to it
+// are lost, so callers have to load every range they touch.
+//
+// A file opened without `writable` is only opened for writing by sync, so
+// files that are just read don't have to be writable.
+class PartialFile
+{
+public:
+  explicit PartialFile(const std::filesystem::path& path, bool writable = true);
+  ~PartialFile();
+
+  PartialFile(const PartialFile&) = delete;
+  PartialFile& operator=(const PartialFile&) = delete;
+
+  std::uint8_t* data() { return (std::uint8_t*)ptr; }
+  std::size_t size() const { return length; }
+
+  // Reads the part of [offset, offset + size) that lies in the file and
+  // isn't loaded yet.
+  void load(std::uint64_t offset, std::uint64_t size);
+
+  // Grows the file, the new bytes count as loaded. Invalidates all
+  // pointers into the file.
+  void resize(std::size_t newSize);
+
+  // Writes back the changed bytes with pwrite and flushes them to disk.
+  // Fails when the path no longer names the file that was opened.
+  void sync();
+
+  // The runs of changed bytes sync would write.
+  std::vector<FileEdit> getEdits();
+  // Size of the file on disk, as of the last sync.
+  std::size_t getDiskSize() const { return fileSize; }
+
+  const IoStats& getStats() const { return stats; }
+
+private:
+  struct Range
+  {
+    std::uint64_t offset;
+    std::uint64_t size;
+    // Contents as last read or written, empty for bytes that didn't
+    // exist in the file yet.
+    std::vector<std::uint8_t> original;
+  };
+
+  void reserve(std::size_t size);
+  void loadRange(std::uint64_t offset, std::uint64_t size);
+  void writeBack(const Range& range);
+  void openForWriting();
+
+  std::filesystem::path path;
+  bool writable;
+  int fd = -1;
+  void* ptr = nullptr;
+  std::size_t length = 0;
+  std::size_t fileSize = 0;
+  // Sorted by offset and never overlapping.
+  std::vector<Range> ranges;
+  IoStats stats;
+};
+}
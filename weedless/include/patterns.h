@@ -0,0 +1,105 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+// stl
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace weedless {
+
+enum class PatternKind : std::uint8_t { Exact, Prefix, Glob, Regex };
+
+struct Pattern
+{
+  PatternKind kind;
+  std::string_view text;
+  // Patterns in different groups (e.g. hooks into different dylibs)
+  // conflict when they match the same symbol.
+  std::uint32_t group;
+};
+
+// Two patterns of different groups that match the same symbols, of which
+// the later pattern `second` wins.
+struct PatternConflict
+{
+  std::uint32_t first;
+  std::uint32_t second;
+  // The shortest symbol both match.
+  std::string example;
+};
+
+// Matches whole symbol names against a set of patterns at once, in a
+// single pass over the name. The patterns are compiled into one DFA:
+// - prefix: everything starting with the text.
+// - glob: `*` matches any run of characters, `?` a single one, `[...]` a
+//   character class (negated by `!` or `^`), `\` escapes.
+// - regex: `.`, `[...]`, `*`, `+`, `?`, `|`, `(...)` and `\` escapes
+//   (`\d` and `\w` are classes), anchored at both ends.
+class SymbolMatcher
+{
+public:
+  static constexpr std::uint32_t npos = UINT32_MAX;
+
+  SymbolMatcher() = default;
+
+  // Throws on invalid patterns or when the DFA gets too large. Every
+  // conflict between groups is reported once, in a stable order.
+  static SymbolMatcher compile(
+      const std::vector<Pattern>& patterns, 
+      std::vector<PatternConflict>* conflicts = nullptr);
+
+  bool empty() const { return transitions.empty(); }
+
+  // Index of the last pattern matching `symbol`, npos when none does.
+  std::uint32_t match(std::string_view symbol) const
+  {
+    if (empty()) {
+      return npos;
+    }
+    std::uint32_t state = kStart;
+    for (const auto c: symbol) {
+      state = transitions[state * classCount + classes[(std::uint8_t)c]];
+      if (state == kDead) {
+        return npos;
+      }
+    }
+    return matches[state];
+  }
+
+private:
+  static constexpr std::uint32_t kDead = 0;
+  static constexpr std::uint32_t kStart = 1;
+
+  // Bytes no pattern tells apart share an equivalence class.
+  std::uint8_t classes[256] = {};
+  std::uint32_t classCount = 0;
+  // Next state by state and class.
+  std::vector<std::uint32_t> transitions;
+  // Winning pattern by state.
+  std::vector<std::uint32_t> matches;
+};
+}
@@ -0,0 +1,70 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+// stl
+#include <filesystem>
+#include <vector>
+
+// weedless
+#include "hash.h"
+#include "partial.h"
+
+namespace weedless {
+
+  namespace config {
+    struct Config;
+  };
+
+// Patching a given binary with given configs always writes the same
+// bytes. A plan records them together with digests of the binary before
+// and after, so identical copies of it can be patched by replaying the
+// edits, without parsing them or reading any config.
+struct PatchPlan
+{
+  FileDigest input;
+  FileDigest output;
+  // Only `offset` and `after` are set. Sorted by offset, never overlapping.
+  std::vector<FileEdit> edits;
+};
+
+// Patches `target` with every config in memory and records the result,
+// leaving the target untouched. Dylibs are not installed.
+PatchPlan makePlan(
+    const std::vector<const config::Config*>& configs,
+    const std::filesystem::path& target);
+
+void writePlan(const std::filesystem::path& path, const PatchPlan& plan);
+PatchPlan readPlan(const std::filesystem::path& path);
+
+// Replays the plan onto `target`, which has to match its input digest.
+// Returns false when the target already matches its output digest, in
+// which case nothing is written. With `journal`, the edits are recorded
+// in the undo journal of the target first (see journal.h).
+bool applyPlan(
+    const PatchPlan& plan,
+    const std::filesystem::path& target,
+    IoStats* stats = nullptr,
+    bool journal = false);
+}
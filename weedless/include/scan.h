@@ -0,0 +1,177 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+// stl
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// weedless
+#include "uleb.h"
+
+#if defined(__SSE2__)
+#define WEEDLESS_SCAN_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// Scanners for the tokens of bind opcode streams: NUL-terminated symbol
+// names, LEB128 operands and runs of BIND_OPCODE_DONE. The decoder is
+// instantiated per scanner and picks one per image, so the checks for the
+// instruction set are never made per token.
+namespace weedless::scan {
+
+// From slowest to fastest.
+enum class Level : std::uint8_t { Scalar, Sse2, Avx2 };
+
+// The fastest level the CPU supports.
+Level getSupportedLevel();
+
+// The level bind streams are decoded at, the supported one unless it was
+// lowered (to compare levels).
+Level getLevel();
+void setLevel(Level level);
+
+const char* getLevelName(Level level);
+
+// Finds the first NUL in [p, end), nullptr when there is none. Scans 32
+// bytes at a time at the AVX2 level.
+const std::uint8_t* findNulLong(const std::uint8_t* p, const std::uint8_t* end);
+
+// Number of NULs in [p, end).
+std::size_t countNuls(const std::uint8_t* p, const std::uint8_t* end);
+
+// A byte at a time.
+struct ScalarScanner
+{
+  static const std::uint8_t* findNul(const std::uint8_t* p, const std::uint8_t* end)
+  {
+    return (const std::uint8_t*)memchr(p, '\0', end - p);
+  }
+
+  static std::uint64_t readUleb(const std::uint8_t*& p, const std::uint8_t* end)
+  {
+    return read_uleb128(p, end).first;
+  }
+
+  static void skipLeb(const std::uint8_t*& p, const std::uint8_t* end)
+  {
+    skip_leb128(p, end);
+  }
+
+  static const std::uint8_t* skipZeros(const std::uint8_t* p, const std::uint8_t* end)
+  {
+    while (p < end && *p == 0) {
+      p++;
+    }
+    return p;
+  }
+};
+
+#if defined(WEEDLESS_SCAN_SSE2)
+
+// Packs the 7-bit groups of a LEB128 of `size` (at most 8) bytes, loaded
+// little endian.
+inline std::uint64_t packLeb(std::uint64_t bytes, unsigned size)
+{
+  if (size < 8) {
+    bytes &= (std::uint64_t(1) << (size * 8)) - 1;
+  }
+  bytes &= 0x7f7f7f7f7f7f7f7full;
+  bytes = (bytes & 0x007f007f007f007full) | ((bytes & 0x7f007f007f007f00ull) >> 1);
+  bytes = (bytes & 0x00003fff00003fffull) | ((bytes & 0x3fff00003fff0000ull) >> 2);
+  return (bytes & 0x000000000fffffffull) | ((bytes & 0x0fffffff00000000ull) >> 4);
+}
+
+// 16 bytes at a time where the stream has them left, which covers every
+// well-formed LEB128 and almost every symbol name in one step. Anything
+// else (the end of the stream, malformed or oversized LEB128s) is left to
+// the scalar scanner, so both fail the same way.
+struct VectorScanner
+{
+  static const std::uint8_t* findNul(const std::uint8_t* p, const std::uint8_t* end)
+  {
+    if (end - p < 16) {
+      return ScalarScanner::findNul(p, end);
+    }
+    const auto bytes = _mm_loadu_si128((const __m128i*)p);
+    const unsigned nuls = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_setzero_si128()));
+    return nuls ? p + __builtin_ctz(nuls) : findNulLong(p + 16, end);
+  }
+
+  static std::uint64_t readUleb(const std::uint8_t*& p, const std::uint8_t* end)
+  {
+    if (end - p >= 16) {
+      const unsigned size = getLebSize(p);
+      if (size <= 8) {
+        std::uint64_t bytes;
+        memcpy(&bytes, p, sizeof(bytes));
+        p += size;
+        return packLeb(bytes, size);
+      }
+    }
+    return ScalarScanner::readUleb(p, end);
+  }
+
+  static void skipLeb(const std::uint8_t*& p, const std::uint8_t* end)
+  {
+    if (end - p >= 16) {
+      const unsigned size = getLebSize(p);
+      if (size <= 16) {
+        p += size;
+        return;
+      }
+    }
+    ScalarScanner::skipLeb(p, end);
+  }
+
+  static const std::uint8_t* skipZeros(const std::uint8_t* p, const std::uint8_t* end)
+  {
+    while (end - p >= 16) {
+      const auto bytes = _mm_loadu_si128((const __m128i*)p);
+      const unsigned zeros = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_setzero_si128()));
+      if (zeros != 0xffff) {
+        return p + __builtin_ctz(~zeros);
+      }
+      p += 16;
+    }
+    return ScalarScanner::skipZeros(p, end);
+  }
+
+private:
+  // Size of the LEB128 at `p` (which has 16 bytes left), 17 when it is
+  // longer than that.
+  static unsigned getLebSize(const std::uint8_t* p)
+  {
+    const unsigned continued = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)p));
+    return __builtin_ctz(~continued) + 1;
+  }
+};
+
+#else
+
+using VectorScanner = ScalarScanner;
+
+#endif
+}
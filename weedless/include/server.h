@@ -0,0 +1,62 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+// stl
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace weedless {
+
+// A weedless command line, run by the server as if it was run by the
+// client in `workingDirectory`.
+struct ServerRequest
+{
+  std::filesystem::path workingDirectory;
+  std::vector<std::string> args;
+};
+
+struct ServerResponse
+{
+  int exitCode = 0;
+  std::string out;
+  std::string err;
+};
+
+using RequestHandler = std::function<ServerResponse(const ServerRequest&)>;
+
+// Listens on a Unix domain socket and handles every connection on its own
+// thread, so requests run concurrently. Doesn't return; a stale socket
+// left behind by an earlier server is replaced.
+[[noreturn]] void serve(const std::filesystem::path& socketPath, const RequestHandler& handler);
+
+// Sends a request to the server listening at `socketPath`. Returns nothing
+// when no server is listening there.
+std::optional<ServerResponse> sendRequest(
+    const std::filesystem::path& socketPath, 
+    const ServerRequest& request);
+}
@@ -0,0 +1,128 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+// stl
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+
+namespace weedless::trace {
+
+enum class Phase : std::uint8_t
+{
+  ConfigParse,
+  Discover,
+  Digest,
+  Exports,
+  Install,
+  Target,
+  Map,
+  LoadCommands,
+  BindDecode,
+  HookMatch,
+  Inject,
+  Sign,
+  Sync,
+  Unpatch,
+  Apply,
+  Count
+};
+
+enum class Counter : std::uint8_t
+{
+  BytesRead,
+  BytesWritten,
+  BytesMapped,
+  SymbolsScanned,
+  HooksMatched,
+  OpcodesDecoded,
+  Count
+};
+
+namespace detail {
+  extern std::atomic<bool> enabled;
+  void add(Counter counter, std::uint64_t value);
+}
+
+// Nothing is recorded until tracing is enabled, until then scopes and
+// counters cost a single relaxed load.
+void enable();
+
+inline bool isEnabled()
+{
+  return detail::enabled.load(std::memory_order_relaxed);
+}
+
+inline void count(Counter counter, std::uint64_t value = 1)
+{
+  if (isEnabled()) {
+    detail::add(counter, value);
+  }
+}
+
+// Records the time between its construction and destruction as a span of
+// `phase`. The detail (e.g. a path) is shown with the span in traces.
+class Scope
+{
+public:
+  explicit Scope(Phase phase, std::string_view detail = {})
+    : phase(phase)
+  {
+    if (isEnabled()) {
+      begin(detail);
+    }
+  }
+
+  ~Scope()
+  {
+    if (active) {
+      end();
+    }
+  }
+
+  Scope(const Scope&) = delete;
+  Scope& operator=(const Scope&) = delete;
+
+private:
+  void begin(std::string_view detail);
+  void end();
+
+  Phase phase;
+  bool active = false;
+  std::uint64_t start = 0;
+  std::string detail;
+};
+
+const char* getPhaseName(Phase phase);
+const char* getCounterName(Counter counter);
+
+// Both expect every traced thread to be done. The trace is in the Chrome
+// trace event format (chrome://tracing, Perfetto), the stats are a JSON
+// summary of the time spent per phase and the counters.
+void writeChromeTrace(const std::filesystem::path& path);
+void writeStats(const std::filesystem::path& path);
+}
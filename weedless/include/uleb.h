@@ -1,3 +1,5 @@
+#pragma once
+
 #include <utility>
 #include <cstdint>
 #include <stdexcept>
@@ -24,34 +26,44 @@ static std::pair<uintptr_t, int> read_uleb128(const uint8_t*& p, const uint8_t*
   return {result, bit};
 }
 
-static uint32_t write_uleb128(uint8_t *p, uint64_t value, uint32_t length_limit) {
-    uint8_t *orig = p;
+static uint32_t uleb128_size(uint64_t value) {
+    uint32_t len = 0;
     do {
-        uint8_t byte = value & 0x7f;
         value >>= 7;
-        
-        if (value != 0) {
-            byte |= 0x80;
-        }
-        
-        *p++ = byte;
+        len++;
     } while (value != 0);
-    
-    uint32_t len = (uint32_t)(p - orig);
-    
-    int32_t pad = length_limit - len;
-    if (pad < 0 && length_limit != 0) {
+    return len;
+}
+
+// Writes `value`, padded with continuation bytes to exactly `length_limit`
+// bytes when that is non-zero.
+static uint32_t write_uleb128(uint8_t *p, uint64_t value, uint32_t length_limit) {
+    uint32_t len = uleb128_size(value);
+    if (length_limit != 0 && len > length_limit) {
         throw std::runtime_error("length error");
     }
     
-    if (pad != 0 && pad > 0) {
+    uint32_t total = length_limit != 0 ? length_limit : len;
+    for (uint32_t i = 0; i < total; i++) {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        
         // mark these bytes to show more follow
-        for (; pad != 1; --pad) {
-            *p++ = '\x80';
+        if (i + 1 != total) {
+            byte |= 0x80;
         }
         
-        // mark terminating byte
-        *p++ = '\x00';
+        *p++ = byte;
     }
     return len;
 }
+
+// Skips a ULEB128 or SLEB128 without decoding it.
+static void skip_leb128(const uint8_t*& p, const uint8_t* end)
+{
+  do {
+    if (p == end)
+      throw std::runtime_error("malformed leb128");
+  } 
+  while (*p++ & 0x80);
+}
@@ -0,0 +1,193 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+
+// stl
+#include <chrono>
+#include <exception>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// weedless
+#include "exports.h"
+#include "hash.h"
+#include "index.h"
+
+namespace weedless {
+
+namespace config {
+  struct Config;
+}
+
+// Whether a stamp can be trusted to change with its file. Changes within
+// the timestamp granularity of the filesystem can keep the mtime, so
+// files changed in the last seconds aren't trusted yet.
+bool isStampSettled(const FileStamp& stamp);
+
+// Whether `path` still has `stamp`, false if it can't be stamped anymore.
+bool isStampCurrent(const std::filesystem::path& path, const FileStamp& stamp);
+
+// Values derived from files, kept for as long as their file is unchanged.
+template <typename Value>
+class StampedCache
+{
+public:
+  // The cached value for `path`, made by `make` when there is none or its
+  // file has changed.
+  template <typename Make>
+  Value get(const std::string& key, const std::filesystem::path& path, Make&& make)
+  {
+    // Stamp the file before reading it, so a concurrent change can only
+    // make the value look stale, never current. Files that can't be
+    // stamped are left to `make` to report.
+    std::optional<FileStamp> stamp;
+    try {
+      stamp = FileStamp::of(path);
+    } catch (const std::exception&) {
+      return make();
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = entries.find(key);
+      if (it != entries.end() && it->second.stamp == *stamp) {
+        return it->second.value;
+      }
+    }
+
+    Value value = make();
+    if (isStampSettled(*stamp)) {
+      std::lock_guard<std::mutex> lock(mutex);
+      entries.insert_or_assign(key, Entry{path, *stamp, value});
+    }
+    return value;
+  }
+
+  // Drops the values of files that changed or went away since.
+  void evictStale()
+  {
+    std::vector<std::tuple<std::string, std::filesystem::path, FileStamp>> checked;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (const auto& [key, entry]: entries) {
+        checked.emplace_back(key, entry.path, entry.stamp);
+      }
+    }
+    // Stamping happens unlocked, and only drops entries nobody replaced.
+    for (const auto& [key, path, stamp]: checked) {
+      if (isStampCurrent(path, stamp)) {
+        continue;
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = entries.find(key);
+      if (it != entries.end() && it->second.stamp == stamp) {
+        entries.erase(it);
+      }
+    }
+  }
+
+private:
+  struct Entry
+  {
+    std::filesystem::path path;
+    FileStamp stamp;
+    Value value;
+  };
+
+  std::mutex mutex;
+  std::unordered_map<std::string, Entry> entries;
+};
+
+// Holds the lock on a path, and keeps its mutex alive while it does.
+struct PathLock
+{
+  std::shared_ptr<std::mutex> mutex;
+  std::unique_lock<std::mutex> lock;
+};
+
+// Everything a long running weedless keeps between batches: parsed
+// configs, image indexes, dylib digests and exports, and which targets and dylibs
+// were found up to date. All of it is only used while the files it came
+// from keep their identity and mtime, and evictStale drops it after.
+class WarmState
+{
+public:
+  std::shared_ptr<const config::Config> getConfig(
+      const std::filesystem::path& path, 
+      const std::filesystem::path& workingDirectory);
+  ImageIndex getIndex(const std::filesystem::path& path);
+  FileDigest getDigest(const std::filesystem::path& path);
+  DylibExports getExports(const std::filesystem::path& path);
+
+  // Whether `output` was found patched by `config` (which has to come from
+  // getConfig) at `stamp`.
+  bool isKnownPatched(const config::Config& config, const std::filesystem::path& output, const FileStamp& stamp);
+  void setPatched(const config::Config& config, const std::filesystem::path& output, const FileStamp& stamp);
+
+  // Whether `destination` was found to hold the contents of `source` at
+  // these stamps.
+  bool isKnownInstalled(
+      const std::filesystem::path& source, const FileStamp& sourceStamp,
+      const std::filesystem::path& destination, const FileStamp& destinationStamp);
+  void setInstalled(
+      const std::filesystem::path& source, const FileStamp& sourceStamp,
+      const std::filesystem::path& destination, const FileStamp& destinationStamp);
+
+  // Serializes everything that writes to `path`.
+  PathLock lockPath(const std::filesystem::path& path);
+
+  // Drops everything that came from files which changed or went away,
+  // what was known about replaced configs, and the locks of paths nobody
+  // writes to. Does nothing when it already ran in the last minute.
+  void evictStale();
+
+private:
+  struct PatchedEntry
+  {
+    // Keeps the config alive, so its address can't be reused by another.
+    std::shared_ptr<const config::Config> config;
+    FileStamp stamp;
+  };
+
+  StampedCache<std::shared_ptr<const config::Config>> configs;
+  StampedCache<ImageIndex> indexes;
+  StampedCache<FileDigest> digests;
+  StampedCache<DylibExports> exports;
+
+  std::mutex mutex;
+  // Every config handed out by getConfig that is still in use.
+  std::unordered_map<const config::Config*, std::weak_ptr<const config::Config>> loadedConfigs;
+  std::map<std::pair<const config::Config*, std::string>, PatchedEntry> patched;
+  std::map<std::pair<std::string, std::string>, std::pair<FileStamp, FileStamp>> installed;
+  std::unordered_map<std::string, std::weak_ptr<std::mutex>> pathLocks;
+  std::chrono::steady_clock::time_point lastEviction;
+};
+}
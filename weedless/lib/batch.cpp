@@ -0,0 +1,665 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "batch.h"
+
+// weedless
+#include "config.h"
+#include "copy.h"
+#include "hash.h"
+#include "install.h"
+#include "macho.h"
+#include "parallel.h"
+#include "trace.h"
+#include "walk.h"
+#include "warm.h"
+
+// stl
+#include <algorithm>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_set>
+
+namespace weedless {
+namespace {
+
+std::string describeException(const std::exception_ptr& exception)
+{
+  try {
+    std::rethrow_exception(exception);
+  } catch (const std::exception& e) {
+    return e.what();
+  } catch (...) {
+    return "Unknown error!";
+  }
+}
+
+std::optional<FileStamp> getStamp(const std::filesystem::path& path)
+{
+  try {
+    return FileStamp::of(path);
+  } catch (const std::exception&) {
+    return std::nullopt;
+  }
+}
+
+// Locks every path, in a fixed order so batches can't deadlock.
+std::vector<PathLock> lockPaths(
+    WarmState* warm, 
+    std::vector<std::filesystem::path> paths)
+{
+  std::vector<PathLock> locks;
+  if (!warm) {
+    return locks;
+  }
+  for (auto& path: paths) {
+    path = path.lexically_normal();
+  }
+  std::sort(paths.begin(), paths.end());
+  paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+  for (const auto& path: paths) {
+    locks.push_back(warm->lockPath(path));
+  }
+  return locks;
+}
+
+// Installs (or only checks) a dylib. Destinations that were up to date
+// are remembered until either file changes.
+bool install(
+    const config::Dylib& dylib, 
+    const std::filesystem::path& destination, 
+    const FileDigest& digest,
+    const BatchOptions& options)
+{
+  std::optional<FileStamp> sourceStamp;
+  std::optional<FileStamp> destinationStamp;
+  if (options.warm) {
+    sourceStamp = getStamp(dylib.path);
+    destinationStamp = getStamp(destination);
+    if (sourceStamp && destinationStamp && 
+        options.warm->isKnownInstalled(dylib.path, *sourceStamp, destination, *destinationStamp)) {
+      return false;
+    }
+  }
+
+  const bool changed = options.check 
+    ? !isDylibInstalled(dylib, destination, digest)
+    : installDylib(dylib, destination, digest, options.hardlink);
+  if (!changed && sourceStamp && destinationStamp) {
+    options.warm->setInstalled(dylib.path, *sourceStamp, destination, *destinationStamp);
+  }
+  return changed;
+}
+
+// Whether `output` is patched, remembered until it changes.
+bool isOutputPatched(
+    const config::Config& config, 
+    const std::filesystem::path& output, 
+    const BatchOptions& options)
+{
+  if (!options.warm) {
+    return isPatched(config, output);
+  }
+  const auto stamp = FileStamp::of(output);
+  if (options.warm->isKnownPatched(config, output, stamp)) {
+    return true;
+  }
+  const bool patched = isPatched(config, output);
+  if (patched) {
+    options.warm->setPatched(config, output, stamp);
+  }
+  return patched;
+}
+
+// Whether `output` holds `target` patched by `config`, so writing it again
+// wouldn't change it. Outputs that can't be read are out of date.
+bool isOutputCurrent(
+    const config::Config& config, 
+    const std::filesystem::path& target, 
+    const std::filesystem::path& output, 
+    const BatchOptions& options)
+{
+  try {
+    return !isOutputStale(target, output) && isOutputPatched(config, output, options);
+  } catch (const std::exception&) {
+    return false;
+  }
+}
+
+// Patches `target` in place, unless it is known to be up to date.
+bool patchInPlace(
+    const config::Config& config, 
+    const std::filesystem::path& target, 
+    const BatchOptions& options,
+    IoStats& io)
+{
+  if (!options.warm) {
+    return patchMachO(config, target, options.io, &io, options.journal);
+  }
+  const auto stamp = FileStamp::of(target);
+  if (options.warm->isKnownPatched(config, target, stamp)) {
+    return false;
+  }
+  const bool changed = patchMachO(config, target, options.io, &io, options.journal);
+  if (!changed) {
+    options.warm->setPatched(config, target, stamp);
+  }
+  return changed;
+}
+
+// Patches one binary with the configs of several results as a single
+// transaction, so it's only parsed and written back once. A config that
+// fails is left out, the others are still written.
+template <typename FailFn, typename ChangeFn>
+void patchTogether(
+    const std::vector<std::size_t>& group,
+    std::vector<TargetResult>& results,
+    const std::vector<const config::Config*>& resultConfigs,
+    const BatchOptions& options,
+    FailFn fail,
+    ChangeFn change)
+{
+  std::vector<std::size_t> pending;
+  for (const auto result: group) {
+    if (results[result].ok()) {
+      pending.push_back(result);
+    }
+  }
+  if (pending.empty()) {
+    return;
+  }
+
+  const auto target = results[pending.front()].target;
+  const auto output = results[pending.front()].output;
+  const bool inPlace = options.outputDirectory.empty();
+  const auto path = inPlace ? target : getTempPath(output);
+  try {
+    if (!std::filesystem::exists(target)) {
+      throw std::runtime_error("Target path does not exist!");
+    }
+    // An output is only written again when some config isn't current in it.
+    std::vector<std::size_t> outdated;
+    for (const auto result: pending) {
+      if (inPlace || !isOutputCurrent(*resultConfigs[result], target, output, options)) {
+        outdated.push_back(result);
+      }
+    }
+    if (outdated.empty()) {
+      return;
+    }
+    if (!inPlace) {
+      cloneFile(target, path);
+    }
+
+    std::optional<FileStamp> stamp;
+    if (inPlace && options.warm) {
+      stamp = FileStamp::of(target);
+    }
+    MachOImage image(path, output.filename().string());
+    std::vector<std::size_t> applied;
+    for (const auto result: pending) {
+      trace::Scope scope(trace::Phase::Target, results[result].target.string());
+      const auto& config = *resultConfigs[result];
+      if (stamp && options.warm->isKnownPatched(config, target, *stamp)) {
+        continue;
+      }
+      try {
+        if (image.apply(config)) {
+          applied.push_back(result);
+        } else if (stamp && applied.empty()) {
+          options.warm->setPatched(config, target, *stamp);
+        }
+      } catch (...) {
+        fail(result, describeException(std::current_exception()));
+        // The failed config rolled back the whole image.
+        for (const auto other: applied) {
+          image.apply(*resultConfigs[other]);
+        }
+      }
+    }
+    image.commit(&results[pending.front()].io, inPlace && options.journal);
+
+    if (inPlace) {
+      for (const auto result: applied) {
+        change(result);
+      }
+      return;
+    }
+    syncFile(path);
+    std::filesystem::rename(path, output);
+    syncFile(output.parent_path().empty() ? "." : output.parent_path());
+    for (const auto result: outdated) {
+      change(result);
+    }
+  } catch (...) {
+    if (!inPlace) {
+      std::error_code error;
+      std::filesystem::remove(path, error);
+    }
+    const auto error = describeException(std::current_exception());
+    for (const auto result: pending) {
+      fail(result, error);
+    }
+  }
+}
+
+// Whether `path` is one of the config's hook dylibs, or a copy of one
+// installed next to another binary.
+bool isHookDylib(const config::Config& config, const std::filesystem::path& path)
+{
+  for (const auto& dylib: config.dylibs) {
+    std::error_code error;
+    if (path.filename() == std::filesystem::path(dylib.installName).filename() ||
+        std::filesystem::equivalent(path, dylib.path, error)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+struct FoundTarget
+{
+  std::filesystem::path target;
+  std::filesystem::path output;
+  // Set when the binary couldn't be read.
+  std::string error;
+};
+
+// The Mach-Os below the config's directories that import a hooked symbol.
+// Everything else is skipped once its imports are read, without writing
+// anything. With an output directory, the found binaries keep their path
+// relative to (and including) the directory they were found in.
+std::vector<FoundTarget> findTargets(const config::Config& config, const BatchOptions& options)
+{
+  std::unordered_set<std::string_view> exactSymbols;
+  for (const auto& hook: config.hooks) {
+    if (hook.kind == PatternKind::Exact) {
+      exactSymbols.insert(config.getSymbol(hook));
+    }
+  }
+  auto isHooked = [&](std::string_view symbol) {
+    return exactSymbols.count(symbol) || config.matchPattern(symbol);
+  };
+
+  std::unordered_set<std::string> explicitTargets;
+  for (const auto& target: config.targets) {
+    explicitTargets.insert(target.lexically_normal().string());
+  }
+
+  std::vector<FoundTarget> found;
+  for (const auto& directory: config.directories) {
+    const auto root = directory.lexically_normal();
+    const auto rootName = root.has_filename() ? root.filename() : root.parent_path().filename();
+    auto getOutput = [&](const std::filesystem::path& binary) {
+      return options.outputDirectory.empty() 
+        ? binary 
+        : options.outputDirectory / rootName / binary.lexically_relative(root);
+    };
+
+    std::vector<std::filesystem::path> binaries;
+    try {
+      trace::Scope scope(trace::Phase::Discover, root.string());
+      binaries = findMachOs(root, options.jobs);
+    } catch (...) {
+      found.push_back({root, getOutput(root), describeException(std::current_exception())});
+      continue;
+    }
+
+    std::vector<char> hooked(binaries.size());
+    std::vector<std::string> errors(binaries.size());
+    parallelFor(binaries.size(), options.jobs, [&](std::size_t index) {
+      const auto& binary = binaries[index];
+      if (explicitTargets.count(binary.string()) || isHookDylib(config, binary)) {
+        return;
+      }
+      trace::Scope scope(trace::Phase::Discover, binary.string());
+      try {
+        const auto imageIndex = options.warm ? options.warm->getIndex(binary) : indexMachO(binary);
+        for (std::size_t slice = 0; slice < imageIndex.getSliceCount() && !hooked[index]; slice++) {
+          for (const auto& import: imageIndex.getImports(slice)) {
+            if (isHooked(import.symbol)) {
+              hooked[index] = true;
+              break;
+            }
+          }
+        }
+      } catch (...) {
+        errors[index] = describeException(std::current_exception());
+        hooked[index] = true;
+      }
+    });
+
+    for (std::size_t index = 0; index < binaries.size(); index++) {
+      if (hooked[index]) {
+        found.push_back({binaries[index], getOutput(binaries[index]), std::move(errors[index])});
+      }
+    }
+  }
+  return found;
+}
+
+struct DylibExportsResult
+{
+  std::optional<DylibExports> exports;
+  // Set when the dylib couldn't be read.
+  std::string error;
+};
+
+// Lists the symbols `config` hooks that their dylib doesn't export in
+// one of `archs`, or why the dylib couldn't be read. Patterns only match
+// imports once a target is patched, so only exact hooks are checked.
+std::string findMissingExports(
+    const config::Config& config, 
+    const std::map<std::filesystem::path, DylibExportsResult>& exports,
+    const std::vector<std::string>& archs)
+{
+  constexpr std::size_t kMaxListed = 8;
+
+  std::vector<std::string> missing;
+  for (const auto& hook: config.hooks) {
+    if (hook.kind != PatternKind::Exact) {
+      continue;
+    }
+    const auto& dylib = config.getDylib(hook);
+    const auto& result = exports.at(dylib.path);
+    if (!result.exports.has_value()) {
+      return "Can't read exports of " + dylib.path.string() + ": " + result.error;
+    }
+    const auto missingArchs = result.exports->findMissing(config.getSymbol(hook), archs);
+    if (missingArchs.empty()) {
+      continue;
+    }
+    auto entry = std::string(config.getSymbol(hook)) + " from " + dylib.name;
+    // Archs are only listed when the symbol is there in some of them.
+    const auto checked = archs.empty() ? result.exports->getSlices().size() : archs.size();
+    if (missingArchs.size() != checked) {
+      for (std::size_t index = 0; index < missingArchs.size(); index++) {
+        entry += (index ? ", " : " (") + missingArchs[index];
+      }
+      entry += ")";
+    }
+    missing.push_back(std::move(entry));
+  }
+
+  if (missing.empty()) {
+    return {};
+  }
+  std::string error = "Hooked symbols not exported: ";
+  for (std::size_t index = 0; index < std::min(missing.size(), kMaxListed); index++) {
+    error += (index ? ", " : "") + missing[index];
+  }
+  if (missing.size() > kMaxListed) {
+    error += " and " + std::to_string(missing.size() - kMaxListed) + " more";
+  }
+  return error;
+}
+
+struct SourceDigest
+{
+  FileDigest digest{0, 0};
+  // Set when the source couldn't be read.
+  std::string error;
+};
+
+struct InstallTask
+{
+  const config::Dylib* dylib;
+  std::vector<std::size_t> results;
+};
+
+}
+
+std::vector<TargetResult> patchTargets(
+    const std::vector<config::Config>& configs,
+    const BatchOptions& options)
+{
+  std::vector<const config::Config*> configPtrs;
+  for (const auto& config: configs) {
+    configPtrs.push_back(&config);
+  }
+  return patchTargets(configPtrs, options);
+}
+
+std::vector<TargetResult> patchTargets(
+    const std::vector<const config::Config*>& configs,
+    const BatchOptions& options)
+{
+  std::vector<TargetResult> results;
+  std::vector<const config::Config*> resultConfigs;
+  for (const auto* config: configs) {
+    for (const auto& target: config->targets) {
+      const auto output = options.outputDirectory.empty() 
+        ? target 
+        : options.outputDirectory / target.filename();
+      results.push_back({target, output, {}, false, {}});
+      resultConfigs.push_back(config);
+    }
+    for (auto& found: findTargets(*config, options)) {
+      if (!options.check && !options.outputDirectory.empty()) {
+        std::error_code error;
+        std::filesystem::create_directories(found.output.parent_path(), error);
+      }
+      results.push_back({std::move(found.target), std::move(found.output), std::move(found.error), false, {}});
+      resultConfigs.push_back(config);
+    }
+  }
+
+  std::mutex resultMutex;
+  auto fail = [&](std::size_t result, const std::string& error) {
+    std::lock_guard<std::mutex> lock(resultMutex);
+    if (results[result].ok()) {
+      results[result].error = error;
+    }
+  };
+  auto change = [&](std::size_t result) {
+    std::lock_guard<std::mutex> lock(resultMutex);
+    results[result].changed = true;
+  };
+
+  // Every hook has to be exported by its dylib, which is checked before
+  // anything is written. Each dylib is read once, straight from a mapping.
+  std::map<std::filesystem::path, DylibExportsResult> exports;
+  for (const auto* config: configs) {
+    for (const auto& hook: config->hooks) {
+      if (hook.kind == PatternKind::Exact) {
+        exports.emplace(config->getDylib(hook).path, DylibExportsResult{});
+      }
+    }
+  }
+  std::vector<std::pair<const std::filesystem::path, DylibExportsResult>*> exportsList;
+  for (auto& entry: exports) {
+    exportsList.push_back(&entry);
+  }
+  parallelFor(exportsList.size(), options.jobs, [&](std::size_t index) {
+    auto& [path, result] = *exportsList[index];
+    trace::Scope scope(trace::Phase::Exports, path.string());
+    try {
+      result.exports = options.warm ? options.warm->getExports(path) : readExports(path);
+    } catch (...) {
+      result.error = describeException(std::current_exception());
+    }
+  });
+  // Only the slices that get patched are checked. A target that can't be
+  // read, or has none of the configured archs, fails when it's patched.
+  std::map<std::pair<const config::Config*, std::vector<std::string>>, std::string> exportErrors;
+  for (std::size_t result = 0; result < results.size(); result++) {
+    if (!results[result].ok()) {
+      continue;
+    }
+    const auto* config = resultConfigs[result];
+    std::vector<std::string> archs;
+    try {
+      archs = getArchNames(results[result].target);
+    } catch (...) {
+      continue;
+    }
+    if (!config->archs.empty()) {
+      archs.erase(std::remove_if(archs.begin(), archs.end(), [config](const std::string& arch) {
+        return std::find(config->archs.begin(), config->archs.end(), arch) == config->archs.end();
+      }), archs.end());
+    }
+    if (archs.empty()) {
+      continue;
+    }
+    auto it = exportErrors.find({config, archs});
+    if (it == exportErrors.end()) {
+      it = exportErrors.emplace(
+          std::make_pair(config, archs), findMissingExports(*config, exports, archs)).first;
+    }
+    if (!it->second.empty()) {
+      fail(result, it->second);
+    }
+  }
+
+  // Dylibs are installed next to the patched binaries. Those sharing a
+  // directory install the same dylibs, so every destination is only
+  // installed once.
+  std::map<std::filesystem::path, InstallTask> installs;
+  for (std::size_t result = 0; result < results.size(); result++) {
+    if (!results[result].ok()) {
+      continue;
+    }
+    for (const auto& dylib: resultConfigs[result]->dylibs) {
+      const auto destination = 
+        getInstallPath(dylib, results[result].output).lexically_normal();
+      auto& install = installs[destination];
+      if (!install.dylib) {
+        install.dylib = &dylib;
+      } else if (install.dylib->path != dylib.path) {
+        fail(result, "Conflicting dylibs installed to " + destination.string());
+        continue;
+      }
+      install.results.push_back(result);
+    }
+  }
+
+  // Every source dylib is hashed once, no matter how many targets use it.
+  std::map<std::filesystem::path, SourceDigest> digests;
+  for (const auto& install: installs) {
+    digests.emplace(install.second.dylib->path, SourceDigest{});
+  }
+  std::vector<std::pair<const std::filesystem::path, SourceDigest>*> digestList;
+  for (auto& digest: digests) {
+    digestList.push_back(&digest);
+  }
+  parallelFor(digestList.size(), options.jobs, [&](std::size_t index) {
+    auto& [path, source] = *digestList[index];
+    trace::Scope scope(trace::Phase::Digest, path.string());
+    try {
+      source.digest = options.warm ? options.warm->getDigest(path) : digestFile(path);
+    } catch (...) {
+      source.error = describeException(std::current_exception());
+    }
+  });
+
+  std::vector<std::pair<const std::filesystem::path, InstallTask>*> installList;
+  for (auto& install: installs) {
+    installList.push_back(&install);
+  }
+  parallelFor(installList.size(), options.jobs, [&](std::size_t index) {
+    const auto& [destination, install] = *installList[index];
+    trace::Scope scope(trace::Phase::Install, destination.string());
+    try {
+      const auto& source = digests.at(install.dylib->path);
+      if (!source.error.empty()) {
+        throw std::runtime_error(source.error);
+      }
+      const auto locks = lockPaths(options.warm, {destination});
+      if (weedless::install(*install.dylib, destination, source.digest, options)) {
+        for (const auto result: install.results) {
+          change(result);
+        }
+      }
+    } catch (...) {
+      const auto error = describeException(std::current_exception());
+      for (const auto result: install.results) {
+        fail(result, error);
+      }
+    }
+  });
+
+  // The same binary can be listed by several configs; those are patched
+  // together.
+  std::map<std::filesystem::path, std::vector<std::size_t>> groups;
+  for (std::size_t result = 0; result < results.size(); result++) {
+    auto& group = groups[results[result].output.lexically_normal()];
+    if (!group.empty() && 
+        results[group.front()].target.lexically_normal() != results[result].target.lexically_normal()) {
+      fail(result, "Conflicting targets written to " + results[result].output.string());
+      continue;
+    }
+    group.push_back(result);
+  }
+
+  std::vector<const std::vector<std::size_t>*> groupList;
+  for (const auto& group: groups) {
+    groupList.push_back(&group.second);
+  }
+  parallelFor(groupList.size(), options.jobs, [&](std::size_t index) {
+    const auto& first = results[groupList[index]->front()];
+    const auto locks = lockPaths(options.warm, {first.target, first.output});
+    if (!options.check && groupList[index]->size() > 1) {
+      patchTogether(*groupList[index], results, resultConfigs, options, fail, change);
+      return;
+    }
+
+    for (const auto result: *groupList[index]) {
+      if (!results[result].ok()) {
+        continue;
+      }
+      trace::Scope scope(trace::Phase::Target, results[result].target.string());
+      try {
+        const auto& config = *resultConfigs[result];
+        const auto& target = results[result].target;
+        const auto& output = results[result].output;
+        if (!std::filesystem::exists(target)) {
+          throw std::runtime_error("Target path does not exist!");
+        }
+
+        // Each result is only touched by the thread patching its group.
+        auto& io = results[result].io;
+        bool changed = true;
+        if (options.check) {
+          changed = !isOutputCurrent(config, target, output, options);
+        } else if (!options.outputDirectory.empty()) {
+          changed = !isOutputCurrent(config, target, output, options) &&
+            patchMachOTo(config, target, output, options.io, &io);
+        } else {
+          changed = patchInPlace(config, target, options, io);
+        }
+        if (changed) {
+          change(result);
+        }
+      } catch (...) {
+        fail(result, describeException(std::current_exception()));
+      }
+    }
+  });
+
+  return results;
+}
+}
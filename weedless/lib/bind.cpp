@@ -0,0 +1,563 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "bind.h"
+
+// c
+#include <cstring>
+
+// stl
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+// weedless
+#include "loadcommands.h"
+#include "machodefs.h"
+#include "scan.h"
+#include "trace.h"
+#include "uleb.h"
+
+namespace weedless {
+namespace {
+
+// Bytes at the start of a stream the number of bindings is estimated from.
+constexpr std::size_t kSampleSize = 64 * 1024;
+
+enum class Operand : std::uint8_t 
+{ 
+  None, 
+  Uleb, 
+  Sleb, 
+  Symbol, 
+  UlebTimesUleb, 
+  Threaded, 
+  Invalid 
+};
+
+struct OpcodeInfo
+{
+  Operand operand;
+  bool binds;
+};
+
+// Indexed by opcode >> 4.
+constexpr OpcodeInfo kOpcodes[16] = {
+  {Operand::None, false},           // BIND_OPCODE_DONE
+  {Operand::None, false},           // BIND_OPCODE_SET_DYLIB_ORDINAL_IMM
+  {Operand::Uleb, false},           // BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB
+  {Operand::None, false},           // BIND_OPCODE_SET_DYLIB_SPECIAL_IMM
+  {Operand::Symbol, false},         // BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM
+  {Operand::None, false},           // BIND_OPCODE_SET_TYPE_IMM
+  {Operand::Sleb, false},           // BIND_OPCODE_SET_ADDEND_SLEB
+  {Operand::Uleb, false},           // BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB
+  {Operand::Uleb, false},           // BIND_OPCODE_ADD_ADDR_ULEB
+  {Operand::None, true},            // BIND_OPCODE_DO_BIND
+  {Operand::Uleb, true},            // BIND_OPCODE_DO_BIND_ADD_ADDR_ULEB
+  {Operand::None, true},            // BIND_OPCODE_DO_BIND_ADD_ADDR_IMM_SCALED
+  {Operand::UlebTimesUleb, true},   // BIND_OPCODE_DO_BIND_ULEB_TIMES_SKIPPING_ULEB
+  {Operand::Threaded, false},       // BIND_OPCODE_THREADED
+  {Operand::Invalid, false},
+  {Operand::Invalid, false},
+};
+
+// A single opcode with its operands, `start` and `end` delimit its bytes.
+struct Opcode
+{
+  const std::uint8_t* start;
+  const std::uint8_t* end;
+  std::uint8_t opcode;
+  std::uint8_t immediate;
+  std::uint64_t operand;
+  std::uint64_t skip;
+  bool binds;
+};
+
+template <typename Scanner>
+Opcode readOpcode(const std::uint8_t* p, const std::uint8_t* end)
+{
+  Opcode op {};
+  op.start = p;
+  op.opcode = *p & BIND_OPCODE_MASK;
+  op.immediate = *p & BIND_IMMEDIATE_MASK;
+  const auto& opcodeInfo = kOpcodes[op.opcode >> 4];
+  op.binds = opcodeInfo.binds;
+  p++;
+
+  switch (opcodeInfo.operand) {
+    case Operand::None:
+      break;
+    case Operand::Uleb:
+      op.operand = Scanner::readUleb(p, end);
+      break;
+    case Operand::Sleb:
+      Scanner::skipLeb(p, end);
+      break;
+    case Operand::Symbol: {
+      const auto* nul = Scanner::findNul(p, end);
+      if (!nul) {
+        throw std::runtime_error("Unterminated symbol name in bind opcodes!");
+      }
+      p = nul + 1;
+      break;
+    }
+    case Operand::UlebTimesUleb:
+      op.operand = Scanner::readUleb(p, end);
+      op.skip = Scanner::readUleb(p, end);
+      break;
+    case Operand::Threaded:
+      if (op.immediate == BIND_SUBOPCODE_THREADED_SET_BIND_ORDINAL_TABLE_SIZE_ULEB) {
+        Scanner::readUleb(p, end);
+      } else if (op.immediate != BIND_SUBOPCODE_THREADED_APPLY) {
+        throw std::runtime_error("Unknown threaded bind opcode!");
+      }
+      break;
+    case Operand::Invalid:
+      throw std::runtime_error("Unknown bind opcode!");
+  }
+
+  op.end = p;
+  return op;
+}
+
+bool isOrdinalOpcode(std::uint8_t opcode)
+{
+  return opcode == BIND_OPCODE_SET_DYLIB_ORDINAL_IMM ||
+         opcode == BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB ||
+         opcode == BIND_OPCODE_SET_DYLIB_SPECIAL_IMM;
+}
+
+std::int32_t getOrdinal(const Opcode& op)
+{
+  switch (op.opcode) {
+    case BIND_OPCODE_SET_DYLIB_ORDINAL_IMM:
+      return op.immediate;
+    case BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB:
+      return op.operand;
+    default:
+      return op.immediate ? (std::int8_t)(BIND_OPCODE_MASK | op.immediate) : 0;
+  }
+}
+
+std::pair<const std::uint8_t*, const std::uint8_t*> getStream(
+    const std::uint8_t* machHeader, 
+    std::size_t machOSize,
+    std::uint32_t offset, 
+    std::uint32_t size)
+{
+  if (offset > machOSize || size > machOSize - offset) {
+    throw std::runtime_error("Bind opcodes exceed the image!");
+  }
+  return {machHeader + offset, machHeader + offset + size};
+}
+
+// Every binding comes with the NUL ending its symbol name, and in the lazy
+// stream with a DONE opcode. Estimates the bindings in a stream from the
+// NULs at its start, capped at the most a stream of that size can name (an
+// opcode, a one character name and a bind each).
+std::size_t estimateBindings(const std::uint8_t* p, const std::uint8_t* end, BindStream stream)
+{
+  const std::size_t size = end - p;
+  if (size == 0) {
+    return 0;
+  }
+  const auto sampleSize = std::min(size, kSampleSize);
+  auto nuls = scan::countNuls(p, p + sampleSize) * size / sampleSize;
+  if (stream == BindStream::LazyBind) {
+    nuls /= 2;
+  }
+  return std::min(nuls, size / 4);
+}
+
+// Returns the number of opcodes decoded. Binds advance by the pointer size
+// of `Layout`.
+template <typename Layout, typename Scanner>
+std::size_t decodeStream(
+    const std::uint8_t* machHeader, 
+    const std::uint8_t* p,
+    const std::uint8_t* end,
+    BindStream stream,
+    std::vector<BindingInfo>& bindingInfos)
+{
+  constexpr std::uint64_t kPointerSize = Layout::kPointerSize;
+  std::size_t opcodes = 0;
+
+  BindingInfo current {};
+  current.stream = stream;
+  // Set once `current` has been recorded; cleared when the symbol or the
+  // ordinal changes.
+  bool recorded = false;
+
+  while (p < end) {
+    const auto op = readOpcode<Scanner>(p, end);
+    p = op.end;
+    opcodes++;
+
+    switch (op.opcode) {
+      case BIND_OPCODE_DONE: {
+        // Lazy bindings are separate entries that each end with DONE, the
+        // other streams are done at the first one.
+        if (stream != BindStream::LazyBind) { 
+          return opcodes; 
+        }
+        current = {};
+        current.stream = stream;
+        recorded = false;
+        // Entries are padded with more DONE opcodes, which do nothing.
+        const auto* next = Scanner::skipZeros(p, end);
+        opcodes += next - p;
+        p = next;
+        break;
+      }
+      case BIND_OPCODE_SET_DYLIB_ORDINAL_IMM:
+      case BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB:
+      case BIND_OPCODE_SET_DYLIB_SPECIAL_IMM: {
+        current.ordinalOffset = op.start - machHeader;
+        current.ordinalSize = op.end - op.start;
+        current.dylibIndex = getOrdinal(op);
+        recorded = false;
+        break;
+      }
+      case BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM: {
+        current.symbolOffset = op.start + 1 - machHeader;
+        current.symbolFlags = op.immediate;
+        recorded = false;
+        break;
+      }
+      case BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB: {
+        current.segmentIndex = op.immediate;
+        current.segmentOffset = op.operand;
+        break;
+      }
+      case BIND_OPCODE_ADD_ADDR_ULEB: {
+        current.segmentOffset += op.operand;
+        break;
+      }
+      default:
+        break;
+    }
+
+    if (!op.binds) {
+      continue;
+    }
+
+    if (!recorded && current.symbolOffset != 0) {
+      current.bindOffset = op.start - machHeader;
+      bindingInfos.push_back(current);
+      recorded = true;
+    }
+
+    switch (op.opcode) {
+      case BIND_OPCODE_DO_BIND:
+        current.segmentOffset += kPointerSize;
+        break;
+      case BIND_OPCODE_DO_BIND_ADD_ADDR_ULEB:
+        current.segmentOffset += kPointerSize + op.operand;
+        break;
+      case BIND_OPCODE_DO_BIND_ADD_ADDR_IMM_SCALED:
+        current.segmentOffset += kPointerSize + op.immediate * kPointerSize;
+        break;
+      case BIND_OPCODE_DO_BIND_ULEB_TIMES_SKIPPING_ULEB:
+        current.segmentOffset += op.operand * (kPointerSize + op.skip);
+        break;
+    }
+  }
+  return opcodes;
+}
+
+template <typename Layout, typename Scanner>
+std::size_t decodeStreams(
+    const std::uint8_t* machHeader, 
+    std::size_t machOSize,
+    const struct dyld_info_command& dyldInfo,
+    std::vector<BindingInfo>& bindingInfos)
+{
+  const std::pair<std::uint32_t, std::uint32_t> ranges[] = {
+    {dyldInfo.bind_off, dyldInfo.bind_size},
+    {dyldInfo.weak_bind_off, dyldInfo.weak_bind_size},
+    {dyldInfo.lazy_bind_off, dyldInfo.lazy_bind_size},
+  };
+  const BindStream kinds[] = {BindStream::Bind, BindStream::WeakBind, BindStream::LazyBind};
+
+  // Sizing the result up front saves growing it one binding at a time.
+  std::pair<const std::uint8_t*, const std::uint8_t*> streams[3] = {};
+  std::size_t estimate = 0;
+  for (std::size_t index = 0; index < 3; index++) {
+    if (ranges[index].second != 0) {
+      streams[index] = getStream(machHeader, machOSize, ranges[index].first, ranges[index].second);
+      estimate += estimateBindings(streams[index].first, streams[index].second, kinds[index]);
+    }
+  }
+  bindingInfos.reserve(estimate + estimate / 8);
+
+  std::size_t opcodes = 0;
+  for (std::size_t index = 0; index < 3; index++) {
+    opcodes += decodeStream<Layout, Scanner>(
+        machHeader, streams[index].first, streams[index].second, kinds[index], bindingInfos);
+  }
+  return opcodes;
+}
+
+bool canSetDylibIndex(const BindingInfo& info, std::int64_t index)
+{
+  if (index <= 0) {
+    return false;
+  }
+  if (info.ordinalSize == 1) {
+    return index <= BIND_IMMEDIATE_MASK;
+  }
+  // Keep the ULEB at its current length so the stream doesn't move.
+  return uleb128_size(index) <= info.ordinalSize - 1u;
+}
+
+void setDylibIndex(std::uint8_t* machHeader, const BindingInfo& info, std::uint64_t index)
+{
+  auto* opcodePtr = machHeader + info.ordinalOffset;
+  if (info.ordinalSize == 1) {
+    *opcodePtr = BIND_OPCODE_SET_DYLIB_ORDINAL_IMM | (index & BIND_IMMEDIATE_MASK);
+  } else {
+    write_uleb128(opcodePtr + 1, index, info.ordinalSize - 1);
+  }
+}
+
+void appendUleb(std::vector<std::uint8_t>& stream, std::uint64_t value)
+{
+  std::uint8_t buffer[16];
+  const auto size = write_uleb128(buffer, value, 0);
+  stream.insert(stream.end(), buffer, buffer + size);
+}
+
+void appendOrdinal(std::vector<std::uint8_t>& stream, std::int64_t index)
+{
+  if (index <= 0) {
+    stream.push_back(BIND_OPCODE_SET_DYLIB_SPECIAL_IMM | (index & BIND_IMMEDIATE_MASK));
+  } else if (index <= BIND_IMMEDIATE_MASK) {
+    stream.push_back(BIND_OPCODE_SET_DYLIB_ORDINAL_IMM | index);
+  } else {
+    stream.push_back(BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB);
+    appendUleb(stream, index);
+  }
+}
+
+// Re-encodes the bind stream with every binding pointing at its hooked
+// ordinal. The original ordinal opcodes are dropped and a new one is
+// emitted before every bind whose ordinal differs from the one in effect.
+// `eagerBinds` are appended as regular bindings.
+std::vector<std::uint8_t> encodeBindStream(
+    const std::uint8_t* machHeader,
+    const struct dyld_info_command& dyldInfo,
+    const SymbolOrdinals& hookOrdinals,
+    const std::vector<std::pair<const BindingInfo*, std::size_t>>& eagerBinds)
+{
+  std::vector<std::uint8_t> stream;
+  stream.reserve(dyldInfo.bind_size + eagerBinds.size() * 32);
+
+  // The stream was bounds checked when it was decoded.
+  const std::uint8_t* p = machHeader + dyldInfo.bind_off;
+  const std::uint8_t* end = p + dyldInfo.bind_size;
+
+  std::int64_t originalIndex = 0;
+  std::int64_t emittedIndex = 0;
+  const char* symbolName = nullptr;
+  bool hasAddend = false;
+
+  while (p < end) {
+    const auto op = readOpcode<scan::ScalarScanner>(p, end);
+    p = op.end;
+
+    if (op.opcode == BIND_OPCODE_DONE) {
+      break;
+    }
+    if (op.opcode == BIND_OPCODE_THREADED) {
+      throw std::runtime_error("Can't re-encode threaded bind opcodes (not supported)");
+    }
+    if (isOrdinalOpcode(op.opcode)) {
+      originalIndex = getOrdinal(op);
+      continue;
+    }
+    if (op.opcode == BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM) {
+      symbolName = (const char*)op.start + 1;
+    }
+    if (op.opcode == BIND_OPCODE_SET_ADDEND_SLEB) {
+      hasAddend = true;
+    }
+
+    if (op.binds) {
+      std::int64_t index = originalIndex;
+      if (symbolName) {
+        auto it = hookOrdinals.find(symbolName);
+        if (it != hookOrdinals.end()) {
+          index = it->second;
+        }
+      }
+      if (index != emittedIndex) {
+        appendOrdinal(stream, index);
+        emittedIndex = index;
+      }
+    }
+    stream.insert(stream.end(), op.start, op.end);
+  }
+
+  if (!eagerBinds.empty()) {
+    stream.push_back(BIND_OPCODE_SET_TYPE_IMM | BIND_TYPE_POINTER);
+    if (hasAddend) {
+      stream.push_back(BIND_OPCODE_SET_ADDEND_SLEB);
+      stream.push_back(0);
+    }
+  }
+  for (const auto& [info, index] : eagerBinds) {
+    const char* name = getSymbolName(machHeader, *info);
+    stream.push_back(BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB | info->segmentIndex);
+    appendUleb(stream, info->segmentOffset);
+    if ((std::int64_t)index != emittedIndex) {
+      appendOrdinal(stream, index);
+      emittedIndex = index;
+    }
+    stream.push_back(BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM | info->symbolFlags);
+    stream.insert(stream.end(), name, name + strlen(name) + 1);
+    stream.push_back(BIND_OPCODE_DO_BIND);
+  }
+
+  stream.push_back(BIND_OPCODE_DONE);
+  return stream;
+}
+
+}
+
+template <typename Layout>
+std::vector<BindingInfo> getBindingInfo(
+    const std::uint8_t* machHeader, 
+    std::size_t machOSize,
+    const struct dyld_info_command& dyldInfo)
+{
+  trace::Scope scope(trace::Phase::BindDecode);
+  std::vector<BindingInfo> bindingInfos;
+  const auto opcodes = scan::getLevel() == scan::Level::Scalar
+    ? decodeStreams<Layout, scan::ScalarScanner>(machHeader, machOSize, dyldInfo, bindingInfos)
+    : decodeStreams<Layout, scan::VectorScanner>(machHeader, machOSize, dyldInfo, bindingInfos);
+  trace::count(trace::Counter::OpcodesDecoded, opcodes);
+  trace::count(trace::Counter::SymbolsScanned, bindingInfos.size());
+  return bindingInfos;
+}
+
+template std::vector<BindingInfo> getBindingInfo<MachO64>(
+    const std::uint8_t*, std::size_t, const struct dyld_info_command&);
+template std::vector<BindingInfo> getBindingInfo<MachO32>(
+    const std::uint8_t*, std::size_t, const struct dyld_info_command&);
+
+std::optional<std::vector<std::uint8_t>> rebindSymbols(
+    std::uint8_t* machHeader,
+    const struct dyld_info_command& dyldInfo,
+    const std::vector<BindingInfo>& bindingInfos,
+    const SymbolOrdinals& hookOrdinals)
+{
+  trace::Scope scope(trace::Phase::HookMatch);
+  struct Rebind
+  {
+    const BindingInfo* info;
+    std::size_t index;
+  };
+  std::vector<Rebind> rebinds;
+  // Lazy bindings that can't be patched in place are bound eagerly from
+  // the bind stream instead, since the stub helpers refer to lazy bind
+  // entries by offset and the lazy stream can't grow.
+  std::vector<std::pair<const BindingInfo*, std::size_t>> eagerBinds;
+  bool reencodeBinds = false;
+  std::size_t matched = 0;
+
+  // Bindings that share an ordinal opcode are adjacent, so every run of
+  // them can only be rebound as a whole.
+  std::size_t first = 0;
+  while (first < bindingInfos.size()) {
+    const auto& info = bindingInfos[first];
+    std::size_t last = first + 1;
+    while (last < bindingInfos.size() && 
+           bindingInfos[last].ordinalOffset == info.ordinalOffset) {
+      last++;
+    }
+
+    // Weak bindings are resolved by name across all images, there is no
+    // ordinal to redirect.
+    if (info.ordinalOffset == 0) {
+      first = last;
+      continue;
+    }
+
+    std::optional<std::int64_t> newIndex;
+    bool hooked = false;
+    bool shared = false;
+    for (auto i = first; i < last; i++) {
+      auto it = hookOrdinals.find(getSymbolName(machHeader, bindingInfos[i]));
+      std::int64_t index = bindingInfos[i].dylibIndex;
+      if (it != hookOrdinals.end()) {
+        index = it->second;
+        hooked = true;
+        matched++;
+      }
+      if (newIndex.has_value() && *newIndex != index) {
+        shared = true;
+      }
+      newIndex = index;
+    }
+
+    if (hooked && (shared || *newIndex != info.dylibIndex)) {
+      if (!shared && canSetDylibIndex(info, *newIndex)) {
+        rebinds.push_back({&info, (std::size_t)*newIndex});
+      } else if (info.stream == BindStream::Bind) {
+        reencodeBinds = true;
+      } else {
+        for (auto i = first; i < last; i++) {
+          auto it = hookOrdinals.find(getSymbolName(machHeader, bindingInfos[i]));
+          if (it != hookOrdinals.end() && 
+              (std::int64_t)it->second != bindingInfos[i].dylibIndex) {
+            eagerBinds.emplace_back(&bindingInfos[i], it->second);
+          }
+        }
+      }
+    }
+    first = last;
+  }
+  trace::count(trace::Counter::HooksMatched, matched);
+
+  for (const auto& rebind: rebinds) {
+    // The bind stream is re-encoded from the original opcodes as a whole.
+    if (reencodeBinds && rebind.info->stream == BindStream::Bind) {
+      continue;
+    }
+    setDylibIndex(machHeader, *rebind.info, rebind.index);
+  }
+
+  if (!reencodeBinds && eagerBinds.empty()) {
+    return std::nullopt;
+  }
+
+  // Make sure the lazy entries that are now bound eagerly can't be bound
+  // again later (dyld may bind lazy pointers at launch) by ending them
+  // before their DO_BIND.
+  for (const auto& [info, index] : eagerBinds) {
+    machHeader[info->bindOffset] = BIND_OPCODE_DONE;
+  }
+
+  return encodeBindStream(machHeader, dyldInfo, hookOrdinals, eagerBinds);
+}
+}
@@ -0,0 +1,149 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "cache.h"
+
+// stl
+#include <stdexcept>
+
+// c
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// weedless
+#include "copy.h"
+#include "hash.h"
+#include "macho.h"
+
+namespace weedless {
+namespace {
+
+// Maps a whole cache entry read-only, the mapping lives as long as any
+// index using it.
+std::optional<ImageIndex> mapEntry(const std::filesystem::path& path)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return std::nullopt;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    close(fd);
+    return std::nullopt;
+  }
+
+  const auto size = static_cast<std::size_t>(st.st_size);
+  void* ptr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED) {
+    return std::nullopt;
+  }
+
+  std::shared_ptr<const void> mapping(ptr, [size](const void* p) { munmap(const_cast<void*>(p), size); });
+  try {
+    return ImageIndex(std::move(mapping), static_cast<const std::uint8_t*>(ptr), size);
+  } catch (const std::runtime_error&) {
+    // Truncated or from another version, it will be replaced.
+    return std::nullopt;
+  }
+}
+
+void writeAll(int fd, const std::uint8_t* data, std::size_t size)
+{
+  while (size) {
+    const auto written = write(fd, data, size);
+    if (written < 0) {
+      throw std::runtime_error("Unable to write cache entry.");
+    }
+    data += written;
+    size -= written;
+  }
+}
+}
+
+IndexCache::IndexCache(std::filesystem::path directory)
+  : directory(std::move(directory))
+{
+  std::filesystem::create_directories(this->directory);
+}
+
+std::filesystem::path IndexCache::getEntryPath(const std::filesystem::path& target) const
+{
+  const auto key = std::filesystem::absolute(target).lexically_normal().string();
+  return directory / (toHex(hashBytes(key.data(), key.size())) + ".idx");
+}
+
+std::optional<ImageIndex> IndexCache::lookup(const std::filesystem::path& target) const
+{
+  auto index = mapEntry(getEntryPath(target));
+  if (!index.has_value() || index->getStamp() != FileStamp::of(target)) {
+    return std::nullopt;
+  }
+  return index;
+}
+
+void IndexCache::store(const std::filesystem::path& target, const ImageIndex& index) const
+{
+  // Entries are replaced atomically, readers either see the old or the new one.
+  const auto entryPath = getEntryPath(target);
+  const auto tempPath = getTempPath(entryPath);
+
+  int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) {
+    throw std::runtime_error("Unable to create cache entry.");
+  }
+
+  try {
+    writeAll(fd, index.data(), index.size());
+  } catch (...) {
+    close(fd);
+    unlink(tempPath.c_str());
+    throw;
+  }
+  close(fd);
+
+  if (rename(tempPath.c_str(), entryPath.c_str()) != 0) {
+    unlink(tempPath.c_str());
+    throw std::runtime_error("Unable to store cache entry.");
+  }
+}
+
+ImageIndex IndexCache::get(const std::filesystem::path& target) const
+{
+  if (auto index = lookup(target)) {
+    return *index;
+  }
+
+  auto index = indexMachO(target);
+  try {
+    store(target, index);
+  } catch (const std::runtime_error&) {
+    // The cache is only an optimization, a read-only cache directory
+    // shouldn't fail the query.
+  }
+  return index;
+}
+}
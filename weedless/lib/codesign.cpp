@@ -0,0 +1,506 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "codesign.h"
+
+// stl
+#include <algorithm>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+
+namespace weedless {
+namespace {
+
+// Signatures are stored big endian.
+constexpr std::uint32_t kSuperBlobMagic = 0xfade0cc0;
+constexpr std::uint32_t kCodeDirectoryMagic = 0xfade0c02;
+constexpr std::uint32_t kRequirementsMagic = 0xfade0c01;
+constexpr std::uint32_t kBlobWrapperMagic = 0xfade0b01;
+
+// Slots of the blobs in a signature. The code directory holds the hashes
+// of the blobs and of the files outside of the binary in the same slots.
+constexpr std::uint32_t kCodeDirectorySlot = 0;
+constexpr std::uint32_t kInfoSlot = 1;
+constexpr std::uint32_t kRequirementsSlot = 2;
+constexpr std::uint32_t kResourcesSlot = 3;
+constexpr std::uint32_t kApplicationSlot = 4;
+constexpr std::uint32_t kEntitlementsSlot = 5;
+constexpr std::uint32_t kDerEntitlementsSlot = 7;
+constexpr std::uint32_t kAlternateCodeDirectorySlot = 0x1000;
+constexpr std::uint32_t kAlternateCodeDirectoryCount = 5;
+constexpr std::uint32_t kSignatureSlot = 0x10000;
+
+constexpr std::uint32_t kAdHocFlag = 0x2;
+constexpr std::uint64_t kMainBinaryFlag = 0x1;
+constexpr std::uint8_t kSha256Type = 2;
+constexpr std::size_t kHashSize = 32;
+
+// Code directories of this version end with the executable segment.
+constexpr std::uint32_t kCodeDirectoryVersion = 0x20400;
+constexpr std::size_t kCodeDirectorySize = 88;
+constexpr std::size_t kMinimumCodeDirectorySize = 44;
+
+std::uint32_t readBigEndian32(const std::uint8_t* ptr)
+{
+  return (std::uint32_t(ptr[0]) << 24) | (std::uint32_t(ptr[1]) << 16) |
+         (std::uint32_t(ptr[2]) << 8) | std::uint32_t(ptr[3]);
+}
+
+std::uint64_t readBigEndian64(const std::uint8_t* ptr)
+{
+  return (std::uint64_t(readBigEndian32(ptr)) << 32) | readBigEndian32(ptr + 4);
+}
+
+void writeBigEndian32(std::uint8_t* ptr, std::uint32_t value)
+{
+  ptr[0] = value >> 24;
+  ptr[1] = value >> 16;
+  ptr[2] = value >> 8;
+  ptr[3] = value;
+}
+
+void writeBigEndian64(std::uint8_t* ptr, std::uint64_t value)
+{
+  writeBigEndian32(ptr, value >> 32);
+  writeBigEndian32(ptr + 4, value);
+}
+
+struct CodeDirectory
+{
+  std::uint32_t flags;
+  std::string identifier;
+  std::uint8_t pageShift;
+  std::uint64_t codeLimit;
+  std::uint32_t specialSlots;
+  std::uint32_t codeSlots;
+  // Hash of the first page, preceded by the special slots. Only set for
+  // SHA-256 directories.
+  const std::uint8_t* hashes = nullptr;
+  std::optional<std::uint64_t> execSegFlags;
+
+  const std::uint8_t* getSpecialHash(std::uint32_t slot) const
+  {
+    return hashes - slot * kHashSize;
+  }
+};
+
+struct Signature
+{
+  std::optional<CodeDirectory> codeDirectory;
+  // The first directory with SHA-256 hashes, which may be an alternate one.
+  std::optional<CodeDirectory> sha256Directory;
+  std::vector<std::pair<std::uint32_t, std::vector<std::uint8_t>>> entitlements;
+};
+
+std::optional<CodeDirectory> parseCodeDirectory(const std::uint8_t* blob, std::size_t size)
+{
+  if (size < kMinimumCodeDirectorySize || readBigEndian32(blob) != kCodeDirectoryMagic) {
+    return std::nullopt;
+  }
+  const auto version = readBigEndian32(blob + 8);
+  const auto hashOffset = readBigEndian32(blob + 16);
+  const auto identOffset = readBigEndian32(blob + 20);
+  if (identOffset >= size || !memchr(blob + identOffset, '\0', size - identOffset)) {
+    return std::nullopt;
+  }
+
+  CodeDirectory directory;
+  directory.flags = readBigEndian32(blob + 12);
+  directory.identifier = (const char*)blob + identOffset;
+  directory.specialSlots = readBigEndian32(blob + 24);
+  directory.codeSlots = readBigEndian32(blob + 28);
+  directory.codeLimit = readBigEndian32(blob + 32);
+  directory.pageShift = blob[39];
+  if (version >= 0x20300 && size >= 64 && readBigEndian64(blob + 56) != 0) {
+    directory.codeLimit = readBigEndian64(blob + 56);
+  }
+  if (version >= 0x20400 && size >= kCodeDirectorySize) {
+    directory.execSegFlags = readBigEndian64(blob + 80);
+  }
+
+  const auto hashSize = blob[36];
+  const auto hashType = blob[37];
+  if (hashSize == kHashSize && hashType == kSha256Type &&
+      hashOffset >= (std::uint64_t)directory.specialSlots * kHashSize &&
+      hashOffset + (std::uint64_t)directory.codeSlots * kHashSize <= size) {
+    directory.hashes = blob + hashOffset;
+  }
+  return directory;
+}
+
+// Reads the signature of an image. Blobs that don't fit are ignored, a
+// signature without any usable blob reads as empty.
+Signature parseSignature(
+    const std::uint8_t* image, 
+    std::size_t imageSize, 
+    const struct linkedit_data_command* command)
+{
+  Signature signature;
+  if (!command || command->dataoff > imageSize || command->datasize > imageSize - command->dataoff) {
+    return signature;
+  }
+  const auto* superBlob = image + command->dataoff;
+  if (command->datasize < 12 || readBigEndian32(superBlob) != kSuperBlobMagic) {
+    return signature;
+  }
+  const std::uint64_t length = std::min<std::uint32_t>(readBigEndian32(superBlob + 4), command->datasize);
+  const auto count = readBigEndian32(superBlob + 8);
+  if (12 + (std::uint64_t)count * 8 > length) {
+    return signature;
+  }
+
+  for (std::uint32_t index = 0; index < count; index++) {
+    const auto slot = readBigEndian32(superBlob + 12 + index * 8);
+    const auto offset = readBigEndian32(superBlob + 16 + index * 8);
+    if (length < 8 || offset > length - 8) {
+      continue;
+    }
+    const auto* blob = superBlob + offset;
+    const auto blobSize = readBigEndian32(blob + 4);
+    if (blobSize < 8 || blobSize > length - offset) {
+      continue;
+    }
+
+    if (slot == kCodeDirectorySlot || 
+        (slot >= kAlternateCodeDirectorySlot && 
+         slot < kAlternateCodeDirectorySlot + kAlternateCodeDirectoryCount)) {
+      auto directory = parseCodeDirectory(blob, blobSize);
+      if (!directory) {
+        continue;
+      }
+      if (directory->hashes && !signature.sha256Directory) {
+        signature.sha256Directory = directory;
+      }
+      if (slot == kCodeDirectorySlot) {
+        signature.codeDirectory = std::move(directory);
+      }
+    } else if (slot == kEntitlementsSlot || slot == kDerEntitlementsSlot) {
+      signature.entitlements.push_back({slot, {blob, blob + blobSize}});
+    }
+  }
+  return signature;
+}
+
+// Patching only writes the header and load commands, and __LINKEDIT.
+class PatchableRegions
+{
+public:
+  template <typename Layout>
+  explicit PatchableRegions(const LoadCommands<Layout>& commands)
+    : headerEnd(getCommandsEnd(commands))
+  {
+    const auto* linkedit = LoadCommandIndex(commands).linkedit;
+    linkeditStart = linkedit ? linkedit->fileoff : 0;
+  }
+
+  bool containsPage(std::uint32_t pageSize, std::size_t page) const
+  {
+    const std::uint64_t start = (std::uint64_t)page * pageSize;
+    return start < headerEnd || start + pageSize > linkeditStart;
+  }
+
+private:
+  std::uint64_t headerEnd;
+  std::uint64_t linkeditStart;
+};
+
+std::size_t getPageCount(std::uint64_t codeLimit, std::uint32_t pageSize)
+{
+  return (codeLimit + pageSize - 1) / pageSize;
+}
+
+}
+
+template <typename Header>
+bool stripCodeSignature(Header& machHeader, std::size_t machoSize)
+{
+  const LoadCommands commands(machHeader, machoSize);
+  auto* command = LoadCommandIndex(commands).codeSignature;
+  if (!command) {
+    return false;
+  }
+  if (command->dataoff > machoSize || command->datasize > machoSize - command->dataoff) {
+    throw std::runtime_error("Code signature exceeds the image!");
+  }
+
+  auto* base = (std::uint8_t*)&machHeader;
+  memset(base + command->dataoff, 0, command->datasize);
+
+  // The commands behind it move up, the space they leave is zeroed so it
+  // can be used for injecting.
+  auto* commandsEnd = base + sizeof(Header) + machHeader.sizeofcmds;
+  auto* commandStart = (std::uint8_t*)command;
+  const auto cmdSize = command->cmdsize;
+  memmove(commandStart, commandStart + cmdSize, commandsEnd - commandStart - cmdSize);
+  memset(commandsEnd - cmdSize, 0, cmdSize);
+  machHeader.sizeofcmds -= cmdSize;
+  machHeader.ncmds -= 1;
+  return true;
+}
+
+template <typename Header>
+struct linkedit_data_command& addCodeSignatureCommand(Header& machHeader, std::size_t machoSize)
+{
+  const auto commandsEnd = sizeof(Header) + machHeader.sizeofcmds;
+  auto* command = (std::uint8_t*)&machHeader + commandsEnd;
+  const auto cmdSize = sizeof(struct linkedit_data_command);
+  if (commandsEnd > machoSize || cmdSize > machoSize - commandsEnd || 
+      std::any_of(command, command + cmdSize, [](std::uint8_t byte) { return byte != 0; })) {
+    throw std::runtime_error("Not enough space to inject load_command!");
+  }
+
+  struct linkedit_data_command signatureCmd {};
+  signatureCmd.cmd = LC_CODE_SIGNATURE;
+  signatureCmd.cmdsize = cmdSize;
+  memcpy(command, &signatureCmd, cmdSize);
+
+  machHeader.sizeofcmds += cmdSize;
+  machHeader.ncmds += 1;
+  return *(struct linkedit_data_command*)command;
+}
+
+template <typename Layout>
+bool isAdHocSigned(const std::uint8_t* image, std::size_t imageSize, const LoadCommands<Layout>& commands)
+{
+  const auto* command = LoadCommandIndex(commands).codeSignature;
+  const auto directory = parseSignature(image, imageSize, command).sha256Directory;
+  if (!directory || !(directory->flags & kAdHocFlag) || 
+      directory->codeLimit != command->dataoff ||
+      directory->pageShift < 12 || directory->pageShift > 16) {
+    return false;
+  }
+
+  const std::uint32_t pageSize = 1u << directory->pageShift;
+  if (directory->codeSlots != getPageCount(directory->codeLimit, pageSize)) {
+    return false;
+  }
+  const PatchableRegions patchable(commands);
+  for (std::size_t page = 0; page < directory->codeSlots; page++) {
+    if (!patchable.containsPage(pageSize, page)) {
+      continue;
+    }
+    const std::uint64_t offset = (std::uint64_t)page * pageSize;
+    const auto hash = sha256(image + offset, std::min<std::uint64_t>(pageSize, directory->codeLimit - offset));
+    if (memcmp(hash.data(), directory->hashes + page * kHashSize, kHashSize) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <typename Layout>
+AdHocSigner::AdHocSigner(
+    const std::uint8_t* image, 
+    std::size_t imageSize, 
+    const LoadCommands<Layout>& commands, 
+    const std::string& identifier)
+  : identifier(identifier)
+{
+  const LoadCommandIndex index(commands);
+  if (index.text) {
+    execSegBase = index.text->fileoff;
+    execSegLimit = index.text->filesize;
+  }
+  if (((const typename Layout::Header*)image)->filetype == MH_EXECUTE) {
+    execSegFlags = kMainBinaryFlag;
+  }
+
+  auto signature = parseSignature(image, imageSize, index.codeSignature);
+  if (const auto& directory = signature.codeDirectory ? signature.codeDirectory : signature.sha256Directory) {
+    this->identifier = directory->identifier;
+    if (directory->pageShift >= 12 && directory->pageShift <= 16) {
+      pageShift = directory->pageShift;
+    }
+  }
+
+  if (const auto& directory = signature.sha256Directory) {
+    if (directory->execSegFlags) {
+      execSegFlags = *directory->execSegFlags;
+    }
+    for (const auto slot: {kInfoSlot, kResourcesSlot, kApplicationSlot}) {
+      if (slot > directory->specialSlots) {
+        continue;
+      }
+      Sha256 hash;
+      memcpy(hash.data(), directory->getSpecialHash(slot), kHashSize);
+      if (std::any_of(hash.begin(), hash.end(), [](std::uint8_t byte) { return byte != 0; })) {
+        fileHashes.push_back({slot, hash});
+      }
+    }
+    if (directory->pageShift == pageShift) {
+      previousCodeLimit = directory->codeLimit;
+      previousHashes.resize(directory->codeSlots);
+      for (std::size_t page = 0; page < previousHashes.size(); page++) {
+        memcpy(previousHashes[page].data(), directory->hashes + page * kHashSize, kHashSize);
+      }
+    }
+  }
+
+  for (auto& [slot, bytes]: signature.entitlements) {
+    blobs.push_back({slot, std::move(bytes)});
+  }
+  std::sort(blobs.begin(), blobs.end(), [](const Blob& a, const Blob& b) { return a.slot < b.slot; });
+  blobs.erase(
+      std::unique(blobs.begin(), blobs.end(), [](const Blob& a, const Blob& b) { return a.slot == b.slot; }),
+      blobs.end());
+}
+
+std::uint32_t AdHocSigner::getSpecialSlotCount() const
+{
+  std::uint32_t count = kRequirementsSlot;
+  for (const auto& blob: blobs) {
+    count = std::max(count, blob.slot);
+  }
+  for (const auto& [slot, hash]: fileHashes) {
+    count = std::max(count, slot);
+  }
+  return count;
+}
+
+std::size_t AdHocSigner::getSize(std::uint64_t codeLimit) const
+{
+  const auto specialSlots = getSpecialSlotCount();
+
+  std::size_t size = 12 + (3 + blobs.size()) * 8;
+  size += kCodeDirectorySize + identifier.size() + 1;
+  size += (specialSlots + getPageCount(codeLimit, getPageSize())) * kHashSize;
+  // The empty requirement set and CMS blob.
+  size += 12 + 8;
+  for (const auto& blob: blobs) {
+    size += blob.bytes.size();
+  }
+  return size;
+}
+
+template <typename Layout>
+std::vector<std::size_t> AdHocSigner::reuseHashes(
+    const LoadCommands<Layout>& commands, 
+    std::uint64_t codeLimit, 
+    std::vector<Sha256>& hashes) const
+{
+  const auto pageSize = getPageSize();
+  const PatchableRegions patchable(commands);
+  std::vector<std::size_t> pages;
+  for (std::size_t page = 0; page < hashes.size(); page++) {
+    // The previous hash has to cover the same bytes, which the last page
+    // only does when the code didn't grow.
+    const std::uint64_t pageEnd = (std::uint64_t)(page + 1) * pageSize;
+    if (!patchable.containsPage(pageSize, page) && page < previousHashes.size() &&
+        std::min(pageEnd, previousCodeLimit) == std::min(pageEnd, codeLimit)) {
+      hashes[page] = previousHashes[page];
+    } else {
+      pages.push_back(page);
+    }
+  }
+  return pages;
+}
+
+void AdHocSigner::write(std::uint8_t* out, std::uint64_t codeLimit, const std::vector<Sha256>& hashes) const
+{
+  if (codeLimit > UINT32_MAX) {
+    throw std::runtime_error("Image is too large to sign!");
+  }
+  if (hashes.size() != getPageCount(codeLimit, getPageSize())) {
+    throw std::runtime_error("Page hashes don't match the code to sign!");
+  }
+
+  const auto specialSlots = getSpecialSlotCount();
+
+  const auto size = getSize(codeLimit);
+  memset(out, 0, size);
+  const std::uint32_t count = 3 + blobs.size();
+  writeBigEndian32(out, kSuperBlobMagic);
+  writeBigEndian32(out + 4, size);
+  writeBigEndian32(out + 8, count);
+
+  // Blobs follow the index in slot order.
+  std::uint32_t offset = 12 + count * 8;
+  std::uint32_t entry = 0;
+  auto addEntry = [&](std::uint32_t slot, std::size_t blobSize) {
+    writeBigEndian32(out + 12 + entry * 8, slot);
+    writeBigEndian32(out + 16 + entry * 8, offset);
+    entry++;
+    const auto blobOffset = offset;
+    offset += blobSize;
+    return out + blobOffset;
+  };
+
+  const std::uint32_t hashOffset = kCodeDirectorySize + identifier.size() + 1 + specialSlots * kHashSize;
+  const std::uint32_t directorySize = hashOffset + hashes.size() * kHashSize;
+  auto* directory = addEntry(kCodeDirectorySlot, directorySize);
+  writeBigEndian32(directory, kCodeDirectoryMagic);
+  writeBigEndian32(directory + 4, directorySize);
+  writeBigEndian32(directory + 8, kCodeDirectoryVersion);
+  writeBigEndian32(directory + 12, kAdHocFlag);
+  writeBigEndian32(directory + 16, hashOffset);
+  writeBigEndian32(directory + 20, kCodeDirectorySize);
+  writeBigEndian32(directory + 24, specialSlots);
+  writeBigEndian32(directory + 28, hashes.size());
+  writeBigEndian32(directory + 32, codeLimit);
+  directory[36] = kHashSize;
+  directory[37] = kSha256Type;
+  directory[39] = pageShift;
+  writeBigEndian64(directory + 64, execSegBase);
+  writeBigEndian64(directory + 72, execSegLimit);
+  writeBigEndian64(directory + 80, execSegFlags);
+  memcpy(directory + kCodeDirectorySize, identifier.c_str(), identifier.size() + 1);
+  for (std::size_t page = 0; page < hashes.size(); page++) {
+    memcpy(directory + hashOffset + page * kHashSize, hashes[page].data(), kHashSize);
+  }
+  auto setSpecialHash = [&](std::uint32_t slot, const Sha256& hash) {
+    memcpy(directory + hashOffset - slot * kHashSize, hash.data(), kHashSize);
+  };
+
+  auto* requirements = addEntry(kRequirementsSlot, 12);
+  writeBigEndian32(requirements, kRequirementsMagic);
+  writeBigEndian32(requirements + 4, 12);
+  setSpecialHash(kRequirementsSlot, sha256(requirements, 12));
+
+  for (const auto& blob: blobs) {
+    memcpy(addEntry(blob.slot, blob.bytes.size()), blob.bytes.data(), blob.bytes.size());
+    setSpecialHash(blob.slot, sha256(blob.bytes.data(), blob.bytes.size()));
+  }
+  for (const auto& [slot, hash]: fileHashes) {
+    setSpecialHash(slot, hash);
+  }
+
+  auto* wrapper = addEntry(kSignatureSlot, 8);
+  writeBigEndian32(wrapper, kBlobWrapperMagic);
+  writeBigEndian32(wrapper + 4, 8);
+}
+
+template bool stripCodeSignature(struct mach_header_64&, std::size_t);
+template bool stripCodeSignature(struct mach_header&, std::size_t);
+template struct linkedit_data_command& addCodeSignatureCommand(struct mach_header_64&, std::size_t);
+template struct linkedit_data_command& addCodeSignatureCommand(struct mach_header&, std::size_t);
+template bool isAdHocSigned(const std::uint8_t*, std::size_t, const LoadCommands<MachO64>&);
+template bool isAdHocSigned(const std::uint8_t*, std::size_t, const LoadCommands<MachO32>&);
+template AdHocSigner::AdHocSigner(
+    const std::uint8_t*, std::size_t, const LoadCommands<MachO64>&, const std::string&);
+template AdHocSigner::AdHocSigner(
+    const std::uint8_t*, std::size_t, const LoadCommands<MachO32>&, const std::string&);
+template std::vector<std::size_t> AdHocSigner::reuseHashes(
+    const LoadCommands<MachO64>&, std::uint64_t, std::vector<Sha256>&) const;
+template std::vector<std::size_t> AdHocSigner::reuseHashes(
+    const LoadCommands<MachO32>&, std::uint64_t, std::vector<Sha256>&) const;
+}
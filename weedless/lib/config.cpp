@@ -22,67 +22,355 @@
 
 
 #include "config.h"
+#include "trace.h"
 #include "nlohmann/json.hpp"
 
 // sys
 #include <filesystem>
-#include <iostream>
 #include <fstream>
-#include <sys/stat.h>
 
 // stl
+#include <algorithm>
+#include <functional>
+#include <optional>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
-namespace nlohmann 
+namespace weedless::config {
+namespace {
+
+// Builds a Config straight from the parser's events, without a DOM.
+// Unknown keys are skipped, the known ones have to have the right type.
+class ConfigReader : public nlohmann::json_sax<nlohmann::json>
 {
-  template <typename T>
-  void read(T& t, const std::string& key, const json& j)
+public:
+  ConfigReader(Config& config, const std::filesystem::path& workingDirectory) 
+    : config(config), workingDirectory(workingDirectory) {}
+
+  bool null() override { return scalar("null"); }
+  bool boolean(bool) override { return scalar("boolean"); }
+  bool number_integer(number_integer_t) override { return scalar("number"); }
+  bool number_unsigned(number_unsigned_t) override { return scalar("number"); }
+  bool number_float(number_float_t, const string_t&) override { return scalar("number"); }
+  bool binary(binary_t&) override { return scalar("binary"); }
+
+  bool string(string_t& value) override
+  {
+    switch (getContext()) {
+      case Context::Config:
+        if (currentKey == "target") {
+          target = std::move(value);
+          return true;
+        }
+        if (currentKey == "code_signature") {
+          config.codeSignature = getCodeSignature(value);
+          return true;
+        }
+        break;
+      case Context::Dylib:
+        if (currentKey == "name") {
+          dylib.name = std::move(value);
+          return true;
+        }
+        if (currentKey == "install_name") {
+          dylib.installName = std::move(value);
+          return true;
+        }
+        if (currentKey == "path") {
+          dylib.path = std::move(value);
+          return true;
+        }
+        break;
+      case Context::Hook:
+        if (const auto kind = getPatternKind(currentKey); kind.has_value()) {
+          if (hasSymbol) {
+            throw std::runtime_error("Invalid config: a hook takes only one of symbol, prefix, glob and regex");
+          }
+          symbol = std::move(value);
+          hookKind = *kind;
+          hasSymbol = true;
+          return true;
+        }
+        if (currentKey == "dylib_name") {
+          dylibName = std::move(value);
+          return true;
+        }
+        break;
+      case Context::Archs:
+        config.archs.push_back(std::move(value));
+        return true;
+      case Context::Targets:
+        config.targets.push_back(std::move(value));
+        return true;
+      case Context::Directories:
+        config.directories.push_back(std::move(value));
+        return true;
+      default:
+        break;
+    }
+    return scalar("string");
+  }
+
+  bool start_object(std::size_t) override
+  {
+    const auto context = getContext();
+    if (context == Context::None) {
+      contexts.push_back(Context::Root);
+    } else if (context == Context::Root && currentKey == "config") {
+      contexts.push_back(Context::Config);
+    } else if (context == Context::Dylibs) {
+      dylib = {};
+      contexts.push_back(Context::Dylib);
+    } else if (context == Context::Hooks) {
+      symbol.clear();
+      dylibName.clear();
+      hookKind = PatternKind::Exact;
+      hasSymbol = false;
+      contexts.push_back(Context::Hook);
+    } else {
+      expectUnknown("object");
+      contexts.push_back(Context::Skip);
+    }
+    return true;
+  }
+
+  bool end_object() override
+  {
+    const auto context = getContext();
+    contexts.pop_back();
+    if (context == Context::Dylib) {
+      dylib.path = workingDirectory / dylib.path;
+      config.dylibs.push_back(std::move(dylib));
+    } else if (context == Context::Hook) {
+      // Dylibs may come after the hooks, so hooks are resolved once the
+      // whole config is read.
+      config.hooks.push_back({config.symbols.add(symbol), dylibNames.add(dylibName), hookKind});
+    }
+    return true;
+  }
+
+  bool start_array(std::size_t) override
+  {
+    const auto context = getContext();
+    if (context == Context::Config && currentKey == "dylibs") {
+      contexts.push_back(Context::Dylibs);
+    } else if (context == Context::Config && currentKey == "hooks") {
+      contexts.push_back(Context::Hooks);
+    } else if (context == Context::Config && currentKey == "archs") {
+      contexts.push_back(Context::Archs);
+    } else if (context == Context::Config && currentKey == "targets") {
+      contexts.push_back(Context::Targets);
+    } else if (context == Context::Config && currentKey == "directories") {
+      contexts.push_back(Context::Directories);
+    } else {
+      expectUnknown("array");
+      contexts.push_back(Context::Skip);
+    }
+    return true;
+  }
+
+  bool end_array() override
+  {
+    contexts.pop_back();
+    return true;
+  }
+
+  bool key(string_t& value) override
   {
-    auto it = j.find(key);
-    if (it != j.end()) {
-      t = it->get<T>();
-    }
-  }
-
-
-  template <>
-  struct adl_serializer<weedless::config::Dylib> {
-    static void from_json(const json& j, weedless::config::Dylib& obj) 
-    {
-      read(obj.name, "name", j);
-      read(obj.installName, "install_name", j);
-      
-      std::filesystem::path path;
-      read(path, "path", j);
-      obj.path = std::filesystem::absolute(path);
-    }
-  };
-
-  template <>
-  struct adl_serializer<weedless::config::Hook> {
-    static void from_json(const json& j, weedless::config::Hook& obj) 
-    {
-      read(obj.dylibName, "dylib_name", j);
-      read(obj.symbol, "symbol", j);
-    }
-  };
-  
-  template <>
-  struct adl_serializer<weedless::config::Config> {
-    static void from_json(const json& j, weedless::config::Config& obj) 
-    {
-      read(obj.dylibs, "dylibs", j);
-      read(obj.hooks, "hooks", j);
-      
-      std::filesystem::path target;
-      read(target, "target", j);
-      obj.target = std::filesystem::absolute(target);
-    }
-  };
+    currentKey = std::move(value);
+    return true;
+  }
+
+  bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception& ex) override
+  {
+    throw std::runtime_error(std::string("Invalid config: ") + ex.what());
+  }
+
+  // Points the hooks at their dylibs, the first dylib with a name wins.
+  // Returns false when a hook names a dylib that doesn't exist.
+  bool resolveHooks()
+  {
+    std::vector<std::uint32_t> dylibIndices(dylibNames.size(), StringTable::npos);
+    for (std::size_t index = 0; index < config.dylibs.size(); index++) {
+      const auto name = dylibNames.find(config.dylibs[index].name);
+      if (name != StringTable::npos && dylibIndices[name] == StringTable::npos) {
+        dylibIndices[name] = index;
+      }
+    }
+    for (auto& hook: config.hooks) {
+      hook.dylib = dylibIndices[hook.dylib];
+      if (hook.dylib == StringTable::npos) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // A config either names a single `target` or shares its dylibs and
+  // hooks between a list of `targets`.
+  void finishTargets()
+  {
+    if (!target.empty()) {
+      config.targets.insert(config.targets.begin(), target);
+    }
+    for (auto& path: config.targets) {
+      path = workingDirectory / path;
+    }
+    for (auto& path: config.directories) {
+      path = workingDirectory / path;
+    }
+  }
+
+private:
+  enum class Context { None, Root, Config, Dylibs, Dylib, Hooks, Hook, Archs, Targets, Directories, Skip };
+
+  static std::optional<PatternKind> getPatternKind(const std::string& key)
+  {
+    if (key == "symbol") { return PatternKind::Exact; }
+    if (key == "prefix") { return PatternKind::Prefix; }
+    if (key == "glob") { return PatternKind::Glob; }
+    if (key == "regex") { return PatternKind::Regex; }
+    return std::nullopt;
+  }
+
+  Context getContext() const
+  {
+    return contexts.empty() ? Context::None : contexts.back();
+  }
+
+  // Whether the value belongs to a known key (or array) of another type.
+  bool isKnown() const
+  {
+    switch (getContext()) {
+      case Context::None:
+      case Context::Dylibs:
+      case Context::Hooks:
+      case Context::Archs:
+      case Context::Targets:
+      case Context::Directories:
+        return true;
+      case Context::Root:
+        return currentKey == "config";
+      case Context::Config:
+        return currentKey == "target" || currentKey == "dylibs" || currentKey == "hooks" || 
+               currentKey == "archs" || currentKey == "targets" || currentKey == "directories" ||
+               currentKey == "code_signature";
+      case Context::Dylib:
+        return currentKey == "name" || currentKey == "install_name" || currentKey == "path";
+      case Context::Hook:
+        return getPatternKind(currentKey).has_value() || currentKey == "dylib_name";
+      case Context::Skip:
+        return false;
+    }
+    return false;
+  }
+
+  void expectUnknown(const char* type) const
+  {
+    if (isKnown()) {
+      throw std::runtime_error(
+          std::string("Invalid config: unexpected ") + type + 
+          (currentKey.empty() ? std::string() : " for \"" + currentKey + "\""));
+    }
+  }
+
+  bool scalar(const char* type)
+  {
+    expectUnknown(type);
+    return true;
+  }
+
+  Config& config;
+  std::filesystem::path workingDirectory;
+  std::vector<Context> contexts;
+  // Last key read, the one the next value belongs to.
+  std::string currentKey;
+  Dylib dylib;
+  std::string symbol;
+  std::string dylibName;
+  PatternKind hookKind = PatternKind::Exact;
+  bool hasSymbol = false;
+  std::filesystem::path target;
+  // Dylib names used by hooks, resolved to indices at the end.
+  StringTable dylibNames;
+};
+
 }
 
-namespace weedless::config {
+std::uint32_t StringTable::add(std::string_view string)
+{
+  const auto hash = std::hash<std::string_view>{}(string);
+  if (!slots.empty()) {
+    const auto slot = findSlot(string, hash);
+    if (slots[slot] != 0) {
+      return slots[slot] - 1;
+    }
+  }
+
+  // Keep the table at most half full.
+  if ((size() + 1) * 2 > slots.size()) {
+    rehash(std::max<std::size_t>(16, slots.size() * 2));
+  }
+
+  const auto id = static_cast<std::uint32_t>(size());
+  data.append(string);
+  offsets.push_back(data.size());
+  slots[findSlot(string, hash)] = id + 1;
+  return id;
+}
+
+std::uint32_t StringTable::find(std::string_view string) const
+{
+  if (slots.empty()) {
+    return npos;
+  }
+  const auto slot = slots[findSlot(string, std::hash<std::string_view>{}(string))];
+  return slot == 0 ? npos : slot - 1;
+}
+
+// The slot holding `string`, or the empty slot it would go into.
+std::size_t StringTable::findSlot(std::string_view string, std::size_t hash) const
+{
+  const auto mask = slots.size() - 1;
+  for (auto slot = hash & mask;; slot = (slot + 1) & mask) {
+    if (slots[slot] == 0 || get(slots[slot] - 1) == string) {
+      return slot;
+    }
+  }
+}
+
+void StringTable::rehash(std::size_t slotCount)
+{
+  slots.assign(slotCount, 0);
+  for (std::uint32_t id = 0; id < size(); id++) {
+    const auto string = get(id);
+    slots[findSlot(string, std::hash<std::string_view>{}(string))] = id + 1;
+  }
+}
+
+void Config::compilePatterns()
+{
+  std::vector<Pattern> hookPatterns;
+  patternHooks.clear();
+  for (std::uint32_t index = 0; index < hooks.size(); index++) {
+    if (hooks[index].kind != PatternKind::Exact) {
+      hookPatterns.push_back({hooks[index].kind, getSymbol(hooks[index]), hooks[index].dylib});
+      patternHooks.push_back(index);
+    }
+  }
+
+  std::vector<PatternConflict> conflicts;
+  patterns = SymbolMatcher::compile(hookPatterns, &conflicts);
+  for (const auto& conflict: conflicts) {
+    const auto& first = hooks[patternHooks[conflict.first]];
+    const auto& second = hooks[patternHooks[conflict.second]];
+    warnings.push_back(
+        "Hooks \"" + std::string(getSymbol(first)) + "\" (" + getDylib(first).name + 
+        ") and \"" + std::string(getSymbol(second)) + "\" (" + getDylib(second).name + 
+        ") both match \"" + conflict.example + "\", the later one wins.");
+  }
+}
 
 bool verifyDylibs(const Config& config)
 {
@@ -116,22 +404,25 @@ bool verifyDylibs(const Config& config)
   return true;
 }
 
-bool verifyHooks(const Config& config)
+CodeSignature getCodeSignature(std::string_view name)
 {
-  for (const auto& hook: config.hooks) {
-    const auto matchesDylib = std::any_of(
-        config.dylibs.begin(), 
-        config.dylibs.end(), 
-        [&hook](const auto& dylib) {
-          return hook.dylibName == dylib.name;
-        });
-    if (!matchesDylib) { return false; }
+  if (name == "keep") {
+    return CodeSignature::Keep;
   }
-  return true;
+  if (name == "strip") {
+    return CodeSignature::Strip;
+  }
+  if (name == "adhoc") {
+    return CodeSignature::AdHoc;
+  }
+  throw std::runtime_error("Invalid config: code_signature has to be keep, strip or adhoc");
 }
 
-Config read(const std::filesystem::path& path)
+Config read(
+    const std::filesystem::path& path,
+    const std::filesystem::path& workingDirectory)
 {
+  trace::Scope scope(trace::Phase::ConfigParse, path.string());
   if (!std::filesystem::exists(path)) {
     throw std::runtime_error("Config file does not exist!");
   }
@@ -141,21 +432,24 @@ Config read(const std::filesystem::path& path)
     throw std::runtime_error("Can't open config file!");
   }
 
-  nlohmann::json j;
-  cfgStr >> j;
   Config config;
-  nlohmann::read(config, "config", j);
+  ConfigReader reader(config, workingDirectory);
+  nlohmann::json::sax_parse(cfgStr, &reader);
+  reader.finishTargets();
 
   if (!verifyDylibs(config)) {
     throw std::runtime_error("Dylibs config verification failed!");
   }
 
-  if (!verifyHooks(config)) {
+  if (!reader.resolveHooks()) {
     throw std::runtime_error("Hooks config verification failed!");
   }
+  config.compilePatterns();
 
-  if (!std::filesystem::exists(config.target)) {
-    throw std::runtime_error("Target config path does not exist!");
+  // Missing targets are reported per target when patching, so that one
+  // bad path doesn't fail a whole batch.
+  if (config.targets.empty() && config.directories.empty()) {
+    throw std::runtime_error("No target configured!");
   }
 
   return config;
@@ -0,0 +1,183 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "copy.h"
+
+// weedless
+#include "trace.h"
+
+// stl
+#include <atomic>
+#include <stdexcept>
+#include <string>
+
+// c
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// sys
+#if defined(__APPLE__)
+#include <sys/clonefile.h>
+#elif defined(__linux__)
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+namespace weedless {
+namespace {
+
+class FileDescriptor
+{
+public:
+  explicit FileDescriptor(int fd) : fd(fd) {}
+  ~FileDescriptor() { if (fd >= 0) close(fd); }
+
+  FileDescriptor(const FileDescriptor&) = delete;
+  FileDescriptor& operator=(const FileDescriptor&) = delete;
+
+  int get() const { return fd; }
+
+private:
+  int fd;
+};
+
+#if defined(__linux__)
+// Returns false when the filesystem can't copy between these files, before
+// anything was written.
+bool copyRange(int in, int out, std::size_t size)
+{
+  std::size_t copied = 0;
+  while (copied < size) {
+    const auto result = copy_file_range(in, nullptr, out, nullptr, size - copied, 0);
+    if (result < 0) {
+      if (copied == 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+        return false;
+      }
+      throw std::runtime_error("Unable to copy file.");
+    }
+    if (result == 0) {
+      throw std::runtime_error("File shrank while copying.");
+    }
+    copied += result;
+  }
+  trace::count(trace::Counter::BytesRead, copied);
+  trace::count(trace::Counter::BytesWritten, copied);
+  return true;
+}
+#endif
+
+void copy(int in, int out)
+{
+  char buffer[256 * 1024];
+  for (;;) {
+    const auto count = read(in, buffer, sizeof(buffer));
+    if (count < 0) {
+      throw std::runtime_error("Unable to read file.");
+    }
+    if (count == 0) {
+      return;
+    }
+    trace::count(trace::Counter::BytesRead, count);
+    trace::count(trace::Counter::BytesWritten, count);
+    for (ssize_t written = 0; written < count;) {
+      const auto result = write(out, buffer + written, count - written);
+      if (result < 0) {
+        throw std::runtime_error("Unable to write file.");
+      }
+      written += result;
+    }
+  }
+}
+
+CloneMethod fill(int in, int out, const struct stat& st)
+{
+  // Not subject to the umask, unlike the mode passed to open.
+  if (fchmod(out, st.st_mode & 07777) < 0) {
+    throw std::runtime_error("Could not set output file permissions.");
+  }
+
+#if defined(__linux__)
+  if (ioctl(out, FICLONE, in) == 0) {
+    return CloneMethod::Reflink;
+  }
+  if (copyRange(in, out, st.st_size)) {
+    return CloneMethod::CopyRange;
+  }
+#endif
+
+  copy(in, out);
+  return CloneMethod::Copy;
+}
+}
+
+CloneMethod cloneFile(
+    const std::filesystem::path& source, 
+    const std::filesystem::path& destination)
+{
+#if defined(__APPLE__)
+  if (clonefile(source.c_str(), destination.c_str(), 0) == 0) {
+    return CloneMethod::Reflink;
+  }
+#endif
+
+  FileDescriptor in(open(source.c_str(), O_RDONLY));
+  if (in.get() < 0) {
+    throw std::runtime_error("Could not read input file.");
+  }
+  struct stat st;
+  if (fstat(in.get(), &st) < 0) {
+    throw std::runtime_error("Could not get file info.");
+  }
+
+  FileDescriptor out(open(destination.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600));
+  if (out.get() < 0) {
+    throw std::runtime_error("Could not create " + destination.string());
+  }
+
+  try {
+    return fill(in.get(), out.get(), st);
+  } catch (...) {
+    unlink(destination.c_str());
+    throw;
+  }
+}
+
+void syncFile(const std::filesystem::path& path)
+{
+  trace::Scope scope(trace::Phase::Sync, path.string());
+  FileDescriptor fd(open(path.c_str(), O_RDONLY));
+  if (fd.get() < 0 || fsync(fd.get()) < 0) {
+    throw std::runtime_error("Unable to sync " + path.string() + " to disk.");
+  }
+}
+
+std::filesystem::path getTempPath(const std::filesystem::path& path)
+{
+  static std::atomic<unsigned> counter{0};
+  auto tempPath = path;
+  tempPath += "." + std::to_string(getpid()) + "." + std::to_string(counter++) + ".tmp";
+  return tempPath;
+}
+}
@@ -0,0 +1,109 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "exports.h"
+
+// stl
+#include <algorithm>
+#include <stdexcept>
+
+// weedless
+#include "macho.h"
+#include "uleb.h"
+
+namespace weedless {
+
+bool ExportTrie::contains(std::string_view symbol) const
+{
+  if (size == 0) {
+    return false;
+  }
+  const auto* end = data + size;
+  std::size_t nodeOffset = 0;
+  // Every edge consumes at least one character, which also ends cycles.
+  const auto maxSteps = symbol.size();
+  for (std::size_t steps = 0; steps <= maxSteps; steps++) {
+    if (nodeOffset >= size) {
+      throw std::runtime_error("Malformed export trie!");
+    }
+    const auto* p = data + nodeOffset;
+    const auto terminalSize = read_uleb128(p, end).first;
+    if (symbol.empty()) {
+      return terminalSize != 0;
+    }
+    if (terminalSize >= (std::size_t)(end - p)) {
+      throw std::runtime_error("Malformed export trie!");
+    }
+    p += terminalSize;
+
+    std::size_t childCount = *p++;
+    bool found = false;
+    for (; childCount > 0 && !found; childCount--) {
+      // Edges are NUL-terminated prefixes of the symbols below them.
+      std::size_t length = 0;
+      bool matches = true;
+      for (; p + length < end && p[length] != 0; length++) {
+        matches = matches && length < symbol.size() && symbol[length] == (char)p[length];
+      }
+      if (p + length == end) {
+        throw std::runtime_error("Malformed export trie!");
+      }
+      p += length + 1;
+      const auto childOffset = read_uleb128(p, end).first;
+      if (matches && length != 0) {
+        symbol.remove_prefix(length);
+        nodeOffset = childOffset;
+        found = true;
+      }
+    }
+    if (!found) {
+      return false;
+    }
+  }
+  throw std::runtime_error("Malformed export trie!");
+}
+
+std::vector<std::string> DylibExports::findMissing(
+    std::string_view symbol, 
+    const std::vector<std::string>& archs) const
+{
+  std::vector<std::string> missing;
+  if (archs.empty()) {
+    for (const auto& slice: slices) {
+      if (!slice.trie.contains(symbol)) {
+        missing.push_back(getArchName(slice.cputype, slice.cpusubtype));
+      }
+    }
+    return missing;
+  }
+  // An arch without a slice can't export anything either.
+  for (const auto& arch: archs) {
+    auto slice = std::find_if(slices.begin(), slices.end(), [&arch](const Slice& slice) {
+      return getArchName(slice.cputype, slice.cpusubtype) == arch;
+    });
+    if (slice == slices.end() || !slice->trie.contains(symbol)) {
+      missing.push_back(arch);
+    }
+  }
+  return missing;
+}
+}
@@ -0,0 +1,170 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "fixups.h"
+
+// c
+#include <cstring>
+
+// stl
+#include <stdexcept>
+
+// weedless
+#include "machodefs.h"
+#include "trace.h"
+
+namespace weedless {
+namespace {
+
+// Ordinals at or above these values encode BIND_SPECIAL_DYLIB_* as small
+// negative numbers.
+constexpr std::uint32_t kSpecialOrdinal8 = 0xF0;
+constexpr std::uint32_t kSpecialOrdinal16 = 0xFFF0;
+
+std::size_t getImportSize(std::uint32_t format)
+{
+  switch (format) {
+    case DYLD_CHAINED_IMPORT: 
+      return sizeof(struct dyld_chained_import);
+    case DYLD_CHAINED_IMPORT_ADDEND: 
+      return sizeof(struct dyld_chained_import_addend);
+    case DYLD_CHAINED_IMPORT_ADDEND64: 
+      return sizeof(struct dyld_chained_import_addend64);
+    default:
+      throw std::runtime_error("Unknown chained imports format!");
+  }
+}
+
+template <typename ImportType>
+ImportType loadImport(const std::uint8_t* entry)
+{
+  ImportType import;
+  memcpy(&import, entry, sizeof(ImportType));
+  return import;
+}
+
+std::uint64_t getNameOffset(const std::uint8_t* entry, std::uint32_t format)
+{
+  switch (format) {
+    case DYLD_CHAINED_IMPORT: 
+      return loadImport<struct dyld_chained_import>(entry).name_offset;
+    case DYLD_CHAINED_IMPORT_ADDEND: 
+      return loadImport<struct dyld_chained_import_addend>(entry).name_offset;
+    default:
+      return loadImport<struct dyld_chained_import_addend64>(entry).name_offset;
+  }
+}
+
+}
+
+int ChainedImport::getDylibIndex() const
+{
+  if (format == DYLD_CHAINED_IMPORT_ADDEND64) {
+    const std::uint32_t ordinal = 
+      loadImport<struct dyld_chained_import_addend64>(entry).lib_ordinal;
+    return ordinal >= kSpecialOrdinal16 ? (int16_t)ordinal : (int)ordinal;
+  }
+
+  // Both 32-bit formats share the same layout for the ordinal.
+  const std::uint32_t ordinal = 
+    loadImport<struct dyld_chained_import>(entry).lib_ordinal;
+  return ordinal >= kSpecialOrdinal8 ? (int8_t)ordinal : (int)ordinal;
+}
+
+void ChainedImport::setDylibIndex(std::uint64_t index)
+{
+  if (format == DYLD_CHAINED_IMPORT_ADDEND64) {
+    if (index >= kSpecialOrdinal16) {
+      throw std::runtime_error("Dylib ordinal does not fit in chained import!");
+    }
+    auto import = loadImport<struct dyld_chained_import_addend64>(entry);
+    import.lib_ordinal = index;
+    memcpy(entry, &import, sizeof(import));
+    return;
+  }
+
+  if (index >= kSpecialOrdinal8) {
+    throw std::runtime_error("Dylib ordinal does not fit in chained import!");
+  }
+  auto import = loadImport<struct dyld_chained_import>(entry);
+  import.lib_ordinal = index;
+  memcpy(entry, &import, sizeof(import));
+}
+
+void forEachChainedImport(
+    std::uint8_t* fixups, 
+    std::size_t fixupsSize,
+    const std::function<void(ChainedImport&)>& fn)
+{
+  if (fixupsSize < sizeof(struct dyld_chained_fixups_header)) {
+    throw std::runtime_error("Chained fixups header exceeds its data!");
+  }
+  
+  struct dyld_chained_fixups_header header;
+  memcpy(&header, fixups, sizeof(header));
+
+  if (header.fixups_version != 0) {
+    throw std::runtime_error("Unsupported chained fixups version!");
+  }
+  if (header.symbols_format != 0) {
+    throw std::runtime_error("Compressed chained fixups symbols are not supported!");
+  }
+
+  const auto importSize = getImportSize(header.imports_format);
+  if (header.imports_offset > fixupsSize ||
+      header.imports_count > (fixupsSize - header.imports_offset) / importSize) {
+    throw std::runtime_error("Chained imports exceed their data!");
+  }
+  if (header.symbols_offset > fixupsSize) {
+    throw std::runtime_error("Chained import symbols exceed their data!");
+  }
+
+  const auto* symbols = (const char*)fixups + header.symbols_offset;
+  const auto symbolsSize = fixupsSize - header.symbols_offset;
+
+  trace::count(trace::Counter::SymbolsScanned, header.imports_count);
+  auto* entry = fixups + header.imports_offset;
+  for (std::uint32_t i = 0; i < header.imports_count; i++, entry += importSize) {
+    const auto nameOffset = getNameOffset(entry, header.imports_format);
+    if (nameOffset >= symbolsSize || 
+        !memchr(symbols + nameOffset, '\0', symbolsSize - nameOffset)) {
+      throw std::runtime_error("Chained import name exceeds its data!");
+    }
+
+    ChainedImport import(entry, header.imports_format, symbols + nameOffset);
+    fn(import);
+  }
+}
+
+void forEachChainedImport(
+    std::uint8_t* image, 
+    std::size_t imageSize,
+    const struct linkedit_data_command& command,
+    const std::function<void(ChainedImport&)>& fn)
+{
+  if (command.dataoff > imageSize || command.datasize > imageSize - command.dataoff) {
+    throw std::runtime_error("Chained fixups exceed the image!");
+  }
+  forEachChainedImport(image + command.dataoff, command.datasize, fn);
+}
+}
@@ -0,0 +1,275 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "hash.h"
+
+// weedless
+#include "trace.h"
+
+// stl
+#include <stdexcept>
+
+// c
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace weedless {
+namespace {
+
+constexpr std::uint64_t kPrime1 = 0x9E3779B185EBCA87ull;
+constexpr std::uint64_t kPrime2 = 0xC2B2AE3D27D4EB4Full;
+constexpr std::uint64_t kPrime3 = 0x165667B19E3779F9ull;
+constexpr std::uint64_t kPrime4 = 0x85EBCA77C2B2AE63ull;
+constexpr std::uint64_t kPrime5 = 0x27D4EB2F165667C5ull;
+
+std::uint64_t rotl(std::uint64_t value, int bits)
+{
+  return (value << bits) | (value >> (64 - bits));
+}
+
+std::uint64_t read64(const std::uint8_t* ptr)
+{
+  std::uint64_t value;
+  memcpy(&value, ptr, sizeof(value));
+  return value;
+}
+
+std::uint32_t read32(const std::uint8_t* ptr)
+{
+  std::uint32_t value;
+  memcpy(&value, ptr, sizeof(value));
+  return value;
+}
+
+std::uint64_t round(std::uint64_t acc, std::uint64_t input)
+{
+  acc += input * kPrime2;
+  acc = rotl(acc, 31);
+  return acc * kPrime1;
+}
+
+std::uint64_t mergeRound(std::uint64_t acc, std::uint64_t value)
+{
+  acc ^= round(0, value);
+  return acc * kPrime1 + kPrime4;
+}
+
+constexpr std::uint32_t kSha256Rounds[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+std::uint32_t rotr(std::uint32_t value, int bits)
+{
+  return (value >> bits) | (value << (32 - bits));
+}
+
+void sha256Block(std::uint32_t state[8], const std::uint8_t* block)
+{
+  std::uint32_t w[64];
+  for (int i = 0; i < 16; i++) {
+    w[i] = (std::uint32_t(block[i * 4]) << 24) | (std::uint32_t(block[i * 4 + 1]) << 16) |
+           (std::uint32_t(block[i * 4 + 2]) << 8) | std::uint32_t(block[i * 4 + 3]);
+  }
+  for (int i = 16; i < 64; i++) {
+    const auto s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    const auto s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  auto a = state[0], b = state[1], c = state[2], d = state[3];
+  auto e = state[4], f = state[5], g = state[6], h = state[7];
+  for (int i = 0; i < 64; i++) {
+    const auto t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + kSha256Rounds[i] + w[i];
+    const auto t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+  state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+}
+
+Hasher::Hasher(std::uint64_t seed)
+  : state{seed + kPrime1 + kPrime2, seed + kPrime2, seed, seed - kPrime1}, seed(seed)
+{
+}
+
+void Hasher::update(const void* data, std::size_t size)
+{
+  const auto* p = (const std::uint8_t*)data;
+  const auto* end = p + size;
+  total += size;
+
+  if (buffered + size < sizeof(buffer)) {
+    memcpy(buffer + buffered, p, size);
+    buffered += size;
+    return;
+  }
+
+  if (buffered) {
+    const auto fill = sizeof(buffer) - buffered;
+    memcpy(buffer + buffered, p, fill);
+    p += fill;
+    for (int lane = 0; lane < 4; lane++) {
+      state[lane] = round(state[lane], read64(buffer + lane * 8));
+    }
+    buffered = 0;
+  }
+
+  while (end - p >= 32) {
+    for (int lane = 0; lane < 4; lane++) {
+      state[lane] = round(state[lane], read64(p + lane * 8));
+    }
+    p += 32;
+  }
+
+  memcpy(buffer, p, end - p);
+  buffered = end - p;
+}
+
+std::uint64_t Hasher::digest() const
+{
+  std::uint64_t hash;
+  if (total >= 32) {
+    hash = rotl(state[0], 1) + rotl(state[1], 7) + rotl(state[2], 12) + rotl(state[3], 18);
+    for (int lane = 0; lane < 4; lane++) {
+      hash = mergeRound(hash, state[lane]);
+    }
+  } else {
+    hash = seed + kPrime5;
+  }
+  hash += total;
+
+  const auto* p = buffer;
+  const auto* end = buffer + buffered;
+  while (end - p >= 8) {
+    hash ^= round(0, read64(p));
+    hash = rotl(hash, 27) * kPrime1 + kPrime4;
+    p += 8;
+  }
+  if (end - p >= 4) {
+    hash ^= std::uint64_t(read32(p)) * kPrime1;
+    hash = rotl(hash, 23) * kPrime2 + kPrime3;
+    p += 4;
+  }
+  while (p < end) {
+    hash ^= *p++ * kPrime5;
+    hash = rotl(hash, 11) * kPrime1;
+  }
+
+  hash ^= hash >> 33;
+  hash *= kPrime2;
+  hash ^= hash >> 29;
+  hash *= kPrime3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+Sha256 sha256(const void* data, std::size_t size)
+{
+  std::uint32_t state[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  const auto* p = (const std::uint8_t*)data;
+  std::size_t left = size;
+  for (; left >= 64; left -= 64, p += 64) {
+    sha256Block(state, p);
+  }
+
+  // The tail, a one bit, zeros and the length in bits fill one or two
+  // more blocks.
+  std::uint8_t tail[128] = {};
+  memcpy(tail, p, left);
+  tail[left] = 0x80;
+  const std::size_t tailSize = left < 56 ? 64 : 128;
+  const std::uint64_t bits = std::uint64_t(size) * 8;
+  for (int i = 0; i < 8; i++) {
+    tail[tailSize - 1 - i] = std::uint8_t(bits >> (i * 8));
+  }
+  for (std::size_t offset = 0; offset < tailSize; offset += 64) {
+    sha256Block(state, tail + offset);
+  }
+
+  Sha256 digest;
+  for (int i = 0; i < 8; i++) {
+    digest[i * 4] = std::uint8_t(state[i] >> 24);
+    digest[i * 4 + 1] = std::uint8_t(state[i] >> 16);
+    digest[i * 4 + 2] = std::uint8_t(state[i] >> 8);
+    digest[i * 4 + 3] = std::uint8_t(state[i]);
+  }
+  return digest;
+}
+
+std::string toHex(std::uint64_t hash)
+{
+  static const char digits[] = "0123456789abcdef";
+  std::string hex(16, '0');
+  for (int i = 15; i >= 0; i--, hash >>= 4) {
+    hex[i] = digits[hash & 0xf];
+  }
+  return hex;
+}
+
+FileDigest digestFile(const std::filesystem::path& path)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Could not read " + path.string());
+  }
+
+  Hasher hasher;
+  FileDigest digest{0, 0};
+  std::uint8_t buffer[64 * 1024];
+  for (;;) {
+    const auto count = read(fd, buffer, sizeof(buffer));
+    if (count < 0) {
+      close(fd);
+      throw std::runtime_error("Could not read " + path.string());
+    }
+    if (count == 0) {
+      break;
+    }
+    hasher.update(buffer, count);
+    digest.size += count;
+  }
+  close(fd);
+  trace::count(trace::Counter::BytesRead, digest.size);
+
+  digest.hash = hasher.digest();
+  return digest;
+}
+}
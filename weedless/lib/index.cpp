@@ -0,0 +1,275 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "index.h"
+
+// stl
+#include <stdexcept>
+
+// c
+#include <cstring>
+
+// sys
+#include <sys/stat.h>
+
+namespace weedless {
+namespace {
+
+constexpr char kMagic[8] = {'W', 'D', 'L', 'S', 'I', 'D', 'X', '1'};
+constexpr std::uint32_t kVersion = 1;
+
+struct IndexHeader
+{
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t sliceCount;
+  FileStamp stamp;
+  std::uint32_t slicesOffset;
+  std::uint32_t dylibsOffset;
+  std::uint32_t dylibCount;
+  std::uint32_t importsOffset;
+  std::uint32_t importCount;
+  std::uint32_t stringsOffset;
+  std::uint32_t stringsSize;
+  std::uint32_t reserved;
+};
+
+const IndexHeader& getHeader(const std::uint8_t* data)
+{
+  return *reinterpret_cast<const IndexHeader*>(data);
+}
+
+template<typename T>
+const T* getArray(const std::uint8_t* data, std::uint32_t offset)
+{
+  return reinterpret_cast<const T*>(data + offset);
+}
+
+bool isArrayInBounds(std::size_t size, std::uint32_t offset, std::uint64_t count, std::size_t elementSize, std::size_t alignment)
+{
+  return offset % alignment == 0 && offset <= size && count <= (size - offset) / elementSize;
+}
+
+std::size_t alignUp(std::size_t value, std::size_t alignment)
+{
+  return (value + alignment - 1) / alignment * alignment;
+}
+}
+
+FileStamp FileStamp::of(const std::filesystem::path& path)
+{
+  struct stat st;
+  if (::stat(path.c_str(), &st) != 0) {
+    throw std::runtime_error("Failed to stat file!");
+  }
+
+#ifdef __APPLE__
+  const auto& mtime = st.st_mtimespec;
+#else
+  const auto& mtime = st.st_mtim;
+#endif
+
+  return FileStamp{
+    static_cast<std::uint64_t>(st.st_size),
+    static_cast<std::int64_t>(mtime.tv_sec) * 1000000000 + mtime.tv_nsec,
+    static_cast<std::uint64_t>(st.st_ino),
+    static_cast<std::uint64_t>(st.st_dev),
+  };
+}
+
+ImageIndex::ImageIndex(std::shared_ptr<const void> owner, const std::uint8_t* data, std::size_t size)
+  : owner(std::move(owner)), bytes(data), length(size)
+{
+  if (size < sizeof(IndexHeader) || reinterpret_cast<std::uintptr_t>(data) % alignof(IndexHeader) != 0) {
+    throw std::runtime_error("Invalid index!");
+  }
+
+  const auto& header = getHeader(data);
+  if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion) {
+    throw std::runtime_error("Invalid index!");
+  }
+
+  if (!isArrayInBounds(size, header.slicesOffset, header.sliceCount, sizeof(IndexSlice), alignof(IndexSlice)) ||
+      !isArrayInBounds(size, header.dylibsOffset, header.dylibCount, sizeof(std::uint32_t), alignof(std::uint32_t)) ||
+      !isArrayInBounds(size, header.importsOffset, header.importCount, sizeof(IndexImport), alignof(IndexImport)) ||
+      !isArrayInBounds(size, header.stringsOffset, header.stringsSize, 1, 1)) {
+    throw std::runtime_error("Invalid index!");
+  }
+
+  // Every string ends before the end of the string table, so checking the
+  // last byte is enough to keep lookups in bounds.
+  if (header.stringsSize == 0 || data[header.stringsOffset + header.stringsSize - 1] != '\0') {
+    throw std::runtime_error("Invalid index!");
+  }
+
+  const auto* slices = getArray<IndexSlice>(data, header.slicesOffset);
+  for (std::uint32_t i = 0; i < header.sliceCount; i++) {
+    const auto& slice = slices[i];
+    if (slice.firstDylib > header.dylibCount || slice.dylibCount > header.dylibCount - slice.firstDylib ||
+        slice.firstImport > header.importCount || slice.importCount > header.importCount - slice.firstImport) {
+      throw std::runtime_error("Invalid index!");
+    }
+  }
+
+  const auto* dylibs = getArray<std::uint32_t>(data, header.dylibsOffset);
+  for (std::uint32_t i = 0; i < header.dylibCount; i++) {
+    if (dylibs[i] >= header.stringsSize) {
+      throw std::runtime_error("Invalid index!");
+    }
+  }
+
+  const auto* imports = getArray<IndexImport>(data, header.importsOffset);
+  for (std::uint32_t i = 0; i < header.importCount; i++) {
+    if (imports[i].symbol >= header.stringsSize || imports[i].kind > static_cast<std::uint8_t>(ImportKind::Chained)) {
+      throw std::runtime_error("Invalid index!");
+    }
+  }
+}
+
+const FileStamp& ImageIndex::getStamp() const
+{
+  return getHeader(bytes).stamp;
+}
+
+std::size_t ImageIndex::getSliceCount() const
+{
+  return getHeader(bytes).sliceCount;
+}
+
+ImageIndex::Slice ImageIndex::getSlice(std::size_t slice) const
+{
+  const auto& entry = getArray<IndexSlice>(bytes, getHeader(bytes).slicesOffset)[slice];
+  return Slice{entry.cputype, entry.cpusubtype};
+}
+
+std::vector<std::string_view> ImageIndex::getDylibs(std::size_t slice) const
+{
+  const auto& header = getHeader(bytes);
+  const auto& entry = getArray<IndexSlice>(bytes, header.slicesOffset)[slice];
+  const auto* dylibs = getArray<std::uint32_t>(bytes, header.dylibsOffset) + entry.firstDylib;
+  const auto* strings = reinterpret_cast<const char*>(bytes + header.stringsOffset);
+
+  std::vector<std::string_view> result;
+  result.reserve(entry.dylibCount);
+  for (std::uint32_t i = 0; i < entry.dylibCount; i++) {
+    result.emplace_back(strings + dylibs[i]);
+  }
+
+  return result;
+}
+
+std::vector<ImageIndex::Import> ImageIndex::getImports(std::size_t slice) const
+{
+  const auto& header = getHeader(bytes);
+  const auto& entry = getArray<IndexSlice>(bytes, header.slicesOffset)[slice];
+  const auto* imports = getArray<IndexImport>(bytes, header.importsOffset) + entry.firstImport;
+  const auto* strings = reinterpret_cast<const char*>(bytes + header.stringsOffset);
+
+  std::vector<Import> result;
+  result.reserve(entry.importCount);
+  for (std::uint32_t i = 0; i < entry.importCount; i++) {
+    result.push_back(Import{strings + imports[i].symbol, imports[i].dylibIndex, static_cast<ImportKind>(imports[i].kind)});
+  }
+
+  return result;
+}
+
+void ImageIndexBuilder::addSlice(std::int32_t cputype, std::int32_t cpusubtype)
+{
+  slices.push_back(IndexSlice{
+    cputype, cpusubtype,
+    static_cast<std::uint32_t>(dylibs.size()), 0,
+    static_cast<std::uint32_t>(imports.size()), 0,
+  });
+}
+
+void ImageIndexBuilder::addDylib(std::string_view installName)
+{
+  dylibs.push_back(intern(installName));
+  slices.back().dylibCount++;
+}
+
+void ImageIndexBuilder::addImport(std::string_view symbol, std::int32_t dylibIndex, ImportKind kind)
+{
+  imports.push_back(IndexImport{intern(symbol), dylibIndex, static_cast<std::uint8_t>(kind), {}});
+  slices.back().importCount++;
+}
+
+std::uint32_t ImageIndexBuilder::intern(std::string_view string)
+{
+  auto [it, inserted] = stringOffsets.try_emplace(std::string(string), static_cast<std::uint32_t>(strings.size()));
+  if (inserted) {
+    strings.append(string);
+    strings.push_back('\0');
+  }
+
+  return it->second;
+}
+
+ImageIndex ImageIndexBuilder::finish() const
+{
+  IndexHeader header{};
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.sliceCount = static_cast<std::uint32_t>(slices.size());
+  header.stamp = stamp;
+  header.slicesOffset = static_cast<std::uint32_t>(alignUp(sizeof(IndexHeader), alignof(IndexSlice)));
+  header.dylibsOffset = static_cast<std::uint32_t>(alignUp(header.slicesOffset + slices.size() * sizeof(IndexSlice), alignof(std::uint32_t)));
+  header.dylibCount = static_cast<std::uint32_t>(dylibs.size());
+  header.importsOffset = static_cast<std::uint32_t>(alignUp(header.dylibsOffset + dylibs.size() * sizeof(std::uint32_t), alignof(IndexImport)));
+  header.importCount = static_cast<std::uint32_t>(imports.size());
+  header.stringsOffset = static_cast<std::uint32_t>(header.importsOffset + imports.size() * sizeof(IndexImport));
+  // Keep the string table non-empty so it always ends in a NUL.
+  header.stringsSize = static_cast<std::uint32_t>(strings.size() + 1);
+
+  // Allocate as 64-bit words so the buffer is suitably aligned for the header.
+  auto buffer = std::make_shared<std::vector<std::uint64_t>>(alignUp(header.stringsOffset + header.stringsSize, 8) / 8);
+  auto* data = reinterpret_cast<std::uint8_t*>(buffer->data());
+
+  // Empty vectors may not have any storage, which memcpy doesn't accept.
+  auto copy = [data](std::uint32_t offset, const void* source, std::size_t size) {
+    if (size) {
+      std::memcpy(data + offset, source, size);
+    }
+  };
+  copy(0, &header, sizeof(header));
+  copy(header.slicesOffset, slices.data(), slices.size() * sizeof(IndexSlice));
+  copy(header.dylibsOffset, dylibs.data(), dylibs.size() * sizeof(std::uint32_t));
+  copy(header.importsOffset, imports.data(), imports.size() * sizeof(IndexImport));
+  copy(header.stringsOffset, strings.data(), strings.size());
+
+  return ImageIndex(buffer, data, header.stringsOffset + header.stringsSize);
+}
+
+const char* getImportKindName(ImportKind kind)
+{
+  switch (kind) {
+    case ImportKind::Bind: return "bind";
+    case ImportKind::WeakBind: return "weak";
+    case ImportKind::LazyBind: return "lazy";
+    case ImportKind::Chained: return "chained";
+  }
+
+  return "unknown";
+}
+}
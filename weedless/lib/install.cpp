@@ -24,9 +24,15 @@
 
 // weedless
 #include "config.h"
+#include "copy.h"
 
 // stl
 #include <filesystem>
+#include <stdexcept>
+
+// c
+#include <cstdio>
+#include <unistd.h>
 
 
 namespace weedless {
@@ -48,21 +54,62 @@ GetFullPathFromInstallName(
 }
 
 
-void installDylibs(const config::Config& config)
+std::filesystem::path getInstallPath(
+    const config::Dylib& dylib, 
+    const std::filesystem::path& target)
+{
+  return GetFullPathFromInstallName(dylib.installName, target.parent_path());
+}
+
+bool isDylibInstalled(
+    const config::Dylib& dylib, 
+    const std::filesystem::path& destination,
+    const FileDigest& digest)
+{
+  if (dylib.path == destination) {
+    return true;
+  }
+
+  // Only hash the destination when its size matches.
+  std::error_code error;
+  const auto size = std::filesystem::file_size(destination, error);
+  return !error && size == digest.size && digestFile(destination) == digest;
+}
+
+bool installDylib(
+    const config::Dylib& dylib, 
+    const std::filesystem::path& destination,
+    const FileDigest& digest,
+    bool hardlink)
+{
+  // Leave matching copies alone, so their mtime doesn't trigger rebuilds.
+  if (isDylibInstalled(dylib, destination, digest)) {
+    return false;
+  }
+
+  // Build the new file next to the destination and swap it in, so a
+  // running process never sees a partial dylib. Hardlinks only work
+  // within a filesystem, clones fall back to copying.
+  const auto tempPath = getTempPath(destination);
+  if (!hardlink || link(dylib.path.c_str(), tempPath.c_str()) != 0) {
+    cloneFile(dylib.path, tempPath);
+  }
+  if (rename(tempPath.c_str(), destination.c_str()) != 0) {
+    unlink(tempPath.c_str());
+    throw std::runtime_error("Unable to install " + destination.string());
+  }
+  return true;
+}
+
+bool installDylibs(
+    const config::Config& config, 
+    const std::filesystem::path& target)
 {
-  std::filesystem::path path(config.target);
+  bool installed = false;
   for (const auto& dylib: config.dylibs) {
-    const auto fullPath = 
-      GetFullPathFromInstallName(
-          dylib.installName, 
-          config.target.parent_path()); 
-    if (dylib.path != fullPath) {
-      std::filesystem::copy(
-          dylib.path, 
-          fullPath, 
-          std::filesystem::copy_options::update_existing);
-    }
+    installed |= installDylib(dylib, getInstallPath(dylib, target), digestFile(dylib.path));
   }
+  return installed;
 }
 
 }
@@ -0,0 +1,257 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "journal.h"
+
+// stl
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+
+// c
+#include <unistd.h>
+
+// weedless
+#include "copy.h"
+#include "hash.h"
+#include "trace.h"
+
+namespace weedless {
+namespace {
+
+constexpr char kMagic[8] = {'W', 'D', 'L', 'S', 'U', 'N', 'D', 'O'};
+constexpr std::uint32_t kVersion = 1;
+// Set on edits past the end of the file before the patch.
+constexpr std::uint32_t kAppended = 1;
+
+// Every patch adds one record: this header and its edits, each an
+// EditHeader followed by the new bytes and (unless appended) the old ones.
+struct RecordHeader
+{
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t editCount;
+  std::uint64_t sizeBefore;
+  std::uint64_t sizeAfter;
+  std::uint64_t payloadSize;
+  // XXH64 of the payload.
+  std::uint64_t checksum;
+};
+
+struct EditHeader
+{
+  std::uint64_t offset;
+  std::uint32_t size;
+  std::uint32_t flags;
+};
+
+struct Record
+{
+  std::uint64_t sizeBefore;
+  std::uint64_t sizeAfter;
+  std::vector<FileEdit> edits;
+};
+
+template <typename T>
+void appendRaw(std::vector<std::uint8_t>& out, const T& value)
+{
+  const auto* bytes = (const std::uint8_t*)&value;
+  out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+std::vector<std::uint8_t> readFile(const std::filesystem::path& path)
+{
+  std::ifstream stream(path, std::ios::binary);
+  if (!stream) {
+    throw std::runtime_error("Unable to read " + path.string());
+  }
+  return {std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>()};
+}
+
+std::vector<Record> parseJournal(const std::vector<std::uint8_t>& bytes)
+{
+  const auto fail = []() -> void { throw std::runtime_error("Corrupt undo journal!"); };
+  std::vector<Record> records;
+  std::size_t offset = 0;
+  while (offset < bytes.size()) {
+    RecordHeader header;
+    if (bytes.size() - offset < sizeof(header)) {
+      fail();
+    }
+    memcpy(&header, bytes.data() + offset, sizeof(header));
+    offset += sizeof(header);
+    if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion ||
+        header.payloadSize > bytes.size() - offset ||
+        hashBytes(bytes.data() + offset, header.payloadSize) != header.checksum) {
+      fail();
+    }
+
+    Record record{header.sizeBefore, header.sizeAfter, {}};
+    const auto* p = bytes.data() + offset;
+    const auto* end = p + header.payloadSize;
+    for (std::uint32_t index = 0; index < header.editCount; index++) {
+      EditHeader editHeader;
+      if ((std::size_t)(end - p) < sizeof(editHeader)) {
+        fail();
+      }
+      memcpy(&editHeader, p, sizeof(editHeader));
+      p += sizeof(editHeader);
+      const bool appended = editHeader.flags & kAppended;
+      const std::size_t size = editHeader.size;
+      if ((std::size_t)(end - p) < (appended ? size : 2 * size)) {
+        fail();
+      }
+      FileEdit edit{editHeader.offset, {}, {p, p + size}};
+      p += size;
+      if (!appended) {
+        edit.before.assign(p, p + size);
+        p += size;
+      }
+      record.edits.push_back(std::move(edit));
+    }
+    if (p != end) {
+      fail();
+    }
+    offset += header.payloadSize;
+    records.push_back(std::move(record));
+  }
+  return records;
+}
+
+// Writes `bytes` to `path` atomically and durably.
+void writeJournal(const std::filesystem::path& path, const std::vector<std::uint8_t>& bytes)
+{
+  const auto tempPath = getTempPath(path);
+  try {
+    {
+      std::ofstream stream(tempPath, std::ios::binary | std::ios::trunc);
+      stream.write((const char*)bytes.data(), bytes.size());
+      if (!stream) {
+        throw std::runtime_error("Unable to write " + tempPath.string());
+      }
+    }
+    syncFile(tempPath);
+    std::filesystem::rename(tempPath, path);
+  } catch (...) {
+    std::error_code error;
+    std::filesystem::remove(tempPath, error);
+    throw;
+  }
+  syncFile(path.parent_path().empty() ? "." : path.parent_path());
+}
+
+bool matches(PartialFile& file, std::uint64_t offset, const std::vector<std::uint8_t>& bytes)
+{
+  if (offset > file.size() || bytes.size() > file.size() - offset) {
+    return false;
+  }
+  file.load(offset, bytes.size());
+  return memcmp(file.data() + offset, bytes.data(), bytes.size()) == 0;
+}
+}
+
+std::filesystem::path getJournalPath(const std::filesystem::path& target)
+{
+  auto path = target;
+  path += ".weedless-undo";
+  return path;
+}
+
+void appendJournal(const std::filesystem::path& target, PartialFile& file)
+{
+  std::vector<std::uint8_t> payload;
+  std::uint32_t editCount = 0;
+  for (const auto& edit: file.getEdits()) {
+    const bool appended = edit.before.empty();
+    appendRaw(payload, EditHeader{edit.offset, (std::uint32_t)edit.after.size(), appended ? kAppended : 0});
+    payload.insert(payload.end(), edit.after.begin(), edit.after.end());
+    payload.insert(payload.end(), edit.before.begin(), edit.before.end());
+    editCount++;
+  }
+
+  RecordHeader header{};
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.editCount = editCount;
+  header.sizeBefore = file.getDiskSize();
+  header.sizeAfter = file.size();
+  header.payloadSize = payload.size();
+  header.checksum = hashBytes(payload.data(), payload.size());
+
+  const auto path = getJournalPath(target);
+  std::vector<std::uint8_t> journal;
+  if (std::filesystem::exists(path)) {
+    journal = readFile(path);
+    parseJournal(journal);
+  }
+  appendRaw(journal, header);
+  journal.insert(journal.end(), payload.begin(), payload.end());
+  writeJournal(path, journal);
+}
+
+bool unpatch(const std::filesystem::path& target, IoStats* stats)
+{
+  trace::Scope scope(trace::Phase::Unpatch, target.string());
+  const auto journalPath = getJournalPath(target);
+  if (!std::filesystem::exists(journalPath)) {
+    return false;
+  }
+  const auto records = parseJournal(readFile(journalPath));
+
+  // Everything is reverted in memory first, so a target that doesn't match
+  // the journal is left alone.
+  PartialFile file(target);
+  std::uint64_t size = file.size();
+  for (auto record = records.rbegin(); record != records.rend(); ++record) {
+    bool applied = size == record->sizeAfter;
+    bool pending = size == record->sizeBefore;
+    for (const auto& edit: record->edits) {
+      applied = applied && matches(file, edit.offset, edit.after);
+      pending = pending && (edit.before.empty() || matches(file, edit.offset, edit.before));
+    }
+    if (applied) {
+      for (const auto& edit: record->edits) {
+        std::copy(edit.before.begin(), edit.before.end(), file.data() + edit.offset);
+      }
+      size = record->sizeBefore;
+    } else if (!pending) {
+      throw std::runtime_error("Target changed since it was patched!");
+    }
+  }
+
+  file.sync();
+  if (size < file.size()) {
+    if (truncate(target.c_str(), size) != 0) {
+      throw std::runtime_error("Unable to resize file.");
+    }
+    syncFile(target);
+  }
+  if (stats) {
+    *stats = file.getStats();
+  }
+  std::filesystem::remove(journalPath);
+  syncFile(target.parent_path().empty() ? "." : target.parent_path());
+  return true;
+}
+}
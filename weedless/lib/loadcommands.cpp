@@ -0,0 +1,201 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "loadcommands.h"
+
+// c
+#include <cstring>
+
+// stl
+#include <stdexcept>
+#include <string>
+
+namespace weedless {
+namespace {
+
+// Smallest valid size of a command weedless reads, 0 for the others.
+template <typename Layout>
+std::size_t getMinimumSize(const struct load_command& command)
+{
+  switch (command.cmd) {
+    case Layout::kSegmentCommand: 
+      return sizeof(typename Layout::Segment) + 
+        (std::size_t)((const typename Layout::Segment&)command).nsects * sizeof(typename Layout::Section);
+    case LC_LOAD_DYLIB:
+    case LC_LOAD_WEAK_DYLIB:
+    case LC_REEXPORT_DYLIB:
+    case LC_LOAD_UPWARD_DYLIB:
+    case LC_ID_DYLIB:
+      return sizeof(struct dylib_command);
+    case LC_DYLD_INFO:
+    case LC_DYLD_INFO_ONLY:
+      return sizeof(struct dyld_info_command);
+    case LC_SYMTAB:
+      return sizeof(struct symtab_command);
+    case LC_DYSYMTAB:
+      return sizeof(struct dysymtab_command);
+    case LC_CODE_SIGNATURE:
+    case LC_SEGMENT_SPLIT_INFO:
+    case LC_FUNCTION_STARTS:
+    case LC_DATA_IN_CODE:
+    case LC_DYLIB_CODE_SIGN_DRS:
+    case LC_LINKER_OPTIMIZATION_HINT:
+    case LC_DYLD_EXPORTS_TRIE:
+    case LC_DYLD_CHAINED_FIXUPS:
+      return sizeof(struct linkedit_data_command);
+    default:
+      return 0;
+  }
+}
+
+bool isLinkeditDataCommand(std::uint32_t cmd)
+{
+  return cmd == LC_CODE_SIGNATURE || cmd == LC_SEGMENT_SPLIT_INFO || cmd == LC_FUNCTION_STARTS || 
+         cmd == LC_DATA_IN_CODE || cmd == LC_DYLIB_CODE_SIGN_DRS || cmd == LC_LINKER_OPTIMIZATION_HINT || 
+         cmd == LC_DYLD_EXPORTS_TRIE || cmd == LC_DYLD_CHAINED_FIXUPS;
+}
+
+// Empty ranges are allowed anywhere, linkers leave their offsets at 0.
+bool isInImage(std::uint64_t offset, std::uint64_t size, std::size_t imageSize)
+{
+  return size == 0 || (offset <= imageSize && size <= imageSize - offset);
+}
+
+bool isDylibCommand(std::uint32_t cmd)
+{
+  return cmd == LC_LOAD_DYLIB || cmd == LC_LOAD_WEAK_DYLIB || cmd == LC_REEXPORT_DYLIB || 
+         cmd == LC_LOAD_UPWARD_DYLIB || cmd == LC_ID_DYLIB;
+}
+
+}
+
+template <typename Layout>
+LoadCommands<Layout>::LoadCommands(const typename Layout::Header& machHeader, std::size_t imageSize)
+  : first((std::uint8_t*)(&machHeader + 1)), count(machHeader.ncmds), size(machHeader.sizeofcmds)
+{
+  if (imageSize < sizeof(typename Layout::Header) || 
+      machHeader.sizeofcmds > imageSize - sizeof(typename Layout::Header)) {
+    throw std::runtime_error("Load commands exceed the image!");
+  }
+
+  std::size_t offset = 0;
+  for (std::uint32_t index = 0; index < count; index++) {
+    const auto fail = [index](const char* reason) {
+      throw std::runtime_error("Malformed load command " + std::to_string(index) + ": " + reason);
+    };
+    if (machHeader.sizeofcmds - offset < sizeof(struct load_command)) {
+      fail("exceeds sizeofcmds");
+    }
+    const auto& command = *(const struct load_command*)(first + offset);
+    if (command.cmdsize < sizeof(struct load_command)) {
+      fail("cmdsize is too small");
+    }
+    // dyld rejects these too, and every command behind them would be misaligned.
+    if (command.cmdsize % Layout::kPointerSize != 0) {
+      fail("cmdsize is not a multiple of the pointer size");
+    }
+    if (command.cmdsize > machHeader.sizeofcmds - offset) {
+      fail("exceeds sizeofcmds");
+    }
+    // Segments can only be sized once their fixed part is known to fit.
+    if ((command.cmd == Layout::kSegmentCommand && command.cmdsize < sizeof(typename Layout::Segment)) ||
+        command.cmdsize < getMinimumSize<Layout>(command)) {
+      fail("cmdsize is too small for its type");
+    }
+    if (isDylibCommand(command.cmd)) {
+      const auto& dylib = (const struct dylib_command&)command;
+      const auto nameOffset = dylib.dylib.name.offset;
+      if (nameOffset < sizeof(struct dylib_command) || nameOffset >= command.cmdsize ||
+          !memchr((const std::uint8_t*)&command + nameOffset, '\0', command.cmdsize - nameOffset)) {
+        fail("dylib name is out of bounds");
+      }
+    }
+    if (command.cmd == LC_DYLD_INFO || command.cmd == LC_DYLD_INFO_ONLY) {
+      const auto& info = (const struct dyld_info_command&)command;
+      if (!isInImage(info.rebase_off, info.rebase_size, imageSize) ||
+          !isInImage(info.bind_off, info.bind_size, imageSize) ||
+          !isInImage(info.weak_bind_off, info.weak_bind_size, imageSize) ||
+          !isInImage(info.lazy_bind_off, info.lazy_bind_size, imageSize) ||
+          !isInImage(info.export_off, info.export_size, imageSize)) {
+        fail("dyld info exceeds the image");
+      }
+    }
+    if (isLinkeditDataCommand(command.cmd)) {
+      const auto& data = (const struct linkedit_data_command&)command;
+      if (!isInImage(data.dataoff, data.datasize, imageSize)) {
+        fail("data exceeds the image");
+      }
+    }
+    offset += command.cmdsize;
+  }
+}
+
+template <typename Layout>
+LoadCommandIndex<Layout>::LoadCommandIndex(const LoadCommands<Layout>& commands)
+{
+  for (auto* command: commands.all()) {
+    switch (command->cmd) {
+      case Layout::kSegmentCommand: {
+        auto* segment = (typename Layout::Segment*)command;
+        if (!text && strncmp(segment->segname, SEG_TEXT, sizeof(segment->segname)) == 0) {
+          text = segment;
+        }
+        if (!linkedit && strncmp(segment->segname, SEG_LINKEDIT, sizeof(segment->segname)) == 0) {
+          linkedit = segment;
+        }
+        break;
+      }
+      case LC_DYLD_INFO:
+      case LC_DYLD_INFO_ONLY:
+        if (dyldInfo) {
+          throw std::runtime_error("There should only be 1 dyld_info_command!");
+        }
+        dyldInfo = (struct dyld_info_command*)command;
+        break;
+      case LC_DYLD_CHAINED_FIXUPS:
+        if (chainedFixups) {
+          throw std::runtime_error("There should only be 1 chained fixups command!");
+        }
+        chainedFixups = (struct linkedit_data_command*)command;
+        break;
+      case LC_DYLD_EXPORTS_TRIE:
+        if (exportsTrie) {
+          throw std::runtime_error("There should only be 1 exports trie command!");
+        }
+        exportsTrie = (struct linkedit_data_command*)command;
+        break;
+      case LC_CODE_SIGNATURE:
+        if (codeSignature) {
+          throw std::runtime_error("There should only be 1 code signature command!");
+        }
+        codeSignature = (struct linkedit_data_command*)command;
+        break;
+    }
+  }
+}
+
+template class LoadCommands<MachO64>;
+template class LoadCommands<MachO32>;
+template struct LoadCommandIndex<MachO64>;
+template struct LoadCommandIndex<MachO32>;
+}
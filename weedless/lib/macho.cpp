@@ -22,15 +22,9 @@
 
 #include "macho.h"
 
-// mach-o
-#include <mach-o/arch.h>
-#include <mach-o/fat.h>
-#include <mach-o/loader.h>
-#include <mach-o/nlist.h>
-
 // c
+#include <cstddef>
 #include <cstring>
-#include <cmath>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
@@ -38,320 +32,1270 @@
 
 
 // stl
+#include <algorithm>
 #include <iostream>
 #include <optional>
+#include <string_view>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
 // weedless
-#include "uleb.h"
+#include "bind.h"
+#include "codesign.h"
 #include "config.h"
+#include "copy.h"
+#include "fixups.h"
+#include "journal.h"
+#include "loadcommands.h"
+#include "machodefs.h"
+#include "parallel.h"
+#include "partial.h"
+#include "trace.h"
 
 namespace weedless {
 namespace {
-template <typename CommandType>
-CommandType* getLoadCommand(std::uint32_t index, const struct mach_header_64& machHeader)
+
+template <typename Layout>
+typename Layout::Header* getMachHeader(void* machoPtr) {
+  return (typename Layout::Header*)machoPtr;
+}
+
+// Magic of the image at `machoPtr`: MH_MAGIC_64 or MH_MAGIC, or 0 when it
+// isn't a Mach-O weedless can patch or its header doesn't fit.
+std::uint32_t getMagic(const void* machoPtr, std::uint64_t machoSize)
 {
-  struct load_command* currentLc = (struct load_command*)((std::intptr_t)&machHeader + sizeof(struct mach_header_64));
-  for (std::uint32_t i = 0; i < machHeader.ncmds; i++) {
-    if (i == index) {
-      return reinterpret_cast<CommandType*>(currentLc);
-    }
-    currentLc = (struct load_command*)((std::intptr_t)currentLc + currentLc->cmdsize);
+  if (machoSize < sizeof(struct mach_header)) {
+    return 0;
   }
-  return nullptr;
+  const auto magic = ((const struct mach_header*)machoPtr)->magic;
+  if (magic == MH_MAGIC_64 && machoSize >= sizeof(struct mach_header_64)) {
+    return magic;
+  }
+  return magic == MH_MAGIC ? magic : 0;
 }
 
-template <typename CommandType>
-void appendLoadCommand(
-    const CommandType& command, 
-    struct mach_header_64& machHeader)
+// Calls `fn` with the layout of the image at `machoPtr`, MachO64 or
+// MachO32, so everything it parses or patches is instantiated for that
+// layout and never has to check the width again.
+template <typename Fn>
+decltype(auto) withLayout(const void* machoPtr, std::uint64_t machoSize, Fn&& fn)
 {
-  auto* startNewLc = (uint8_t*)(
-        (std::intptr_t)&machHeader + 
-        sizeof(struct mach_header_64) +
-        machHeader.sizeofcmds);
-
-  for (std::size_t index = 0; index < command.cmdsize; index++) {
-    if (startNewLc[index] != 0) {
-      throw std::runtime_error("Not enough space to inject load_command!");
-    }
+  switch (getMagic(machoPtr, machoSize)) {
+    case MH_MAGIC_64: 
+      return fn(MachO64{});
+    case MH_MAGIC: 
+      return fn(MachO32{});
+    default:
+      throw std::runtime_error("Unsupported Mach-O slice.");
   }
+}
 
-  memcpy(startNewLc, &command, command.cmdsize);
-  machHeader.sizeofcmds += command.cmdsize;
-  machHeader.ncmds += 1;
+// A thin Mach-O inside a (possibly fat) file.
+struct Slice
+{
+  // Index in the fat header, 0 for thin files.
+  std::uint32_t index;
+  std::uint64_t offset;
+  std::uint64_t size;
+  cpu_type_t cputype;
+  cpu_subtype_t cpusubtype;
+};
+
+// Fat headers are always stored big endian.
+std::uint32_t readBigEndian32(const uint8_t* ptr)
+{
+  return (std::uint32_t(ptr[0]) << 24) | (std::uint32_t(ptr[1]) << 16) |
+         (std::uint32_t(ptr[2]) << 8) | std::uint32_t(ptr[3]);
 }
 
-template <typename CommandType>
-std::vector<CommandType*> getLoadCommands(std::vector<std::uint32_t> commandTypes, const struct mach_header_64& machHeader)
+std::uint64_t readBigEndian64(const uint8_t* ptr)
 {
-  std::vector<CommandType*> loadCommands;
-  struct load_command* currentLc = (struct load_command*)((std::intptr_t)&machHeader + sizeof(struct mach_header_64));
-  for (std::uint32_t i = 0; i < machHeader.ncmds; i++) {
-    for (const auto commandType: commandTypes) {
-      if (currentLc->cmd == commandType) {
-        loadCommands.push_back(reinterpret_cast<CommandType*>(currentLc));
-      }
-    }
-    currentLc = (struct load_command*)((std::uintptr_t)currentLc + currentLc->cmdsize);
-  }
-  return loadCommands;
+  return (std::uint64_t(readBigEndian32(ptr)) << 32) | readBigEndian32(ptr + 4);
 }
 
-struct segment_command_64* getSegmentCommand(const char* name, const struct mach_header_64& machHeader)
+void writeBigEndian32(uint8_t* ptr, std::uint32_t value)
 {
-  for (auto* segCmd : getLoadCommands<struct segment_command_64>({LC_SEGMENT_64}, machHeader)) {
-    if (strcmp(segCmd->segname, name) == 0) {
-      return segCmd;
-    }
-  }
-  return nullptr;
+  ptr[0] = value >> 24;
+  ptr[1] = value >> 16;
+  ptr[2] = value >> 8;
+  ptr[3] = value;
 }
 
-struct dyld_info_command* getDyldInfoCommand(const struct mach_header_64& machHeader)
+void writeBigEndian64(uint8_t* ptr, std::uint64_t value)
 {
-  auto dyldInfoCmds = getLoadCommands<struct dyld_info_command>({LC_DYLD_INFO_ONLY}, machHeader);
-  assert(dyldInfoCmds.size() == 1 && "There should only be 1 such LC!"); 
-  return dyldInfoCmds[0];
+  writeBigEndian32(ptr, value >> 32);
+  writeBigEndian32(ptr + 4, value);
 }
 
-struct std::vector<struct dylib_command*> getLoadDylibCommands(const struct mach_header_64& machHeader)
+std::vector<Slice> getSlices(const void* filePtr, std::size_t fileSize)
 {
-  auto loadDylibCmds = getLoadCommands<struct dylib_command>({LC_LOAD_DYLIB, LC_LOAD_UPWARD_DYLIB, LC_LOAD_WEAK_DYLIB}, machHeader);
-  auto loadDylinkerCmd = getLoadCommand<struct dylib_command>(LC_LOAD_DYLINKER, machHeader);
-  loadDylibCmds.insert(loadDylibCmds.begin(), loadDylinkerCmd);
-  return loadDylibCmds;
+  const auto* bytes = (const uint8_t*)filePtr;
+  if (fileSize < sizeof(std::uint32_t)) {
+    throw std::runtime_error("File too small to be a Mach-O.");
+  }
+
+  const auto magic = readBigEndian32(bytes);
+  if (magic != FAT_MAGIC && magic != FAT_MAGIC_64) {
+    if (fileSize < sizeof(struct mach_header)) {
+      throw std::runtime_error("File too small to be a Mach-O.");
+    }
+    // Both layouts start alike.
+    const auto* machHeader = (const struct mach_header*)filePtr;
+    return {{0, 0, fileSize, machHeader->cputype, machHeader->cpusubtype}};
+  }
+
+  const auto archCount = readBigEndian32(bytes + offsetof(struct fat_header, nfat_arch));
+  const auto archSize = 
+    magic == FAT_MAGIC_64 ? sizeof(struct fat_arch_64) : sizeof(struct fat_arch);
+  if (sizeof(struct fat_header) + archCount * archSize > fileSize) {
+    throw std::runtime_error("Fat header exceeds file size.");
+  }
+
+  std::vector<Slice> slices;
+  for (std::uint32_t i = 0; i < archCount; i++) {
+    const auto* arch = bytes + sizeof(struct fat_header) + i * archSize;
+    Slice slice;
+    slice.index = i;
+    slice.cputype = readBigEndian32(arch + offsetof(struct fat_arch, cputype));
+    slice.cpusubtype = readBigEndian32(arch + offsetof(struct fat_arch, cpusubtype));
+    if (magic == FAT_MAGIC_64) {
+      slice.offset = readBigEndian64(arch + offsetof(struct fat_arch_64, offset));
+      slice.size = readBigEndian64(arch + offsetof(struct fat_arch_64, size));
+    } else {
+      slice.offset = readBigEndian32(arch + offsetof(struct fat_arch, offset));
+      slice.size = readBigEndian32(arch + offsetof(struct fat_arch, size));
+    }
+    if (slice.offset > fileSize || slice.size > fileSize - slice.offset) {
+      throw std::runtime_error("Fat slice exceeds file size.");
+    }
+    slices.push_back(slice);
+  }
+  return slices;
 }
 
-struct mach_header_64* getMachHeader(void* machoPtr) {
-  return (struct mach_header_64*)machoPtr;
+void setSliceSize(void* filePtr, const Slice& slice)
+{
+  auto* bytes = (uint8_t*)filePtr;
+  const auto magic = readBigEndian32(bytes);
+  if (magic == FAT_MAGIC_64) {
+    auto* arch = bytes + sizeof(struct fat_header) + slice.index * sizeof(struct fat_arch_64);
+    writeBigEndian64(arch + offsetof(struct fat_arch_64, size), slice.size);
+  } else if (magic == FAT_MAGIC) {
+    auto* arch = bytes + sizeof(struct fat_header) + slice.index * sizeof(struct fat_arch);
+    writeBigEndian32(arch + offsetof(struct fat_arch, size), slice.size);
+  }
 }
 
-struct SymbolInfo
+// Size of the command injected for `installName`. Load commands are
+// aligned to the pointer size.
+template <typename Layout>
+std::size_t getDylibCommandSize(const std::string& installName)
 {
-  const char* symbolName;
-  int dylib;
-};
+  constexpr std::size_t kAlignment = Layout::kPointerSize;
+  return (sizeof(struct dylib_command) + installName.size() + 1 + kAlignment - 1) & ~(kAlignment - 1);
+}
 
-struct LazyBindingInfo
+// Appends a LC_LOAD_DYLIB behind the load commands, into the zeros
+// between them and the first section.
+template <typename Layout>
+void injectDylib(const std::string& installName, typename Layout::Header& machHeader, std::size_t machoSize)
 {
-  uint8_t* symbolNamePtr;
-  uint8_t* dylibIndexPtr;
+  trace::Scope scope(trace::Phase::Inject);
+  const auto cmdSize = getDylibCommandSize<Layout>(installName);
+  const auto commandsEnd = sizeof(typename Layout::Header) + machHeader.sizeofcmds;
+  auto* command = (uint8_t*)&machHeader + commandsEnd;
+  if (commandsEnd > machoSize || cmdSize > machoSize - commandsEnd || 
+      std::any_of(command, command + cmdSize, [](uint8_t byte) { return byte != 0; })) {
+    throw std::runtime_error("Not enough space to inject load_command!");
+  }
 
-  bool isValid() { return symbolNamePtr && dylibIndexPtr; }
+  struct dylib_command loadDylibCmd {};
+  loadDylibCmd.cmd = LC_LOAD_DYLIB;
+  loadDylibCmd.cmdsize = cmdSize;
+  loadDylibCmd.dylib.compatibility_version = 1;
+  loadDylibCmd.dylib.current_version = 1;
+  loadDylibCmd.dylib.name.offset = sizeof(struct dylib_command);
+  loadDylibCmd.dylib.timestamp = 2;
+  memcpy(command, &loadDylibCmd, sizeof(loadDylibCmd));
+  memcpy(command + sizeof(loadDylibCmd), installName.data(), installName.size());
 
-  int dylibBindOpcode;
+  machHeader.sizeofcmds += cmdSize;
+  machHeader.ncmds += 1;
+}
 
-  const char* getSymbolName() const { return (const char*) symbolNamePtr; }
-  uint8_t getDylibIndex() const { 
-    if (dylibBindOpcode == BIND_OPCODE_SET_DYLIB_ORDINAL_IMM) {
-      return dylibIndexPtr[0] & BIND_IMMEDIATE_MASK; 
-    }
-   
-    if (dylibBindOpcode == BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB) {
-      const uint8_t* ptr = dylibIndexPtr+1;
-      return read_uleb128(ptr, ptr+16).first; 
-    }
+// Replaces `size` bytes of __LINKEDIT data at `offset` by `bytes`.
+struct LinkeditRewrite
+{
+  std::uint32_t offset;
+  std::uint32_t size;
+  std::vector<uint8_t> bytes;
+};
 
+// Number of bytes __LINKEDIT has to grow by to apply `rewrite`. Growing in
+// steps of 16 keeps everything after it aligned.
+std::size_t getLinkeditGrowth(const LinkeditRewrite& rewrite)
+{
+  if (rewrite.bytes.size() <= rewrite.size) {
     return 0;
   }
+  return (rewrite.bytes.size() - rewrite.size + 15) & ~std::size_t(15);
+}
 
-  void setDylibIndex(uint64_t index)
-  {
-    if (dylibBindOpcode == BIND_OPCODE_SET_DYLIB_ORDINAL_IMM) {
-      if (index > 15) {
-        throw std::runtime_error("Dylib ordinal does not fit in imm opcode (not supported)");
-      }
-      dylibIndexPtr[0] = BIND_OPCODE_SET_DYLIB_ORDINAL_IMM + (index & BIND_IMMEDIATE_MASK);
-    }
-       
-    if (dylibBindOpcode == BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB) {
-      write_uleb128(dylibIndexPtr+1, index, 1); 
-    }
+// Opens a gap of `delta` bytes at `offset` in __LINKEDIT, moving only the
+// data behind it and fixing up all load commands that refer to that data.
+// The image has to have room for `machoSize + delta` bytes.
+template <typename Layout>
+void insertLinkeditSpace(
+    typename Layout::Header& machHeader, 
+    std::size_t machoSize,
+    std::uint32_t offset, 
+    std::uint32_t delta)
+{
+  const LoadCommands commands(machHeader, machoSize);
+  auto* linkedit = LoadCommandIndex(commands).linkedit;
+  if (!linkedit || 
+      offset < linkedit->fileoff || 
+      offset > linkedit->fileoff + linkedit->filesize) {
+    throw std::runtime_error("Data to grow is not in __LINKEDIT!");
+  }
+  if (linkedit->fileoff + linkedit->filesize != machoSize) {
+    throw std::runtime_error("__LINKEDIT is not at the end of the image!");
   }
 
-};
+  auto* base = (uint8_t*)&machHeader;
+  memmove(base + offset + delta, base + offset, machoSize - offset);
+  memset(base + offset, 0, delta);
+
+  auto shift = [offset, delta](std::uint32_t& dataOffset) {
+    if (dataOffset != 0 && dataOffset >= offset) {
+      dataOffset += delta;
+    }
+  };
 
-std::vector<LazyBindingInfo> getLazyBindingInfo(const struct mach_header_64& machHeader) {
-
-  const auto* dyldInfoCmd = getDyldInfoCommand(machHeader);
-  if (!dyldInfoCmd) { 
-    throw std::runtime_error("Could not get dyld_info_command!"); 
-  }
-  
-  uint8_t* lazyBindInfo = (uint8_t*)((intptr_t)&machHeader + dyldInfoCmd->lazy_bind_off);
- 
-  std::vector<LazyBindingInfo> lazyBindingInfos;
-  LazyBindingInfo currentInfo;
-  for (int i = 0; i < dyldInfoCmd->lazy_bind_size; i++) {
-    switch(lazyBindInfo[i] & BIND_OPCODE_MASK)
-    {
-      case BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM: {
-        currentInfo.symbolNamePtr = lazyBindInfo+i+1; 
-        i += strlen(currentInfo.getSymbolName())+1;
+  for (auto* lc : commands.template ofType<struct load_command,
+        LC_DYLD_INFO, LC_DYLD_INFO_ONLY, LC_SYMTAB, LC_DYSYMTAB, 
+        LC_CODE_SIGNATURE, LC_SEGMENT_SPLIT_INFO, LC_FUNCTION_STARTS, 
+        LC_DATA_IN_CODE, LC_DYLIB_CODE_SIGN_DRS, LC_LINKER_OPTIMIZATION_HINT,
+        LC_DYLD_EXPORTS_TRIE, LC_DYLD_CHAINED_FIXUPS>()) {
+    switch (lc->cmd) {
+      case LC_DYLD_INFO:
+      case LC_DYLD_INFO_ONLY: {
+        auto* cmd = (struct dyld_info_command*)lc;
+        shift(cmd->rebase_off);
+        shift(cmd->bind_off);
+        shift(cmd->weak_bind_off);
+        shift(cmd->lazy_bind_off);
+        shift(cmd->export_off);
         break;
       }
-      case BIND_OPCODE_SET_DYLIB_ORDINAL_IMM: {
-        currentInfo.dylibIndexPtr = lazyBindInfo + i;
-        currentInfo.dylibBindOpcode = BIND_OPCODE_SET_DYLIB_ORDINAL_IMM;
+      case LC_SYMTAB: {
+        auto* cmd = (struct symtab_command*)lc;
+        shift(cmd->symoff);
+        shift(cmd->stroff);
         break;
       }
-      case BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB: {
-        currentInfo.dylibIndexPtr = lazyBindInfo + i;
-        currentInfo.dylibBindOpcode = BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB;
-        
-        const uint8_t* ptr = lazyBindInfo+i;
-        auto [data, size] = read_uleb128(ptr, lazyBindInfo+dyldInfoCmd->lazy_bind_size); 
-        i += ceil((float)size/8); 
+      case LC_DYSYMTAB: {
+        auto* cmd = (struct dysymtab_command*)lc;
+        shift(cmd->tocoff);
+        shift(cmd->modtaboff);
+        shift(cmd->extrefsymoff);
+        shift(cmd->indirectsymoff);
+        shift(cmd->extreloff);
+        shift(cmd->locreloff);
         break;
       }
-      case BIND_OPCODE_DONE: {
-        if (!currentInfo.isValid()) { break; }
-        lazyBindingInfos.push_back(currentInfo);
-        memset(&currentInfo, 0, sizeof(SymbolInfo));
+      default: {
+        shift(((struct linkedit_data_command*)lc)->dataoff);
         break;
       }
-      case BIND_OPCODE_SET_DYLIB_SPECIAL_IMM:
-      case BIND_OPCODE_SET_TYPE_IMM:
-      case BIND_OPCODE_DO_BIND_ADD_ADDR_IMM_SCALED:
-      case BIND_OPCODE_THREADED: {
-        break;
+    }
+  }
+
+  // Keep the segment page aligned in memory (16K covers every platform).
+  linkedit->filesize += delta;
+  linkedit->vmsize = std::max<decltype(linkedit->vmsize)>(
+      linkedit->vmsize, (linkedit->filesize + 0x3fff) & ~0x3fffull);
+}
+
+// Applies `rewrite` to an image of `machoSize` bytes. There has to be
+// room for the growth returned by getLinkeditGrowth behind the image.
+template <typename Layout>
+void applyLinkeditRewrite(
+    typename Layout::Header& machHeader, 
+    std::size_t machoSize,
+    const LinkeditRewrite& rewrite)
+{
+  trace::Scope scope(trace::Phase::Inject);
+  const auto delta = getLinkeditGrowth(rewrite);
+  if (delta) {
+    insertLinkeditSpace<Layout>(machHeader, machoSize, rewrite.offset + rewrite.size, delta);
+  }
+
+  auto* data = (uint8_t*)&machHeader + rewrite.offset;
+  memcpy(data, rewrite.bytes.data(), rewrite.bytes.size());
+  memset(data + rewrite.bytes.size(), 0, rewrite.size + delta - rewrite.bytes.size());
+
+  auto* dyldInfoCmd = LoadCommandIndex(LoadCommands(machHeader, machoSize + delta)).dyldInfo;
+  dyldInfoCmd->bind_off = rewrite.offset;
+  dyldInfoCmd->bind_size = rewrite.size + delta;
+}
+
+// Maps install names to the (1-based) ordinals the bind opcodes refer to.
+// Built with a single walk over the load commands.
+struct DylibOrdinals
+{
+  std::unordered_map<std::string_view, std::size_t> byInstallName;
+  std::size_t count = 0;
+
+  void add(std::string_view installName) 
+  {
+    // Keep the first match, like dyld does for duplicate install names.
+    byInstallName.emplace(installName, ++count);
+  }
+
+  std::optional<std::size_t> find(std::string_view installName) const
+  {
+    auto it = byInstallName.find(installName);
+    if (it == byInstallName.end()) {
+      return std::nullopt;
+    }
+    return it->second;
+  }
+};
+
+// The dylibs the bind ordinals count.
+template <typename Layout>
+using DylibCommands = typename LoadCommands<Layout>::template Range<struct dylib_command, 
+  LC_LOAD_DYLIB, LC_LOAD_WEAK_DYLIB, LC_REEXPORT_DYLIB, LC_LOAD_UPWARD_DYLIB>;
+
+template <typename Layout>
+DylibCommands<Layout> getDylibCommands(const LoadCommands<Layout>& commands)
+{
+  return commands.template ofType<struct dylib_command, 
+    LC_LOAD_DYLIB, LC_LOAD_WEAK_DYLIB, LC_REEXPORT_DYLIB, LC_LOAD_UPWARD_DYLIB>();
+}
+
+template <typename Layout>
+DylibOrdinals getDylibOrdinals(const LoadCommands<Layout>& commands)
+{
+  trace::Scope scope(trace::Phase::LoadCommands);
+  DylibOrdinals ordinals;
+  for (const auto* dlc : getDylibCommands(commands)) {
+    ordinals.add(getDylibName(*dlc));
+  }
+  return ordinals;
+}
+
+// Resolves hooks to the ordinals of their dylibs in an image. Exact hooks
+// are resolved up front, later ones for the same symbol override earlier
+// ones. Imports matching a hook pattern are added as they are found.
+class HookResolver
+{
+public:
+  HookResolver(const config::Config& config, const DylibOrdinals& dylibOrdinals)
+    : config(config)
+  {
+    trace::Scope scope(trace::Phase::HookMatch);
+    ordinals.reserve(config.dylibs.size());
+    for (const auto& dylib: config.dylibs) {
+      ordinals.push_back(dylibOrdinals.find(dylib.installName));
+    }
+
+    hookOrdinals.reserve(config.hooks.size());
+    for (const auto& hook : config.hooks) {
+      if (hook.kind == PatternKind::Exact) {
+        hookOrdinals.insert_or_assign(config.getSymbol(hook), getOrdinal(hook));
       }
-      
-      case BIND_OPCODE_SET_ADDEND_SLEB:
-      case BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB:
-      case BIND_OPCODE_ADD_ADDR_ULEB:
-      case BIND_OPCODE_DO_BIND_ADD_ADDR_ULEB:
-      case BIND_OPCODE_DO_BIND_ULEB_TIMES_SKIPPING_ULEB:{
-        const uint8_t* ptr = lazyBindInfo+i;
-        auto [data, size] = read_uleb128(ptr, lazyBindInfo+dyldInfoCmd->lazy_bind_size); 
-        i += ceil((float)size/8); 
+    }
+  }
+
+  // Adds `symbol` when it matches a hook pattern and no exact hook. The
+  // symbol has to outlive the resolver.
+  void resolve(std::string_view symbol)
+  {
+    if (config.patterns.empty() || hookOrdinals.count(symbol)) {
+      return;
+    }
+    if (const auto* hook = config.matchPattern(symbol)) {
+      hookOrdinals.emplace(symbol, getOrdinal(*hook));
+    }
+  }
+
+  const SymbolOrdinals& getOrdinals() const { return hookOrdinals; }
+
+private:
+  std::size_t getOrdinal(const config::Hook& hook) const
+  {
+    const auto& ordinal = ordinals[hook.dylib];
+    if (!ordinal.has_value()) {
+      throw std::runtime_error("Can't find dylib index!");
+    }
+    return *ordinal;
+  }
+
+  const config::Config& config;
+  // Ordinal of every config dylib in the image.
+  std::vector<std::optional<std::size_t>> ordinals;
+  SymbolOrdinals hookOrdinals;
+};
+
+// Whether patching would leave the image unchanged: all dylibs are
+// injected and every hooked import already uses its hook's ordinal.
+template <typename Layout>
+bool isMachOPatched(void* machoPtr, std::size_t machoSize, const config::Config& config)
+{
+  const LoadCommands commands(*getMachHeader<Layout>(machoPtr), machoSize);
+  const LoadCommandIndex index(commands);
+  const auto dylibOrdinals = getDylibOrdinals(commands);
+  for (const auto& dylib: config.dylibs) {
+    if (!dylibOrdinals.find(dylib.installName).has_value()) {
+      return false;
+    }
+  }
+
+  HookResolver hooks(config, dylibOrdinals);
+  auto isHooked = [&hooks](const char* symbol, std::int64_t dylibIndex) {
+    hooks.resolve(symbol);
+    auto it = hooks.getOrdinals().find(symbol);
+    return it == hooks.getOrdinals().end() || (std::int64_t)it->second == dylibIndex;
+  };
+
+  if (const auto* dyldInfoCmd = index.dyldInfo) {
+    for (const auto& info: getBindingInfo<Layout>((uint8_t*)machoPtr, machoSize, *dyldInfoCmd)) {
+      // Weak bindings have no ordinal and are never rebound.
+      if (info.ordinalOffset != 0 && 
+          !isHooked(getSymbolName((uint8_t*)machoPtr, info), info.dylibIndex)) {
+        return false;
       }
     }
   }
 
-  return lazyBindingInfos;
+  bool patched = true;
+  if (const auto* chainedFixupsCmd = index.chainedFixups) {
+    trace::Scope scope(trace::Phase::BindDecode);
+    forEachChainedImport(
+        (uint8_t*)machoPtr, 
+        machoSize,
+        *chainedFixupsCmd,
+        [&](ChainedImport& import) {
+          patched = patched && isHooked(import.getSymbolName(), import.getDylibIndex());
+        });
+  }
+  return patched;
 }
 
-void injectDylib(const std::string& dylibPath, void* machoPtr) {
-  auto* machHeader = getMachHeader(machoPtr);
+template <typename Layout>
+std::optional<LinkeditRewrite> 
+patchMachOImpl(void* machoPtr, std::size_t machoSize, const config::Config& config)
+{
+  auto* machHeader = getMachHeader<Layout>(machoPtr);
   if (!machHeader) { 
     throw std::runtime_error("Could not get mach_header."); 
   }
- 
-  std::size_t cmdSize = sizeof(struct dylib_command) + dylibPath.length() +1;
-  auto * loadDylibCmd = (struct dylib_command*)malloc(cmdSize);
+  // Stripping first frees the space of the signature command for injecting.
+  if (config.codeSignature == config::CodeSignature::Strip) {
+    stripCodeSignature(*machHeader, machoSize);
+  }
+
+  // Injecting only appends commands, so the indexed ones stay in place.
+  const LoadCommands commands(*machHeader, machoSize);
+  const LoadCommandIndex index(commands);
+  auto dylibOrdinals = getDylibOrdinals(commands);
+
+  // Injected dylibs are appended after all existing load commands, so
+  // they simply take the next ordinals.
+  for (const auto& dylib: config.dylibs)
+  {
+    if (!dylibOrdinals.find(dylib.installName).has_value()) {
+      injectDylib<Layout>(dylib.installName, *machHeader, machoSize);
+      dylibOrdinals.add(dylib.installName);
+    }
+  }
 
-  loadDylibCmd->cmd = LC_LOAD_DYLIB;
-  loadDylibCmd->cmdsize = cmdSize;
-  loadDylibCmd->dylib.compatibility_version = 1;
-  loadDylibCmd->dylib.current_version = 1;
-  loadDylibCmd->dylib.name.offset = sizeof(struct dylib_command);
-  loadDylibCmd->dylib.timestamp = 2;
+  HookResolver hooks(config, dylibOrdinals);
+
+  // Binaries built for older deployment targets bind through opcodes in 
+  // LC_DYLD_INFO(_ONLY), newer ones import through LC_DYLD_CHAINED_FIXUPS.
+  const auto* dyldInfoCmd = index.dyldInfo;
+  const auto* chainedFixupsCmd = index.chainedFixups;
+  if (!dyldInfoCmd && !chainedFixupsCmd) {
+    throw std::runtime_error("Could not get dyld_info_command or chained fixups!");
+  }
 
-  void* dylibNameStart = (void*)((intptr_t)loadDylibCmd + loadDylibCmd->dylib.name.offset); 
-  memcpy(dylibNameStart, dylibPath.c_str(), dylibPath.length());
+  std::optional<LinkeditRewrite> rewrite;
+  if (dyldInfoCmd) {
+    // All three opcode streams are decoded together and patched in one pass.
+    const auto bindingInfos = 
+      getBindingInfo<Layout>((uint8_t*)machoPtr, machoSize, *dyldInfoCmd);
+    if (!config.patterns.empty()) {
+      trace::Scope scope(trace::Phase::HookMatch);
+      for (const auto& info: bindingInfos) {
+        hooks.resolve(getSymbolName((uint8_t*)machoPtr, info));
+      }
+    }
+    auto bindStream = 
+      rebindSymbols((uint8_t*)machoPtr, *dyldInfoCmd, bindingInfos, hooks.getOrdinals());
+    if (bindStream.has_value()) {
+      // Without a bind stream, the new one goes where the lazy one starts.
+      rewrite = LinkeditRewrite {
+        dyldInfoCmd->bind_size ? dyldInfoCmd->bind_off : dyldInfoCmd->lazy_bind_off,
+        dyldInfoCmd->bind_size,
+        std::move(*bindStream)};
+    }
+  }
 
-  appendLoadCommand(*loadDylibCmd, *machHeader);
+  if (chainedFixupsCmd) {
+    trace::Scope scope(trace::Phase::HookMatch);
+    std::size_t matched = 0;
+    forEachChainedImport(
+        (uint8_t*)machoPtr, 
+        machoSize,
+        *chainedFixupsCmd,
+        [&hooks, &matched](ChainedImport& import) {
+          hooks.resolve(import.getSymbolName());
+          auto it = hooks.getOrdinals().find(import.getSymbolName());
+          if (it != hooks.getOrdinals().end()) {
+            import.setDylibIndex(it->second);
+            matched++;
+          }
+        });
+    trace::count(trace::Counter::HooksMatched, matched);
+  }
 
-  free (loadDylibCmd);
+  return rewrite;
 }
 
-std::optional<std::size_t>
-getDylibLoadCmdIndexByName(const char* dylibName, const mach_header_64& machHeader)
+// A file mapped read-write, that can grow while it is mapped.
+class MappedFile
 {
-  auto dylibLoadCmds = getLoadDylibCommands(machHeader);
-  for (size_t dylibIndex = 0; dylibIndex < dylibLoadCmds.size(); dylibIndex++) {
-    const auto* dlc = dylibLoadCmds[dylibIndex];
-    const char* curDylibName = (const char*)((intptr_t)dlc + dlc->dylib.name.offset); 
-    if (strcmp(dylibName, curDylibName) == 0) {
-      return dylibIndex; 
+public:
+  explicit MappedFile(const std::filesystem::path& path, bool writable = true)
+    : writable(writable)
+  {
+    trace::Scope scope(trace::Phase::Map, path.string());
+    if ((fd = open(path.c_str(), writable ? O_RDWR : O_RDONLY)) < 0) {
+      throw std::runtime_error("Could not read input file.");
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+      close(fd);
+      throw std::runtime_error("Could not get file info.");
+    }
+
+    try {
+      map(st.st_size);
+    } catch (...) {
+      close(fd);
+      throw;
     }
   }
-  return std::nullopt;
+
+  ~MappedFile()
+  {
+    munmap(ptr, length);
+    close(fd);
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  std::uint8_t* data() { return (std::uint8_t*)ptr; }
+  std::size_t size() const { return length; }
+
+  // Invalidates all pointers into the mapping.
+  void resize(std::size_t newSize)
+  {
+    if (munmap(ptr, length) == -1) {
+      throw std::runtime_error("Unable to unmap file..");
+    }
+    ptr = MAP_FAILED;
+    if (ftruncate(fd, newSize) == -1) {
+      throw std::runtime_error("Unable to resize file.");
+    }
+    map(newSize);
+  }
+
+  void sync()
+  {
+    trace::Scope scope(trace::Phase::Sync);
+    if (msync(ptr, length, MS_SYNC) == -1) {
+      throw std::runtime_error("Unable to sync file to disk.");
+    }
+  }
+
+private:
+  void map(std::size_t newSize)
+  {
+    ptr = writable
+      ? mmap(NULL, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+      : mmap(NULL, newSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (ptr == MAP_FAILED) {
+      throw std::runtime_error("Could not map file.");
+    }
+    length = newSize;
+    trace::count(trace::Counter::BytesMapped, newSize);
+  }
+
+  bool writable;
+  int fd = -1;
+  void* ptr = MAP_FAILED;
+  std::size_t length = 0;
+};
+
+// The slices of `allSlices` that the config asks to patch.
+std::vector<Slice> selectSlices(
+    std::uint8_t* filePtr, 
+    const std::vector<Slice>& allSlices, 
+    const config::Config& config)
+{
+  trace::Scope scope(trace::Phase::LoadCommands);
+  std::vector<Slice> slices;
+  for (const auto& slice: allSlices) {
+    const auto archName = getArchName(slice.cputype, slice.cpusubtype);
+    if (!config.archs.empty() && 
+        std::find(config.archs.begin(), config.archs.end(), archName) == config.archs.end()) {
+      continue;
+    }
+
+    if (!getMagic(filePtr + slice.offset, slice.size)) {
+      throw std::runtime_error("Unsupported Mach-O slice (" + archName + ").");
+    }
+    slices.push_back(slice);
+  }
+
+  if (slices.empty()) {
+    throw std::runtime_error("No slice matches the configured architectures.");
+  }
+  return slices;
+}
+
+// Signing reads pages that patching doesn't, mapped files have them all.
+void loadRange(MappedFile&, std::uint64_t, std::uint64_t) {}
+
+void loadRange(PartialFile& file, std::uint64_t offset, std::uint64_t size)
+{
+  file.load(offset, size);
 }
 
-void patchMachOImpl(void* machoPtr, const config::Config& config)
+// Makes room for a slice to grow by `delta` bytes. Fat slices can only
+// grow into the alignment padding before the next slice.
+template <typename File>
+void reserveSliceGrowth(
+    File& file, 
+    const Slice& slice, 
+    const std::vector<Slice>& allSlices, 
+    std::size_t delta)
 {
-  const auto* machHeader = getMachHeader(machoPtr);
-  if (!machHeader) { 
-    throw std::runtime_error("Could not get mach_header."); 
+  const auto sliceEnd = slice.offset + slice.size;
+  for (const auto& other: allSlices) {
+    if (other.offset >= sliceEnd && sliceEnd + delta > other.offset) {
+      throw std::runtime_error(
+          "Not enough space to grow slice (" + 
+          getArchName(slice.cputype, slice.cpusubtype) + ").");
+    }
+  }
+  if (sliceEnd + delta > file.size()) {
+    file.resize(sliceEnd + delta);
   }
+}
 
-  for (const auto& dylib: config.dylibs)
+// Whether the signature of a slice is what the config asks for. Ad-hoc
+// signatures have to match the pages patching writes, at 16K pages those
+// cover every page size.
+template <typename Layout, typename File>
+bool isSignatureCurrent(File& file, const Slice& slice, config::CodeSignature mode)
+{
+  const auto* machHeader = getMachHeader<Layout>(file.data() + slice.offset);
+  const LoadCommands commands(*machHeader, slice.size);
+  const LoadCommandIndex index(commands);
+  if (mode == config::CodeSignature::Strip) {
+    return !index.codeSignature;
+  }
+
+  const auto headerEnd = (getCommandsEnd(commands) + 0x3fff) & ~0x3fffull;
+  loadRange(file, slice.offset, std::min<std::uint64_t>(headerEnd, slice.size));
+  if (index.linkedit) {
+    const auto linkeditStart = index.linkedit->fileoff & ~0x3fffull;
+    if (linkeditStart < slice.size) {
+      loadRange(file, slice.offset + linkeditStart, slice.size - linkeditStart);
+    }
+  }
+  return isAdHocSigned(file.data() + slice.offset, slice.size, commands);
+}
+
+// Replaces the signature of a patched slice by an ad-hoc one. It stays
+// the last thing in __LINKEDIT, which grows when it doesn't fit. Pages are
+// hashed concurrently, and only when the previous signature has no hash
+// for them that is still valid.
+template <typename Layout, typename File>
+void signSlice(
+    File& file, 
+    Slice& slice, 
+    const std::vector<Slice>& allSlices, 
+    const std::string& identifier)
+{
+  trace::Scope scope(trace::Phase::Sign);
+  std::optional<AdHocSigner> signer;
+  std::uint64_t codeLimit;
   {
-    auto hookDylibIndex = 
-      getDylibLoadCmdIndexByName(dylib.installName.c_str(), *machHeader);
+    const auto* machHeader = getMachHeader<Layout>(file.data() + slice.offset);
+    const LoadCommands commands(*machHeader, slice.size);
+    const LoadCommandIndex index(commands);
+    if (!index.linkedit || index.linkedit->fileoff + index.linkedit->filesize != slice.size) {
+      throw std::runtime_error("__LINKEDIT is not at the end of the image!");
+    }
+    if (const auto* command = index.codeSignature) {
+      if ((std::uint64_t)command->dataoff + command->datasize != slice.size) {
+        throw std::runtime_error("Code signature is not at the end of __LINKEDIT!");
+      }
+      codeLimit = command->dataoff;
+    } else {
+      codeLimit = (slice.size + 15) & ~std::uint64_t(15);
+    }
+    signer.emplace(file.data() + slice.offset, slice.size, commands, identifier);
+  }
 
-    if (!hookDylibIndex.has_value()) {
-      injectDylib(dylib.installName, machoPtr);
+  const auto signatureEnd = codeLimit + signer->getSize(codeLimit);
+  if (signatureEnd > slice.size) {
+    const auto delta = (signatureEnd - slice.size + 15) & ~std::uint64_t(15);
+    reserveSliceGrowth(file, slice, allSlices, delta);
+    insertLinkeditSpace<Layout>(*getMachHeader<Layout>(file.data() + slice.offset), slice.size, slice.size, delta);
+    slice.size += delta;
+    setSliceSize(file.data(), slice);
+  }
+
+  auto* image = file.data() + slice.offset;
+  auto* machHeader = getMachHeader<Layout>(image);
+  auto* command = LoadCommandIndex(LoadCommands(*machHeader, slice.size)).codeSignature;
+  if (!command) {
+    command = &addCodeSignatureCommand(*machHeader, slice.size);
+  }
+  command->dataoff = codeLimit;
+  command->datasize = slice.size - codeLimit;
+
+  const auto pageSize = signer->getPageSize();
+  std::vector<Sha256> hashes((codeLimit + pageSize - 1) / pageSize);
+  const auto pages = signer->reuseHashes(LoadCommands(*machHeader, slice.size), codeLimit, hashes);
+  for (const auto page: pages) {
+    const std::uint64_t offset = (std::uint64_t)page * pageSize;
+    loadRange(file, slice.offset + offset, std::min<std::uint64_t>(pageSize, codeLimit - offset));
+  }
+  parallelFor(pages.size(), defaultJobs(), [&](std::size_t index) {
+    const std::uint64_t offset = (std::uint64_t)pages[index] * pageSize;
+    hashes[pages[index]] = sha256(image + offset, std::min<std::uint64_t>(pageSize, codeLimit - offset));
+  });
+
+  memset(image + codeLimit, 0, slice.size - codeLimit);
+  signer->write(image + codeLimit, codeLimit, hashes);
+}
+
+template <typename File>
+bool isFilePatched(File& file, const config::Config& config)
+{
+  for (const auto& slice: selectSlices(file.data(), getSlices(file.data(), file.size()), config)) {
+    const bool patched = withLayout(file.data() + slice.offset, slice.size, [&](auto layout) {
+      using Layout = decltype(layout);
+      return isMachOPatched<Layout>(file.data() + slice.offset, slice.size, config) &&
+        (config.codeSignature == config::CodeSignature::Keep || 
+         isSignatureCurrent<Layout>(file, slice, config.codeSignature));
+    });
+    if (!patched) {
+      return false;
     }
   }
+  return true;
+}
 
-  auto lazyBindingInfos = getLazyBindingInfo(*machHeader);
+// `identifier` names the binary in new code signatures.
+template <typename File>
+void patchFileImpl(File& file, const config::Config& config, const std::string& identifier)
+{
+  const auto allSlices = getSlices(file.data(), file.size());
+  auto slices = selectSlices(file.data(), allSlices, config);
+
+  // Slices never overlap, so they can be patched in place concurrently.
+  std::vector<std::optional<LinkeditRewrite>> rewrites(slices.size());
+  parallelFor(slices.size(), slices.size(), [&](std::size_t index) {
+    auto* machoPtr = file.data() + slices[index].offset;
+    rewrites[index] = withLayout(machoPtr, slices[index].size, [&](auto layout) {
+      return patchMachOImpl<decltype(layout)>(machoPtr, slices[index].size, config);
+    });
+  });
 
-  for (const auto& hook : config.hooks) {
-    const auto* hookDylib = config.getDylibByName(hook.dylibName); 
-    if (hookDylib == nullptr) {
+  // Growing __LINKEDIT moves data and may remap the file, so that is done
+  // one slice at a time, back to front.
+  for (std::size_t index = slices.size(); index-- > 0;) {
+    if (!rewrites[index].has_value()) {
       continue;
     }
-    auto hookDylibIndex = 
-      getDylibLoadCmdIndexByName(hookDylib->installName.c_str(), *machHeader);
-    if (!hookDylibIndex.has_value()) {
-      throw std::runtime_error("Can't find dylib index!");
+    auto& slice = slices[index];
+    const auto delta = getLinkeditGrowth(*rewrites[index]);
+    if (delta) {
+      // Growing moves everything behind the bind opcodes.
+      const std::uint64_t moved = rewrites[index]->offset + rewrites[index]->size;
+      if (moved < slice.size) {
+        loadRange(file, slice.offset + moved, slice.size - moved);
+      }
+      reserveSliceGrowth(file, slice, allSlices, delta);
+    }
+
+    withLayout(file.data() + slice.offset, slice.size, [&](auto layout) {
+      using Layout = decltype(layout);
+      applyLinkeditRewrite<Layout>(
+          *getMachHeader<Layout>(file.data() + slice.offset), slice.size, *rewrites[index]);
+    });
+
+    if (delta) {
+      slice.size += delta;
+      setSliceSize(file.data(), slice);
+    }
+  }
+
+  // Signing hashes the slice as patched, so it comes last.
+  if (config.codeSignature == config::CodeSignature::AdHoc) {
+    for (std::size_t index = slices.size(); index-- > 0;) {
+      auto& slice = slices[index];
+      withLayout(file.data() + slice.offset, slice.size, [&](auto layout) {
+        signSlice<decltype(layout)>(file, slice, allSlices, identifier);
+      });
+    }
+  }
+}
+
+// Upper bound for the size of the load commands injected for `config`,
+// 64-bit commands are aligned the most.
+std::size_t getInjectionSize(const config::Config& config)
+{
+  std::size_t size = 0;
+  for (const auto& dylib: config.dylibs) {
+    size += getDylibCommandSize<MachO64>(dylib.installName);
+  }
+  if (config.codeSignature == config::CodeSignature::AdHoc) {
+    size += sizeof(struct linkedit_data_command);
+  }
+  return size;
+}
+
+// Loads everything patching reads or writes: the fat header, the header
+// and load commands of every slice (with `commandSlack` bytes behind them
+// for injected commands), the bind opcodes, chained fixups, export trie
+// and code signature in __LINKEDIT, and the padding a slice can grow into.
+// The rest of __LINKEDIT is only read when it has to move to grow it.
+void loadMachO(PartialFile& file, std::size_t commandSlack)
+{
+  trace::Scope scope(trace::Phase::Map);
+  file.load(0, sizeof(struct fat_header));
+  if (file.size() >= sizeof(struct fat_header)) {
+    const auto magic = readBigEndian32(file.data());
+    if (magic == FAT_MAGIC || magic == FAT_MAGIC_64) {
+      const std::uint64_t archCount = 
+        readBigEndian32(file.data() + offsetof(struct fat_header, nfat_arch));
+      file.load(0, sizeof(struct fat_header) + archCount * sizeof(struct fat_arch_64));
     }
+  }
 
-    for (auto& lbi: lazyBindingInfos) {
-      if (strcmp(lbi.getSymbolName(), hook.symbol.c_str()) == 0) {
-        lbi.setDylibIndex(*hookDylibIndex);            
+  const auto slices = getSlices(file.data(), file.size());
+  for (const auto& slice: slices) {
+    // The larger header covers both layouts.
+    file.load(slice.offset, sizeof(struct mach_header_64));
+    if (!getMagic(file.data() + slice.offset, slice.size)) {
+      continue;
+    }
+    withLayout(file.data() + slice.offset, slice.size, [&](auto layout) {
+      using Layout = decltype(layout);
+      const auto* machHeader = getMachHeader<Layout>(file.data() + slice.offset);
+      file.load(slice.offset, sizeof(typename Layout::Header) + machHeader->sizeofcmds + commandSlack);
+
+      const LoadCommandIndex index(LoadCommands(*machHeader, slice.size));
+      if (const auto* dyldInfoCmd = index.dyldInfo) {
+        file.load(slice.offset + dyldInfoCmd->bind_off, dyldInfoCmd->bind_size);
+        file.load(slice.offset + dyldInfoCmd->weak_bind_off, dyldInfoCmd->weak_bind_size);
+        file.load(slice.offset + dyldInfoCmd->lazy_bind_off, dyldInfoCmd->lazy_bind_size);
+        file.load(slice.offset + dyldInfoCmd->export_off, dyldInfoCmd->export_size);
       }
+      for (const auto* command: {index.chainedFixups, index.exportsTrie, index.codeSignature}) {
+        if (command) {
+          file.load(slice.offset + command->dataoff, command->datasize);
+        }
+      }
+    });
+
+    std::uint64_t growthEnd = file.size();
+    for (const auto& other: slices) {
+      if (other.offset >= slice.offset + slice.size) {
+        growthEnd = std::min(growthEnd, other.offset);
+      }
+    }
+    if (growthEnd > slice.offset + slice.size) {
+      file.load(slice.offset + slice.size, growthEnd - slice.offset - slice.size);
     }
   }
 }
 
+ImportKind getImportKind(BindStream stream)
+{
+  switch (stream) {
+    case BindStream::Bind: return ImportKind::Bind;
+    case BindStream::WeakBind: return ImportKind::WeakBind;
+    case BindStream::LazyBind: return ImportKind::LazyBind;
+  }
+  throw std::runtime_error("Unknown bind stream.");
+}
+
+template <typename Layout>
+void indexSlice(ImageIndexBuilder& builder, std::uint8_t* machoPtr, std::size_t machoSize)
+{
+  const LoadCommands commands(*getMachHeader<Layout>(machoPtr), machoSize);
+  const LoadCommandIndex index(commands);
+  for (const auto* dlc : getDylibCommands(commands)) {
+    builder.addDylib(getDylibName(*dlc));
+  }
+
+  if (const auto* dyldInfoCmd = index.dyldInfo) {
+    for (const auto& info: getBindingInfo<Layout>(machoPtr, machoSize, *dyldInfoCmd)) {
+      builder.addImport(getSymbolName(machoPtr, info), info.dylibIndex, getImportKind(info.stream));
+    }
+  }
+
+  if (const auto* chainedFixupsCmd = index.chainedFixups) {
+    forEachChainedImport(
+        machoPtr, 
+        machoSize,
+        *chainedFixupsCmd,
+        [&builder](ChainedImport& import) {
+          builder.addImport(import.getSymbolName(), import.getDylibIndex(), ImportKind::Chained);
+        });
+  }
+}
+
+template <typename File>
+ImageIndex indexFileImpl(File& file, const FileStamp& stamp)
+{
+  ImageIndexBuilder builder(stamp);
+  for (const auto& slice: getSlices(file.data(), file.size())) {
+    auto* machoPtr = file.data() + slice.offset;
+    // Slices that can't be patched aren't worth indexing either.
+    if (!getMagic(machoPtr, slice.size)) {
+      continue;
+    }
+
+    builder.addSlice(slice.cputype, slice.cpusubtype);
+    withLayout(machoPtr, slice.size, [&](auto layout) {
+      indexSlice<decltype(layout)>(builder, machoPtr, slice.size);
+    });
+  }
+
+  return builder.finish();
+}
+
 template <typename ProcessFn, typename... Args>
 void processMachO(
     const std::filesystem::path &path, 
     ProcessFn fn, 
-    Args... args)
+    Args&&... args)
 {
-  int fd;
+  MappedFile file(path);
+  fn(file, std::forward<Args>(args)...);
+  file.sync();
+}
 
-  if ((fd = open(path.c_str(), O_RDWR)) < 0) {
-    throw std::runtime_error("Could not read input file.");
+// Patches `target` in place, naming it `identifier` in new signatures.
+bool patchFile(
+    const config::Config& config, 
+    const std::filesystem::path& target,
+    const std::string& identifier,
+    IoBackend backend,
+    IoStats* stats,
+    bool journal) 
+{
+  if (backend == IoBackend::Pread || journal) {
+    PartialFile file(target, false);
+    loadMachO(file, getInjectionSize(config));
+    const bool patched = isFilePatched(file, config);
+    if (!patched) {
+      patchFileImpl(file, config, identifier);
+      if (journal) {
+        appendJournal(target, file);
+      }
+      file.sync();
+    }
+    if (stats) {
+      *stats = file.getStats();
+    }
+    return !patched;
   }
 
-  lseek(fd, 0, SEEK_SET);
-  struct stat st;
-  if (fstat(fd, &st) < 0) {
-    close(fd);
-    throw std::runtime_error("Could not get file info.");
+  // Up to date targets are neither opened for writing nor synced, so
+  // repeated runs leave them (and their mtime) alone.
+  {
+    MappedFile file(target, false);
+    if (isFilePatched(file, config)) {
+      return false;
+    }
   }
+  processMachO<>(target, patchFileImpl<MappedFile>, config, identifier);
+  return true;
+}
+
+}
 
-  void* machoPtr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-  if (machoPtr == MAP_FAILED) {
-    throw std::runtime_error("Could not map file.");
+std::string getArchName(std::int32_t cputype, std::int32_t cpusubtype)
+{
+  const auto subtype = cpusubtype & ~CPU_SUBTYPE_MASK;
+  switch (cputype) {
+    case CPU_TYPE_X86_64: 
+      return subtype == CPU_SUBTYPE_X86_64_H ? "x86_64h" : "x86_64";
+    case CPU_TYPE_ARM64: 
+      return subtype == CPU_SUBTYPE_ARM64E ? "arm64e" : "arm64";
+    case CPU_TYPE_ARM64_32: 
+      return "arm64_32";
+    case CPU_TYPE_I386: 
+      return "i386";
+    case CPU_TYPE_ARM: 
+      switch (subtype) {
+        case CPU_SUBTYPE_ARM_V7: return "armv7";
+        case CPU_SUBTYPE_ARM_V7S: return "armv7s";
+        case CPU_SUBTYPE_ARM_V7K: return "armv7k";
+        default: return "arm";
+      }
+    default:
+      return "cputype " + std::to_string(cputype);
   }
-  
-  fn(machoPtr, args...);
-  
-  if (msync(machoPtr, st.st_size, MS_SYNC) == -1) {
-    close(fd); 
-    throw std::runtime_error("Unable to sync file to disk.");
+}
+
+std::vector<std::string> getArchNames(const std::filesystem::path& target)
+{
+  MappedFile file(target, false);
+  std::vector<std::string> names;
+  for (const auto& slice: getSlices(file.data(), file.size())) {
+    names.push_back(getArchName(slice.cputype, slice.cpusubtype));
   }
+  return names;
+}
 
-  if (munmap(machoPtr, st.st_size) == -1) {
-    close(fd); 
-    throw std::runtime_error("Unable to unmap file..");
+bool isPatched(
+    const config::Config& config, 
+    const std::filesystem::path& target) 
+{
+  MappedFile file(target, false);
+  return isFilePatched(file, config);
+}
+
+bool patchMachO(
+    const config::Config& config, 
+    const std::filesystem::path& target,
+    IoBackend backend,
+    IoStats* stats,
+    bool journal) 
+{
+  return patchFile(config, target, target.filename().string(), backend, stats, journal);
+}
+
+bool isOutputStale(
+    const std::filesystem::path& target,
+    const std::filesystem::path& output)
+{
+  std::int64_t outputTime;
+  try {
+    outputTime = FileStamp::of(output).mtime;
+  } catch (const std::exception&) {
+    return true;
   }
+  return outputTime < FileStamp::of(target).mtime;
+}
 
-  close(fd);
+bool patchMachOTo(
+    const config::Config& config, 
+    const std::filesystem::path& target,
+    const std::filesystem::path& output,
+    IoBackend backend,
+    IoStats* stats)
+{
+  try {
+    if (!isOutputStale(target, output) && isPatched(config, output)) {
+      return false;
+    }
+  } catch (const std::exception&) {
+    // An output that can't be read is simply replaced.
+  }
+
+  // The patch goes to a clone next to the output, which only replaces the
+  // output once it is complete and on disk. Pages that aren't patched
+  // stay shared with the target where the filesystem supports reflinks.
+  const auto tempPath = getTempPath(output);
+  cloneFile(target, tempPath);
+  try {
+    patchFile(config, tempPath, output.filename().string(), backend, stats, false);
+    syncFile(tempPath);
+    std::filesystem::rename(tempPath, output);
+  } catch (...) {
+    std::error_code error;
+    std::filesystem::remove(tempPath, error);
+    throw;
+  }
+  syncFile(output.parent_path().empty() ? "." : output.parent_path());
+  return true;
+}
+
+ImageIndex indexMachO(const std::filesystem::path& target)
+{
+  // Stamp the file before reading it, so a concurrent change can only make
+  // the index look stale, never current.
+  const auto stamp = FileStamp::of(target);
+  MappedFile file(target, false);
+  return indexFileImpl(file, stamp);
+}
+
+DylibExports readExports(const std::filesystem::path& dylib)
+{
+  auto file = std::make_shared<MappedFile>(dylib, false);
+  std::vector<DylibExports::Slice> slices;
+  for (const auto& slice: getSlices(file->data(), file->size())) {
+    auto* machoPtr = file->data() + slice.offset;
+    if (!getMagic(machoPtr, slice.size)) {
+      continue;
+    }
+    const auto archName = getArchName(slice.cputype, slice.cpusubtype);
+    if (((const struct mach_header*)machoPtr)->filetype != MH_DYLIB) {
+      throw std::runtime_error("Not a dylib (" + archName + ").");
+    }
+
+    // Newer linkers move the trie out of LC_DYLD_INFO into its own command.
+    std::uint64_t offset = 0;
+    std::uint64_t size = 0;
+    withLayout(machoPtr, slice.size, [&](auto layout) {
+      const LoadCommandIndex index(LoadCommands(*getMachHeader<decltype(layout)>(machoPtr), slice.size));
+      if (index.exportsTrie) {
+        offset = index.exportsTrie->dataoff;
+        size = index.exportsTrie->datasize;
+      } else if (index.dyldInfo) {
+        offset = index.dyldInfo->export_off;
+        size = index.dyldInfo->export_size;
+      }
+    });
+    if (offset > slice.size || size > slice.size - offset) {
+      throw std::runtime_error("Export trie exceeds the image (" + archName + ").");
+    }
+    slices.push_back({
+        slice.cputype, slice.cpusubtype, 
+        ExportTrie(file->data() + slice.offset + offset, size)});
+  }
+
+  if (slices.empty()) {
+    throw std::runtime_error("Not a Mach-O dylib.");
+  }
+  return DylibExports(std::move(file), std::move(slices));
 }
 
+MachOImage::MachOImage(const std::filesystem::path& path, std::string name)
+  : path(path), name(name.empty() ? path.filename().string() : std::move(name))
+{
+  rollback();
 }
 
-void patchMachO(const config::Config& config) {
-  processMachO<>(config.target, patchMachOImpl, config);
+MachOImage::~MachOImage() = default;
+MachOImage::MachOImage(MachOImage&&) noexcept = default;
+MachOImage& MachOImage::operator=(MachOImage&&) noexcept = default;
+
+std::size_t MachOImage::getSliceCount() const
+{
+  return getSlices(file->data(), file->size()).size();
+}
+
+std::int32_t MachOImage::getCpuType(std::size_t slice) const
+{
+  return getSlices(file->data(), file->size()).at(slice).cputype;
+}
+
+std::int32_t MachOImage::getCpuSubtype(std::size_t slice) const
+{
+  return getSlices(file->data(), file->size()).at(slice).cpusubtype;
+}
+
+bool MachOImage::is64Bit(std::size_t slice) const
+{
+  const auto sliceInfo = getSlices(file->data(), file->size()).at(slice);
+  return getMagic(file->data() + sliceInfo.offset, sliceInfo.size) == MH_MAGIC_64;
+}
+
+template <typename Layout>
+LoadCommands<Layout> MachOImage::getLoadCommands(std::size_t slice)
+{
+  const auto sliceInfo = getSlices(file->data(), file->size()).at(slice);
+  if (getMagic(file->data() + sliceInfo.offset, sliceInfo.size) != Layout::kMagic) {
+    throw std::runtime_error(
+        "Unsupported Mach-O slice (" + getArchName(sliceInfo.cputype, sliceInfo.cpusubtype) + ").");
+  }
+  return LoadCommands(*getMachHeader<Layout>(file->data() + sliceInfo.offset), sliceInfo.size);
+}
+
+template LoadCommands<MachO64> MachOImage::getLoadCommands<MachO64>(std::size_t slice);
+template LoadCommands<MachO32> MachOImage::getLoadCommands<MachO32>(std::size_t slice);
+
+ImageIndex MachOImage::getIndex()
+{
+  return indexFileImpl(*file, stamp);
+}
+
+bool MachOImage::isPatched(const config::Config& config)
+{
+  loadMachO(*file, getInjectionSize(config));
+  return isFilePatched(*file, config);
+}
+
+bool MachOImage::apply(const config::Config& config)
+{
+  try {
+    if (isPatched(config)) {
+      return false;
+    }
+    patchFileImpl(*file, config, name);
+  } catch (...) {
+    rollback();
+    throw;
+  }
+  dirty = true;
+  return true;
+}
+
+void MachOImage::rollback()
+{
+  // The stamp is taken first, so a concurrent change can only make the
+  // index look stale.
+  stamp = FileStamp::of(path);
+  // Only commit opens the file for writing.
+  auto newFile = std::make_unique<PartialFile>(path, false);
+  loadMachO(*newFile, 0);
+  file = std::move(newFile);
+  dirty = false;
+}
+
+bool MachOImage::commit(IoStats* stats, bool journal)
+{
+  const bool changed = dirty;
+  if (dirty) {
+    if (journal) {
+      appendJournal(path, *file);
+    }
+    file->sync();
+    stamp = FileStamp::of(path);
+    dirty = false;
+  }
+  if (stats) {
+    *stats = file->getStats();
+  }
+  return changed;
+}
+
+std::vector<FileEdit> MachOImage::getEdits()
+{
+  return file->getEdits();
+}
+
+std::size_t MachOImage::getSize() const
+{
+  return file->size();
 }
 }
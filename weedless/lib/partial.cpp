@@ -0,0 +1,267 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "partial.h"
+
+// weedless
+#include "trace.h"
+
+// stl
+#include <algorithm>
+#include <stdexcept>
+
+// c
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace weedless {
+namespace {
+
+// Changes closer together than this are written with a single pwrite.
+constexpr std::size_t kMergeDistance = 64;
+
+// Calls `fn(start, end)` for every run of bytes in `current` that differs
+// from `original`, merging runs that are close together.
+template <typename Fn>
+void forEachDirtyRun(const std::uint8_t* current, const std::vector<std::uint8_t>& original, Fn&& fn)
+{
+  const auto size = original.size();
+  std::size_t index = 0;
+  while (index < size) {
+    if (current[index] == original[index]) {
+      ++index;
+      continue;
+    }
+
+    // Extend the dirty run until enough unchanged bytes follow it.
+    auto start = index;
+    auto end = index + 1;
+    for (auto clean = end; clean < size && clean - end < kMergeDistance; ++clean) {
+      if (current[clean] != original[clean]) {
+        end = clean + 1;
+      }
+    }
+    fn(start, end);
+    index = end;
+  }
+}
+
+void* reserveMemory(std::size_t size)
+{
+  // Untouched pages are never committed, so reserving a multi-GB file is cheap.
+  void* ptr = mmap(NULL, std::max<std::size_t>(size, 1), PROT_READ | PROT_WRITE, 
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (ptr == MAP_FAILED) {
+    throw std::runtime_error("Could not reserve memory for file.");
+  }
+  return ptr;
+}
+}
+
+PartialFile::PartialFile(const std::filesystem::path& path, bool writable)
+  : path(path), writable(writable)
+{
+  if ((fd = open(path.c_str(), writable ? O_RDWR : O_RDONLY)) < 0) {
+    throw std::runtime_error("Could not read input file.");
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    throw std::runtime_error("Could not get file info.");
+  }
+
+  try {
+    ptr = reserveMemory(st.st_size);
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  length = fileSize = st.st_size;
+}
+
+PartialFile::~PartialFile()
+{
+  munmap(ptr, std::max<std::size_t>(length, 1));
+  close(fd);
+}
+
+void PartialFile::load(std::uint64_t offset, std::uint64_t size)
+{
+  auto end = std::min<std::uint64_t>(offset + size, length);
+  if (offset >= end) {
+    return;
+  }
+
+  // Only read the gaps between ranges that are already loaded.
+  auto it = std::lower_bound(ranges.begin(), ranges.end(), offset, 
+      [](const Range& range, std::uint64_t offset) { return range.offset + range.size <= offset; });
+  std::vector<std::pair<std::uint64_t, std::uint64_t>> gaps;
+  for (; offset < end && it != ranges.end() && it->offset < end; ++it) {
+    if (offset < it->offset) {
+      gaps.emplace_back(offset, it->offset - offset);
+    }
+    offset = std::max(offset, it->offset + it->size);
+  }
+  if (offset < end) {
+    gaps.emplace_back(offset, end - offset);
+  }
+
+  for (const auto& [gapOffset, gapSize]: gaps) {
+    loadRange(gapOffset, gapSize);
+  }
+}
+
+void PartialFile::loadRange(std::uint64_t offset, std::uint64_t size)
+{
+  Range range{offset, size, std::vector<std::uint8_t>(size)};
+  for (std::uint64_t done = 0; done < size;) {
+    const auto count = pread(fd, range.original.data() + done, size - done, offset + done);
+    if (count <= 0) {
+      throw std::runtime_error("Unable to read file.");
+    }
+    done += count;
+  }
+  stats.bytesRead += size;
+  trace::count(trace::Counter::BytesRead, size);
+  memcpy(data() + offset, range.original.data(), size);
+
+  auto it = std::lower_bound(ranges.begin(), ranges.end(), offset, 
+      [](const Range& range, std::uint64_t offset) { return range.offset < offset; });
+  ranges.insert(it, std::move(range));
+}
+
+void PartialFile::resize(std::size_t newSize)
+{
+  if (newSize < length) {
+    throw std::runtime_error("Unable to shrink file.");
+  }
+  if (newSize == length) {
+    return;
+  }
+
+  // Only loaded ranges hold data, so they are all that needs to move.
+  void* newPtr = reserveMemory(newSize);
+  for (const auto& range: ranges) {
+    memcpy((std::uint8_t*)newPtr + range.offset, data() + range.offset, range.size);
+  }
+  munmap(ptr, std::max<std::size_t>(length, 1));
+
+  ranges.push_back(Range{length, newSize - length, {}});
+  ptr = newPtr;
+  length = newSize;
+}
+
+void PartialFile::writeBack(const Range& range)
+{
+  auto write = [this](std::uint64_t offset, std::uint64_t size) {
+    for (std::uint64_t done = 0; done < size;) {
+      const auto count = pwrite(fd, data() + offset + done, size - done, offset + done);
+      if (count < 0) {
+        throw std::runtime_error("Unable to write file.");
+      }
+      done += count;
+    }
+    stats.bytesWritten += size;
+    trace::count(trace::Counter::BytesWritten, size);
+  };
+
+  if (range.original.empty()) {
+    write(range.offset, range.size);
+    return;
+  }
+  forEachDirtyRun(data() + range.offset, range.original, [&](std::size_t start, std::size_t end) {
+    write(range.offset + start, end - start);
+  });
+}
+
+std::vector<FileEdit> PartialFile::getEdits()
+{
+  std::vector<FileEdit> edits;
+  for (const auto& range: ranges) {
+    const auto* current = data() + range.offset;
+    if (range.original.empty()) {
+      edits.push_back({range.offset, {}, {current, current + range.size}});
+      continue;
+    }
+    forEachDirtyRun(current, range.original, [&](std::size_t start, std::size_t end) {
+      edits.push_back({
+          range.offset + start,
+          {range.original.begin() + start, range.original.begin() + end},
+          {current + start, current + end}});
+    });
+  }
+  return edits;
+}
+
+void PartialFile::openForWriting()
+{
+  const int writeFd = open(path.c_str(), O_RDWR);
+  if (writeFd < 0) {
+    throw std::runtime_error("Could not open file for writing.");
+  }
+
+  // Writing to a file that replaced the one that was read would corrupt it.
+  struct stat opened;
+  struct stat reopened;
+  if (fstat(fd, &opened) < 0 || fstat(writeFd, &reopened) < 0 ||
+      opened.st_dev != reopened.st_dev || opened.st_ino != reopened.st_ino) {
+    close(writeFd);
+    throw std::runtime_error("File was replaced since it was read!");
+  }
+  close(fd);
+  fd = writeFd;
+  writable = true;
+}
+
+void PartialFile::sync()
+{
+  trace::Scope scope(trace::Phase::Sync);
+  if (!writable) {
+    openForWriting();
+  }
+  if (length != fileSize) {
+    if (ftruncate(fd, length) == -1) {
+      throw std::runtime_error("Unable to resize file.");
+    }
+    fileSize = length;
+  }
+
+  for (auto& range: ranges) {
+    writeBack(range);
+    range.original.assign(data() + range.offset, data() + range.offset + range.size);
+  }
+
+#ifdef __APPLE__
+  const int result = fsync(fd);
+#else
+  const int result = fdatasync(fd);
+#endif
+  if (result == -1) {
+    throw std::runtime_error("Unable to sync file to disk.");
+  }
+}
+}
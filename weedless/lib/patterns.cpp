@@ -0,0 +1,578 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "patterns.h"
+
+// c
+#include <cctype>
+
+// stl
+#include <algorithm>
+#include <bitset>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <tuple>
+#include <unordered_set>
+#include <utility>
+
+namespace weedless {
+namespace {
+
+using CharSet = std::bitset<256>;
+
+constexpr std::uint32_t kNone = UINT32_MAX;
+// Keeps the transition table at a few megabytes at most.
+constexpr std::size_t kMaxStates = 1 << 15;
+
+// A Thompson NFA state. Char states consume a byte of `chars`, split
+// states follow both edges without consuming anything.
+struct NfaState
+{
+  enum class Kind : std::uint8_t { Char, Split, Accept } kind;
+  CharSet chars;
+  std::uint32_t next = kNone;
+  std::uint32_t alt = kNone;
+  // The pattern an accept state belongs to.
+  std::uint32_t pattern = kNone;
+};
+
+// A partially built automaton, whose dangling edges (`state * 2` for
+// `next`, `state * 2 + 1` for `alt`) still have to be connected.
+struct Fragment
+{
+  std::uint32_t start;
+  std::vector<std::uint32_t> outs;
+};
+
+CharSet getAnyChar()
+{
+  CharSet chars;
+  chars.set();
+  // Symbol names are NUL terminated, so NUL never matches.
+  chars.reset(0);
+  return chars;
+}
+
+class NfaBuilder
+{
+public:
+  std::vector<NfaState> states;
+
+  Fragment chars(const CharSet& chars)
+  {
+    const auto state = add(NfaState::Kind::Char);
+    states[state].chars = chars;
+    return {state, {state * 2}};
+  }
+
+  Fragment literal(char c)
+  {
+    CharSet set;
+    set.set((std::uint8_t)c);
+    return chars(set);
+  }
+
+  Fragment empty()
+  {
+    const auto state = add(NfaState::Kind::Split);
+    return {state, {state * 2}};
+  }
+
+  Fragment concat(Fragment first, Fragment second)
+  {
+    patch(first.outs, second.start);
+    return {first.start, std::move(second.outs)};
+  }
+
+  Fragment alternate(Fragment first, Fragment second)
+  {
+    const auto state = add(NfaState::Kind::Split);
+    states[state].next = first.start;
+    states[state].alt = second.start;
+    first.outs.insert(first.outs.end(), second.outs.begin(), second.outs.end());
+    return {state, std::move(first.outs)};
+  }
+
+  Fragment star(Fragment fragment)
+  {
+    const auto state = add(NfaState::Kind::Split);
+    states[state].next = fragment.start;
+    patch(fragment.outs, state);
+    return {state, {state * 2 + 1}};
+  }
+
+  Fragment plus(Fragment fragment)
+  {
+    const auto state = add(NfaState::Kind::Split);
+    states[state].next = fragment.start;
+    patch(fragment.outs, state);
+    return {fragment.start, {state * 2 + 1}};
+  }
+
+  Fragment optional(Fragment fragment)
+  {
+    const auto state = add(NfaState::Kind::Split);
+    states[state].next = fragment.start;
+    fragment.outs.push_back(state * 2 + 1);
+    return {state, std::move(fragment.outs)};
+  }
+
+  // Ends the fragment in an accept state for `pattern`.
+  std::uint32_t accept(Fragment fragment, std::uint32_t pattern)
+  {
+    const auto state = add(NfaState::Kind::Accept);
+    states[state].pattern = pattern;
+    patch(fragment.outs, state);
+    return fragment.start;
+  }
+
+  std::uint32_t split(std::uint32_t next, std::uint32_t alt)
+  {
+    const auto state = add(NfaState::Kind::Split);
+    states[state].next = next;
+    states[state].alt = alt;
+    return state;
+  }
+
+private:
+  std::uint32_t add(NfaState::Kind kind)
+  {
+    states.push_back({});
+    states.back().kind = kind;
+    return states.size() - 1;
+  }
+
+  void patch(const std::vector<std::uint32_t>& outs, std::uint32_t target)
+  {
+    for (const auto out: outs) {
+      auto& state = states[out / 2];
+      (out % 2 ? state.alt : state.next) = target;
+    }
+  }
+};
+
+// Parses a glob or regex into the builder. Both share character classes
+// and escapes.
+class PatternParser
+{
+public:
+  PatternParser(NfaBuilder& builder, std::string_view text)
+    : builder(builder), text(text) {}
+
+  Fragment parseGlob()
+  {
+    auto fragment = builder.empty();
+    while (pos < text.size()) {
+      const auto c = text[pos++];
+      if (c == '*') {
+        fragment = builder.concat(fragment, builder.star(builder.chars(getAnyChar())));
+      } else if (c == '?') {
+        fragment = builder.concat(fragment, builder.chars(getAnyChar()));
+      } else if (c == '[') {
+        fragment = builder.concat(fragment, builder.chars(parseClass('!', false)));
+      } else if (c == '\\') {
+        fragment = builder.concat(fragment, builder.literal(parseEscaped()));
+      } else {
+        fragment = builder.concat(fragment, builder.literal(c));
+      }
+    }
+    return fragment;
+  }
+
+  Fragment parseRegex()
+  {
+    // Matches are always anchored, explicit anchors are allowed anyway.
+    if (!text.empty() && text.front() == '^') {
+      pos++;
+    }
+    if (text.size() > pos && text.back() == '$' && 
+        (text.size() < 2 || text[text.size() - 2] != '\\')) {
+      text.remove_suffix(1);
+    }
+    auto fragment = parseAlternation();
+    if (pos < text.size()) {
+      fail("unmatched )");
+    }
+    return fragment;
+  }
+
+private:
+  [[noreturn]] void fail(const std::string& reason) const
+  {
+    throw std::runtime_error("Invalid pattern \"" + std::string(text) + "\": " + reason);
+  }
+
+  Fragment parseAlternation()
+  {
+    auto fragment = parseSequence();
+    while (pos < text.size() && text[pos] == '|') {
+      pos++;
+      fragment = builder.alternate(fragment, parseSequence());
+    }
+    return fragment;
+  }
+
+  Fragment parseSequence()
+  {
+    auto fragment = builder.empty();
+    while (pos < text.size() && text[pos] != '|' && text[pos] != ')') {
+      fragment = builder.concat(fragment, parseRepeat());
+    }
+    return fragment;
+  }
+
+  Fragment parseRepeat()
+  {
+    auto fragment = parseAtom();
+    while (pos < text.size()) {
+      if (text[pos] == '*') {
+        fragment = builder.star(fragment);
+      } else if (text[pos] == '+') {
+        fragment = builder.plus(fragment);
+      } else if (text[pos] == '?') {
+        fragment = builder.optional(fragment);
+      } else {
+        break;
+      }
+      pos++;
+    }
+    return fragment;
+  }
+
+  Fragment parseAtom()
+  {
+    const auto c = text[pos++];
+    switch (c) {
+      case '(': {
+        auto fragment = parseAlternation();
+        if (pos == text.size() || text[pos] != ')') {
+          fail("unmatched (");
+        }
+        pos++;
+        return fragment;
+      }
+      case '[':
+        return builder.chars(parseClass('^', true));
+      case '.':
+        return builder.chars(getAnyChar());
+      case '\\': {
+        if (pos < text.size()) {
+          if (const auto chars = getClassEscape(text[pos]); chars.any()) {
+            pos++;
+            return builder.chars(chars);
+          }
+        }
+        return builder.literal(parseEscaped());
+      }
+      case '*':
+      case '+':
+      case '?':
+        fail(std::string("nothing to repeat before ") + c);
+      case '{':
+      case '}':
+        fail("counted repetition is not supported");
+      case '^':
+      case '$':
+        fail("anchors are only supported at the ends");
+      default:
+        return builder.literal(c);
+    }
+  }
+
+  static CharSet getClassEscape(char c)
+  {
+    CharSet chars;
+    if (c == 'd' || c == 'w') {
+      for (char digit = '0'; digit <= '9'; digit++) {
+        chars.set(digit);
+      }
+    }
+    if (c == 'w') {
+      for (char letter = 'a'; letter <= 'z'; letter++) {
+        chars.set(letter);
+        chars.set(letter - 'a' + 'A');
+      }
+      chars.set('_');
+    }
+    return chars;
+  }
+
+  char parseEscaped()
+  {
+    if (pos == text.size()) {
+      fail("trailing \\");
+    }
+    return text[pos++];
+  }
+
+  // Parses the rest of a `[...]` class. `negation` negates the class when
+  // it comes first, `classEscapes` adds the members of `\d` and `\w`.
+  CharSet parseClass(char negation, bool classEscapes)
+  {
+    CharSet chars;
+    const bool negated = pos < text.size() && text[pos] == negation;
+    if (negated) {
+      pos++;
+    }
+    for (bool first = true;; first = false) {
+      if (pos == text.size()) {
+        fail("unmatched [");
+      }
+      auto low = text[pos++];
+      // A leading ] is a member, not the end of the class.
+      if (low == ']' && !first) {
+        break;
+      }
+      if (low == '\\' && classEscapes && pos < text.size()) {
+        if (const auto escaped = getClassEscape(text[pos]); escaped.any()) {
+          pos++;
+          // They can't start a range, like in other regex engines.
+          if (pos + 1 < text.size() && text[pos] == '-' && text[pos + 1] != ']') {
+            fail("invalid range");
+          }
+          chars |= escaped;
+          continue;
+        }
+      }
+      if (low == '\\') {
+        low = parseEscaped();
+      }
+      auto high = low;
+      if (pos + 1 < text.size() && text[pos] == '-' && text[pos + 1] != ']') {
+        pos++;
+        high = text[pos++];
+        if (high == '\\' && classEscapes && pos < text.size() && getClassEscape(text[pos]).any()) {
+          fail("invalid range");
+        }
+        if (high == '\\') {
+          high = parseEscaped();
+        }
+        if ((std::uint8_t)high < (std::uint8_t)low) {
+          fail("invalid range");
+        }
+      }
+      for (unsigned c = (std::uint8_t)low; c <= (std::uint8_t)high; c++) {
+        chars.set(c);
+      }
+    }
+    if (negated) {
+      chars.flip();
+    }
+    chars.reset(0);
+    return chars;
+  }
+
+  NfaBuilder& builder;
+  std::string_view text;
+  std::size_t pos = 0;
+};
+
+Fragment parsePattern(NfaBuilder& builder, const Pattern& pattern)
+{
+  PatternParser parser(builder, pattern.text);
+  switch (pattern.kind) {
+    case PatternKind::Exact:
+    case PatternKind::Prefix: {
+      auto fragment = builder.empty();
+      for (const auto c: pattern.text) {
+        fragment = builder.concat(fragment, builder.literal(c));
+      }
+      if (pattern.kind == PatternKind::Prefix) {
+        fragment = builder.concat(fragment, builder.star(builder.chars(getAnyChar())));
+      }
+      return fragment;
+    }
+    case PatternKind::Glob:
+      return parser.parseGlob();
+    case PatternKind::Regex:
+      return parser.parseRegex();
+  }
+  throw std::runtime_error("Unknown pattern kind.");
+}
+
+}
+
+SymbolMatcher SymbolMatcher::compile(
+    const std::vector<Pattern>& patterns, 
+    std::vector<PatternConflict>* conflicts)
+{
+  SymbolMatcher matcher;
+  if (patterns.empty()) {
+    return matcher;
+  }
+
+  NfaBuilder builder;
+  auto start = kNone;
+  for (std::uint32_t index = patterns.size(); index-- > 0;) {
+    const auto pattern = builder.accept(parsePattern(builder, patterns[index]), index);
+    start = start == kNone ? pattern : builder.split(pattern, start);
+  }
+  const auto& nfa = builder.states;
+
+  // Split the bytes into classes that every character set either fully
+  // contains or excludes. NUL keeps a class of its own that leads nowhere.
+  std::unordered_set<CharSet> charSets;
+  for (const auto& state: nfa) {
+    if (state.kind == NfaState::Kind::Char) {
+      charSets.insert(state.chars);
+    }
+  }
+  for (unsigned c = 1; c < 256; c++) {
+    matcher.classes[c] = 1;
+  }
+  std::uint32_t classCount = 2;
+  for (const auto& chars: charSets) {
+    // New class by old class and membership, 0 while unassigned.
+    std::uint8_t refined[256][2] = {};
+    classCount = 1;
+    for (unsigned c = 1; c < 256; c++) {
+      auto& cls = refined[matcher.classes[c]][chars[c]];
+      if (cls == 0) {
+        cls = classCount++;
+      }
+      matcher.classes[c] = cls;
+    }
+  }
+  matcher.classCount = classCount;
+
+  // The smallest byte of every class stands in for the class when
+  // computing transitions and examples, preferring characters that are
+  // common in symbol names.
+  auto getRank = [](unsigned c) {
+    if (isalnum(c) || c == '_') {
+      return 2;
+    }
+    return isgraph(c) ? 1 : 0;
+  };
+  std::vector<std::uint8_t> representatives(classCount, 0);
+  for (unsigned c = 1; c < 256; c++) {
+    auto& representative = representatives[matcher.classes[c]];
+    if (representative == 0 || getRank(c) > getRank(representative)) {
+      representative = c;
+    }
+  }
+
+  // Subset construction. DFA states are the sets of char and accept
+  // states reachable without consuming anything.
+  std::vector<std::uint32_t> marks(nfa.size(), kNone);
+  std::uint32_t generation = 0;
+  auto closure = [&](const std::vector<std::uint32_t>& roots) {
+    generation++;
+    std::vector<std::uint32_t> set;
+    std::vector<std::uint32_t> stack(roots.rbegin(), roots.rend());
+    while (!stack.empty()) {
+      const auto state = stack.back();
+      stack.pop_back();
+      if (state == kNone || marks[state] == generation) {
+        continue;
+      }
+      marks[state] = generation;
+      if (nfa[state].kind == NfaState::Kind::Split) {
+        stack.push_back(nfa[state].alt);
+        stack.push_back(nfa[state].next);
+      } else {
+        set.push_back(state);
+      }
+    }
+    std::sort(set.begin(), set.end());
+    return set;
+  };
+
+  struct DfaState
+  {
+    std::vector<std::uint32_t> nfaStates;
+    // How the state was first reached, to build examples.
+    std::uint32_t parent;
+    std::uint8_t byte;
+  };
+  std::vector<DfaState> dfa;
+  std::map<std::vector<std::uint32_t>, std::uint32_t> ids;
+  auto getState = [&](std::vector<std::uint32_t> set, std::uint32_t parent, std::uint8_t byte) {
+    const auto it = ids.find(set);
+    if (it != ids.end()) {
+      return it->second;
+    }
+    if (dfa.size() == kMaxStates) {
+      throw std::runtime_error("Hook patterns are too complex to compile.");
+    }
+    const std::uint32_t id = dfa.size();
+    ids.emplace(set, id);
+    dfa.push_back({std::move(set), parent, byte});
+    return id;
+  };
+  getState({}, kDead, 0);
+  getState(closure({start}), kDead, 0);
+
+  std::set<std::pair<std::uint32_t, std::uint32_t>> reported;
+  // States are numbered in breadth-first order, so the first example
+  // found for a conflict is one of the shortest.
+  for (std::uint32_t id = 0; id < dfa.size(); id++) {
+    std::uint32_t winner = npos;
+    for (const auto state: dfa[id].nfaStates) {
+      if (nfa[state].kind == NfaState::Kind::Accept) {
+        winner = winner == npos ? nfa[state].pattern : std::max(winner, nfa[state].pattern);
+      }
+    }
+    matcher.matches.push_back(winner);
+
+    if (conflicts && winner != npos) {
+      for (const auto state: dfa[id].nfaStates) {
+        const auto pattern = nfa[state].pattern;
+        if (nfa[state].kind != NfaState::Kind::Accept || 
+            patterns[pattern].group == patterns[winner].group || 
+            !reported.emplace(pattern, winner).second) {
+          continue;
+        }
+        std::string example;
+        for (auto current = id; current != kStart; current = dfa[current].parent) {
+          example += (char)dfa[current].byte;
+        }
+        std::reverse(example.begin(), example.end());
+        conflicts->push_back({pattern, winner, std::move(example)});
+      }
+    }
+
+    for (std::uint32_t cls = 0; cls < classCount; cls++) {
+      std::vector<std::uint32_t> next;
+      if (cls != 0) {
+        for (const auto state: dfa[id].nfaStates) {
+          if (nfa[state].kind == NfaState::Kind::Char && nfa[state].chars[representatives[cls]]) {
+            next.push_back(nfa[state].next);
+          }
+        }
+      }
+      const auto target = next.empty() ? kDead : getState(closure(next), id, representatives[cls]);
+      matcher.transitions.push_back(target);
+    }
+  }
+
+  // Conflicts come out by example length, sort them for a stable report.
+  if (conflicts) {
+    std::stable_sort(conflicts->begin(), conflicts->end(), [](const auto& a, const auto& b) {
+      return std::tie(a.second, a.first) < std::tie(b.second, b.first);
+    });
+  }
+  return matcher;
+}
+}
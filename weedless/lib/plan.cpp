@@ -0,0 +1,355 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "plan.h"
+
+// stl
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+// c
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// weedless
+#include "copy.h"
+#include "journal.h"
+#include "macho.h"
+#include "trace.h"
+
+namespace weedless {
+namespace {
+
+constexpr char kMagic[8] = {'W', 'D', 'L', 'S', 'P', 'L', 'A', 'N'};
+constexpr std::uint32_t kVersion = 1;
+
+// A plan is this header followed by its edits, each an EditHeader and the
+// bytes it writes.
+struct PlanHeader
+{
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t editCount;
+  std::uint64_t inputSize;
+  std::uint64_t inputHash;
+  std::uint64_t outputSize;
+  std::uint64_t outputHash;
+  std::uint64_t payloadSize;
+  // XXH64 of the payload.
+  std::uint64_t checksum;
+};
+
+struct EditHeader
+{
+  std::uint64_t offset;
+  std::uint64_t size;
+};
+
+template <typename T>
+void appendRaw(std::vector<std::uint8_t>& out, const T& value)
+{
+  const auto* bytes = (const std::uint8_t*)&value;
+  out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+// Digests `target` as it is and as it is once `edits` are applied, with a
+// single read.
+void digestEdited(
+    const std::filesystem::path& target,
+    const std::vector<FileEdit>& edits,
+    FileDigest& input,
+    FileDigest& output)
+{
+  int fd = open(target.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Could not read " + target.string());
+  }
+
+  Hasher inputHasher;
+  Hasher outputHasher;
+  std::uint64_t offset = 0;
+  auto edit = edits.begin();
+  std::uint8_t buffer[64 * 1024];
+  for (;;) {
+    const auto count = read(fd, buffer, sizeof(buffer));
+    if (count < 0) {
+      close(fd);
+      throw std::runtime_error("Could not read " + target.string());
+    }
+    if (count == 0) {
+      break;
+    }
+    inputHasher.update(buffer, count);
+
+    const auto end = offset + count;
+    for (; edit != edits.end() && edit->offset < end; ++edit) {
+      const auto editEnd = edit->offset + edit->after.size();
+      const auto from = std::max(edit->offset, offset);
+      const auto to = std::min(editEnd, end);
+      memcpy(buffer + (from - offset), edit->after.data() + (from - edit->offset), to - from);
+      if (editEnd > end) {
+        break;
+      }
+    }
+    outputHasher.update(buffer, count);
+    offset = end;
+  }
+  close(fd);
+  trace::count(trace::Counter::BytesRead, offset);
+
+  // Everything past the end of the file is written by the edits.
+  input = {offset, inputHasher.digest()};
+  for (; edit != edits.end(); ++edit) {
+    const auto skip = offset > edit->offset ? offset - edit->offset : 0;
+    if (edit->offset + skip != offset) {
+      throw std::runtime_error("Edits leave a gap at the end of " + target.string());
+    }
+    outputHasher.update(edit->after.data() + skip, edit->after.size() - skip);
+    offset += edit->after.size() - skip;
+  }
+  output = {offset, outputHasher.digest()};
+}
+// Writes the edits of `plan` straight to `path`, with a pwrite each.
+void writeEdits(const std::filesystem::path& path, const PatchPlan& plan, IoStats* stats)
+{
+  int fd = open(path.c_str(), O_WRONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Could not write " + path.string());
+  }
+  const auto fail = [fd](const char* message) -> void {
+    close(fd);
+    throw std::runtime_error(message);
+  };
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (std::uint64_t)st.st_size != plan.input.size) {
+    fail("Target changed while applying the plan!");
+  }
+  if (plan.output.size != plan.input.size && ftruncate(fd, plan.output.size) == -1) {
+    fail("Unable to resize file.");
+  }
+
+  IoStats written;
+  for (const auto& edit: plan.edits) {
+    for (std::uint64_t done = 0; done < edit.after.size();) {
+      const auto count = pwrite(fd, edit.after.data() + done, edit.after.size() - done, edit.offset + done);
+      if (count < 0) {
+        fail("Unable to write file.");
+      }
+      done += count;
+    }
+    written.bytesWritten += edit.after.size();
+  }
+  trace::count(trace::Counter::BytesWritten, written.bytesWritten);
+
+#ifdef __APPLE__
+  const int result = fsync(fd);
+#else
+  const int result = fdatasync(fd);
+#endif
+  if (result == -1) {
+    fail("Unable to sync file to disk.");
+  }
+  close(fd);
+  if (stats) {
+    *stats = written;
+  }
+}
+
+// Writes the edits of `plan` to `path`, recording them in the undo journal
+// of `target` first. The journal needs the bytes the edits replace, so
+// only those are read.
+void writeJournaledEdits(
+    const std::filesystem::path& path,
+    const std::filesystem::path& target,
+    const PatchPlan& plan,
+    IoStats* stats)
+{
+  PartialFile file(path);
+  if (file.size() != plan.input.size) {
+    throw std::runtime_error("Target changed while applying the plan!");
+  }
+  for (const auto& edit: plan.edits) {
+    file.load(edit.offset, edit.after.size());
+  }
+  file.resize(plan.output.size);
+  for (const auto& edit: plan.edits) {
+    std::copy(edit.after.begin(), edit.after.end(), file.data() + edit.offset);
+  }
+  appendJournal(target, file);
+  file.sync();
+  if (stats) {
+    *stats = file.getStats();
+  }
+}
+}
+
+PatchPlan makePlan(
+    const std::vector<const config::Config*>& configs,
+    const std::filesystem::path& target)
+{
+  MachOImage image(target);
+  for (const auto* config: configs) {
+    image.apply(*config);
+  }
+
+  PatchPlan plan;
+  plan.edits = image.getEdits();
+  for (auto& edit: plan.edits) {
+    edit.before.clear();
+  }
+  digestEdited(target, plan.edits, plan.input, plan.output);
+  if (plan.output.size != image.getSize()) {
+    throw std::runtime_error("Target changed while planning!");
+  }
+  return plan;
+}
+
+void writePlan(const std::filesystem::path& path, const PatchPlan& plan)
+{
+  std::vector<std::uint8_t> payload;
+  for (const auto& edit: plan.edits) {
+    appendRaw(payload, EditHeader{edit.offset, edit.after.size()});
+    payload.insert(payload.end(), edit.after.begin(), edit.after.end());
+  }
+
+  PlanHeader header{};
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.editCount = (std::uint32_t)plan.edits.size();
+  header.inputSize = plan.input.size;
+  header.inputHash = plan.input.hash;
+  header.outputSize = plan.output.size;
+  header.outputHash = plan.output.hash;
+  header.payloadSize = payload.size();
+  header.checksum = hashBytes(payload.data(), payload.size());
+
+  // Plans are build artifacts, so they are replaced atomically and durably.
+  const auto tempPath = getTempPath(path);
+  try {
+    {
+      std::ofstream stream(tempPath, std::ios::binary | std::ios::trunc);
+      stream.write((const char*)&header, sizeof(header));
+      stream.write((const char*)payload.data(), payload.size());
+      if (!stream) {
+        throw std::runtime_error("Unable to write " + tempPath.string());
+      }
+    }
+    syncFile(tempPath);
+    std::filesystem::rename(tempPath, path);
+  } catch (...) {
+    std::error_code error;
+    std::filesystem::remove(tempPath, error);
+    throw;
+  }
+  syncFile(path.parent_path().empty() ? "." : path.parent_path());
+}
+
+PatchPlan readPlan(const std::filesystem::path& path)
+{
+  std::ifstream stream(path, std::ios::binary);
+  if (!stream) {
+    throw std::runtime_error("Unable to read " + path.string());
+  }
+  // Plans hold whole rewritten __LINKEDITs, so they are read in one go.
+  std::vector<std::uint8_t> bytes(std::filesystem::file_size(path));
+  if (!stream.read((char*)bytes.data(), bytes.size())) {
+    throw std::runtime_error("Unable to read " + path.string());
+  }
+
+  const auto fail = [&path]() -> void { throw std::runtime_error("Corrupt patch plan " + path.string()); };
+  PlanHeader header;
+  if (bytes.size() < sizeof(header)) {
+    fail();
+  }
+  memcpy(&header, bytes.data(), sizeof(header));
+  const auto* p = bytes.data() + sizeof(header);
+  const auto* end = bytes.data() + bytes.size();
+  if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion ||
+      header.payloadSize != (std::size_t)(end - p) || hashBytes(p, header.payloadSize) != header.checksum ||
+      header.outputSize < header.inputSize) {
+    fail();
+  }
+
+  PatchPlan plan{{header.inputSize, header.inputHash}, {header.outputSize, header.outputHash}, {}};
+  std::uint64_t editsEnd = 0;
+  for (std::uint32_t index = 0; index < header.editCount; index++) {
+    EditHeader editHeader;
+    if ((std::size_t)(end - p) < sizeof(editHeader)) {
+      fail();
+    }
+    memcpy(&editHeader, p, sizeof(editHeader));
+    p += sizeof(editHeader);
+    if ((std::size_t)(end - p) < editHeader.size || editHeader.offset < editsEnd || 
+        editHeader.offset > header.outputSize || editHeader.size > header.outputSize - editHeader.offset) {
+      fail();
+    }
+    plan.edits.push_back({editHeader.offset, {}, {p, p + editHeader.size}});
+    p += editHeader.size;
+    editsEnd = editHeader.offset + editHeader.size;
+  }
+  if (p != end) {
+    fail();
+  }
+  return plan;
+}
+
+bool applyPlan(
+    const PatchPlan& plan,
+    const std::filesystem::path& target,
+    IoStats* stats,
+    bool journal)
+{
+  trace::Scope scope(trace::Phase::Apply, target.string());
+  const auto digest = digestFile(target);
+  if (digest == plan.output) {
+    return false;
+  }
+  if (digest != plan.input) {
+    throw std::runtime_error("Target doesn't match the plan!");
+  }
+
+  // The edits go to a clone of the target, which only replaces it once it
+  // is complete and on disk, so a crash never leaves it half-patched.
+  const auto tempPath = getTempPath(target);
+  cloneFile(target, tempPath);
+  try {
+    if (journal) {
+      writeJournaledEdits(tempPath, target, plan, stats);
+    } else {
+      writeEdits(tempPath, plan, stats);
+    }
+    std::filesystem::rename(tempPath, target);
+  } catch (...) {
+    std::error_code error;
+    std::filesystem::remove(tempPath, error);
+    throw;
+  }
+  syncFile(target.parent_path().empty() ? "." : target.parent_path());
+  return true;
+}
+}
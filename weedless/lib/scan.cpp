@@ -0,0 +1,197 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "scan.h"
+
+// stl
+#include <atomic>
+
+// c
+#if defined(WEEDLESS_SCAN_SSE2) && (defined(__x86_64__) || defined(__i386__))
+#define WEEDLESS_SCAN_AVX2 1
+#include <immintrin.h>
+#endif
+
+namespace weedless::scan {
+namespace {
+
+using FindNul = const std::uint8_t* (*)(const std::uint8_t*, const std::uint8_t*);
+using CountNuls = std::size_t (*)(const std::uint8_t*, const std::uint8_t*);
+
+std::size_t countNulsScalar(const std::uint8_t* p, const std::uint8_t* end)
+{
+  std::size_t count = 0;
+  for (; p < end; p++) {
+    count += *p == 0;
+  }
+  return count;
+}
+
+#if defined(WEEDLESS_SCAN_SSE2)
+
+const std::uint8_t* findNulSse2(const std::uint8_t* p, const std::uint8_t* end)
+{
+  const auto zero = _mm_setzero_si128();
+  while (end - p >= 16) {
+    const auto bytes = _mm_loadu_si128((const __m128i*)p);
+    const unsigned nuls = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, zero));
+    if (nuls) {
+      return p + __builtin_ctz(nuls);
+    }
+    p += 16;
+  }
+  return ScalarScanner::findNul(p, end);
+}
+
+std::size_t countNulsSse2(const std::uint8_t* p, const std::uint8_t* end)
+{
+  const auto zero = _mm_setzero_si128();
+  std::size_t count = 0;
+  for (; end - p >= 16; p += 16) {
+    const auto bytes = _mm_loadu_si128((const __m128i*)p);
+    count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, zero)));
+  }
+  return count + countNulsScalar(p, end);
+}
+
+#if defined(WEEDLESS_SCAN_AVX2)
+
+__attribute__((target("avx2")))
+const std::uint8_t* findNulAvx2(const std::uint8_t* p, const std::uint8_t* end)
+{
+  const auto zero = _mm256_setzero_si256();
+  while (end - p >= 32) {
+    const auto bytes = _mm256_loadu_si256((const __m256i*)p);
+    const unsigned nuls = _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, zero));
+    if (nuls) {
+      return p + __builtin_ctz(nuls);
+    }
+    p += 32;
+  }
+  return findNulSse2(p, end);
+}
+
+__attribute__((target("avx2,popcnt")))
+std::size_t countNulsAvx2(const std::uint8_t* p, const std::uint8_t* end)
+{
+  const auto zero = _mm256_setzero_si256();
+  std::size_t count = 0;
+  for (; end - p >= 32; p += 32) {
+    const auto bytes = _mm256_loadu_si256((const __m256i*)p);
+    count += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, zero)));
+  }
+  return count + countNulsSse2(p, end);
+}
+
+#endif
+
+#endif
+
+Level detectLevel()
+{
+#if defined(WEEDLESS_SCAN_AVX2)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return Level::Avx2;
+  }
+#endif
+#if defined(WEEDLESS_SCAN_SSE2)
+  return Level::Sse2;
+#else
+  return Level::Scalar;
+#endif
+}
+
+FindNul getFindNul(Level level)
+{
+  switch (level) {
+#if defined(WEEDLESS_SCAN_AVX2)
+    case Level::Avx2: return findNulAvx2;
+#endif
+#if defined(WEEDLESS_SCAN_SSE2)
+    case Level::Sse2: return findNulSse2;
+#endif
+    default: return ScalarScanner::findNul;
+  }
+}
+
+CountNuls getCountNuls(Level level)
+{
+  switch (level) {
+#if defined(WEEDLESS_SCAN_AVX2)
+    case Level::Avx2: return countNulsAvx2;
+#endif
+#if defined(WEEDLESS_SCAN_SSE2)
+    case Level::Sse2: return countNulsSse2;
+#endif
+    default: return countNulsScalar;
+  }
+}
+
+const Level supportedLevel = detectLevel();
+std::atomic<Level> currentLevel{supportedLevel};
+std::atomic<FindNul> currentFindNul{getFindNul(supportedLevel)};
+std::atomic<CountNuls> currentCountNuls{getCountNuls(supportedLevel)};
+
+}
+
+Level getSupportedLevel()
+{
+  return supportedLevel;
+}
+
+Level getLevel()
+{
+  return currentLevel.load(std::memory_order_relaxed);
+}
+
+void setLevel(Level level)
+{
+  if (level > supportedLevel) {
+    level = supportedLevel;
+  }
+  currentLevel.store(level, std::memory_order_relaxed);
+  currentFindNul.store(getFindNul(level), std::memory_order_relaxed);
+  currentCountNuls.store(getCountNuls(level), std::memory_order_relaxed);
+}
+
+const char* getLevelName(Level level)
+{
+  switch (level) {
+    case Level::Scalar: return "scalar";
+    case Level::Sse2: return "sse2";
+    case Level::Avx2: return "avx2";
+  }
+  return "unknown";
+}
+
+const std::uint8_t* findNulLong(const std::uint8_t* p, const std::uint8_t* end)
+{
+  return currentFindNul.load(std::memory_order_relaxed)(p, end);
+}
+
+std::size_t countNuls(const std::uint8_t* p, const std::uint8_t* end)
+{
+  return currentCountNuls.load(std::memory_order_relaxed)(p, end);
+}
+}
@@ -0,0 +1,248 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "server.h"
+#include "nlohmann/json.hpp"
+
+// stl
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+// c
+#include <cerrno>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace weedless {
+namespace {
+
+// Messages are a 32-bit little endian length followed by that much JSON.
+constexpr std::uint32_t kMaxMessageSize = 64 * 1024 * 1024;
+
+class Socket
+{
+public:
+  explicit Socket(int fd) : fd(fd) {}
+  ~Socket() { if (fd >= 0) close(fd); }
+
+  Socket(const Socket&) = delete;
+  Socket& operator=(const Socket&) = delete;
+
+  int get() const { return fd; }
+
+private:
+  int fd;
+};
+
+struct sockaddr_un getAddress(const std::filesystem::path& socketPath)
+{
+  struct sockaddr_un address {};
+  address.sun_family = AF_UNIX;
+  if (socketPath.native().size() >= sizeof(address.sun_path)) {
+    throw std::runtime_error("Socket path is too long: " + socketPath.string());
+  }
+  strcpy(address.sun_path, socketPath.c_str());
+  return address;
+}
+
+void writeAll(int fd, const void* data, std::size_t size)
+{
+  const auto* bytes = (const std::uint8_t*)data;
+  while (size > 0) {
+    const auto count = write(fd, bytes, size);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error("Unable to write to socket.");
+    }
+    bytes += count;
+    size -= count;
+  }
+}
+
+void readAll(int fd, void* data, std::size_t size)
+{
+  auto* bytes = (std::uint8_t*)data;
+  while (size > 0) {
+    const auto count = read(fd, bytes, size);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count <= 0) {
+      throw std::runtime_error("Unable to read from socket.");
+    }
+    bytes += count;
+    size -= count;
+  }
+}
+
+void sendMessage(int fd, const nlohmann::json& message)
+{
+  const auto text = message.dump();
+  if (text.size() > kMaxMessageSize) {
+    throw std::runtime_error("Message is too large.");
+  }
+  std::uint8_t header[4];
+  for (int i = 0; i < 4; i++) {
+    header[i] = (std::uint8_t)(text.size() >> (i * 8));
+  }
+  writeAll(fd, header, sizeof(header));
+  writeAll(fd, text.data(), text.size());
+}
+
+nlohmann::json receiveMessage(int fd)
+{
+  std::uint8_t header[4];
+  readAll(fd, header, sizeof(header));
+  std::uint32_t size = 0;
+  for (int i = 0; i < 4; i++) {
+    size |= (std::uint32_t)header[i] << (i * 8);
+  }
+  if (size > kMaxMessageSize) {
+    throw std::runtime_error("Message is too large.");
+  }
+  std::string text(size, '\0');
+  readAll(fd, text.data(), size);
+  return nlohmann::json::parse(text);
+}
+
+// The socket to remove when the server is stopped.
+char boundSocketPath[sizeof(sockaddr_un::sun_path)];
+
+void stopServer(int)
+{
+  unlink(boundSocketPath);
+  _exit(0);
+}
+
+// Returns -1 when no server is listening at `socketPath`.
+int connectTo(const std::filesystem::path& socketPath)
+{
+  const auto address = getAddress(socketPath);
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    throw std::runtime_error("Unable to create socket.");
+  }
+  if (connect(fd, (const struct sockaddr*)&address, sizeof(address)) < 0) {
+    const int error = errno;
+    close(fd);
+    if (error == ENOENT || error == ECONNREFUSED) {
+      return -1;
+    }
+    throw std::runtime_error("Unable to connect to " + socketPath.string() + ": " + strerror(error));
+  }
+  return fd;
+}
+
+void handleConnection(int fd, const RequestHandler& handler)
+{
+  Socket connection(fd);
+  ServerResponse response;
+  try {
+    const auto message = receiveMessage(fd);
+    ServerRequest request;
+    request.workingDirectory = message.at("cwd").get<std::string>();
+    request.args = message.at("args").get<std::vector<std::string>>();
+    response = handler(request);
+  } catch (const std::exception& e) {
+    response = {1, "", std::string("FAIL ") + e.what() + "\n"};
+  }
+
+  try {
+    sendMessage(fd, {{"exit", response.exitCode}, {"out", response.out}, {"err", response.err}});
+  } catch (const std::exception&) {
+    // The client is gone, there is nobody left to tell.
+  }
+}
+
+}
+
+void serve(const std::filesystem::path& socketPath, const RequestHandler& handler)
+{
+  // Writing to a client that went away must not kill the server.
+  signal(SIGPIPE, SIG_IGN);
+
+  const auto address = getAddress(socketPath);
+  Socket listener(socket(AF_UNIX, SOCK_STREAM, 0));
+  if (listener.get() < 0) {
+    throw std::runtime_error("Unable to create socket.");
+  }
+
+  // Only replace the socket when nobody is listening on it anymore.
+  if (const int fd = connectTo(socketPath); fd >= 0) {
+    close(fd);
+    throw std::runtime_error("A server is already listening on " + socketPath.string());
+  }
+  unlink(socketPath.c_str());
+
+  // The socket grants everything weedless can do, so only the user may
+  // connect.
+  const auto mask = umask(0177);
+  const int bound = bind(listener.get(), (const struct sockaddr*)&address, sizeof(address));
+  const int error = errno;
+  umask(mask);
+  if (bound < 0) {
+    throw std::runtime_error("Unable to bind " + socketPath.string() + ": " + strerror(error));
+  }
+  strcpy(boundSocketPath, address.sun_path);
+  signal(SIGINT, stopServer);
+  signal(SIGTERM, stopServer);
+
+  if (listen(listener.get(), SOMAXCONN) < 0) {
+    throw std::runtime_error("Unable to listen on " + socketPath.string());
+  }
+
+  for (;;) {
+    const int fd = accept(listener.get(), nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      throw std::runtime_error("Unable to accept connections.");
+    }
+    std::thread(handleConnection, fd, std::cref(handler)).detach();
+  }
+}
+
+std::optional<ServerResponse> sendRequest(
+    const std::filesystem::path& socketPath, 
+    const ServerRequest& request)
+{
+  Socket connection(connectTo(socketPath));
+  if (connection.get() < 0) {
+    return std::nullopt;
+  }
+
+  sendMessage(connection.get(), {{"cwd", request.workingDirectory.string()}, {"args", request.args}});
+  const auto message = receiveMessage(connection.get());
+  return ServerResponse{
+    message.at("exit").get<int>(), 
+    message.at("out").get<std::string>(), 
+    message.at("err").get<std::string>()};
+}
+}
@@ -0,0 +1,242 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "trace.h"
+#include "nlohmann/json.hpp"
+
+// stl
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+// c
+#include <unistd.h>
+
+namespace weedless::trace {
+namespace {
+
+struct Event
+{
+  // Nanoseconds since tracing was enabled.
+  std::uint64_t start;
+  std::uint64_t duration;
+  std::string detail;
+  Phase phase;
+};
+
+// Every thread appends to its own log, so recording takes no lock.
+struct ThreadLog
+{
+  std::uint32_t id;
+  std::vector<Event> events;
+};
+
+std::chrono::steady_clock::time_point origin;
+std::atomic<std::uint64_t> counters[(std::size_t)Counter::Count];
+
+std::mutex logMutex;
+// Logs outlive their threads, they are only read once all work is done.
+std::vector<std::unique_ptr<ThreadLog>> logs;
+thread_local ThreadLog* threadLog = nullptr;
+
+ThreadLog& getThreadLog()
+{
+  if (!threadLog) {
+    std::lock_guard<std::mutex> lock(logMutex);
+    logs.push_back(std::make_unique<ThreadLog>());
+    logs.back()->id = logs.size();
+    threadLog = logs.back().get();
+  }
+  return *threadLog;
+}
+
+std::uint64_t now()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - origin).count();
+}
+
+double toMicroseconds(std::uint64_t nanoseconds)
+{
+  return nanoseconds / 1e3;
+}
+
+double toMilliseconds(std::uint64_t nanoseconds)
+{
+  return nanoseconds / 1e6;
+}
+
+void writeJson(const std::filesystem::path& path, const nlohmann::ordered_json& json)
+{
+  std::ofstream out(path);
+  out << json.dump(1) << std::endl;
+  if (!out) {
+    throw std::runtime_error("Unable to write " + path.string());
+  }
+}
+
+}
+
+namespace detail {
+  std::atomic<bool> enabled {false};
+
+  void add(Counter counter, std::uint64_t value)
+  {
+    counters[(std::size_t)counter].fetch_add(value, std::memory_order_relaxed);
+  }
+}
+
+void enable()
+{
+  origin = std::chrono::steady_clock::now();
+  detail::enabled = true;
+}
+
+void Scope::begin(std::string_view scopeDetail)
+{
+  active = true;
+  detail = scopeDetail;
+  start = now();
+}
+
+void Scope::end()
+{
+  const auto stop = now();
+  getThreadLog().events.push_back({start, stop - start, std::move(detail), phase});
+}
+
+const char* getPhaseName(Phase phase)
+{
+  switch (phase) {
+    case Phase::ConfigParse: return "config_parse";
+    case Phase::Discover: return "discover";
+    case Phase::Digest: return "digest";
+    case Phase::Exports: return "exports";
+    case Phase::Install: return "install";
+    case Phase::Target: return "target";
+    case Phase::Map: return "map";
+    case Phase::LoadCommands: return "load_commands";
+    case Phase::BindDecode: return "bind_decode";
+    case Phase::HookMatch: return "hook_match";
+    case Phase::Inject: return "inject";
+    case Phase::Sign: return "sign";
+    case Phase::Sync: return "sync";
+    case Phase::Unpatch: return "unpatch";
+    case Phase::Apply: return "apply";
+    case Phase::Count: break;
+  }
+  return "unknown";
+}
+
+const char* getCounterName(Counter counter)
+{
+  switch (counter) {
+    case Counter::BytesRead: return "bytes_read";
+    case Counter::BytesWritten: return "bytes_written";
+    case Counter::BytesMapped: return "bytes_mapped";
+    case Counter::SymbolsScanned: return "symbols_scanned";
+    case Counter::HooksMatched: return "hooks_matched";
+    case Counter::OpcodesDecoded: return "opcodes_decoded";
+    case Counter::Count: break;
+  }
+  return "unknown";
+}
+
+void writeChromeTrace(const std::filesystem::path& path)
+{
+  std::lock_guard<std::mutex> lock(logMutex);
+  const auto pid = getpid();
+  const auto end = now();
+  auto events = nlohmann::ordered_json::array();
+  for (const auto& log: logs) {
+    events.push_back({
+        {"name", "thread_name"}, {"ph", "M"}, {"pid", pid}, {"tid", log->id},
+        {"args", {{"name", log->id == 1 ? "main" : "worker " + std::to_string(log->id - 1)}}}});
+    for (const auto& event: log->events) {
+      nlohmann::ordered_json json = {
+        {"name", getPhaseName(event.phase)},
+        {"cat", "weedless"},
+        {"ph", "X"},
+        {"ts", toMicroseconds(event.start)},
+        {"dur", toMicroseconds(event.duration)},
+        {"pid", pid},
+        {"tid", log->id}};
+      if (!event.detail.empty()) {
+        json["args"] = {{"detail", event.detail}};
+      }
+      events.push_back(std::move(json));
+    }
+  }
+
+  // Counters are only totals, so they show up once at the end.
+  auto counterValues = nlohmann::ordered_json::object();
+  for (std::size_t counter = 0; counter < (std::size_t)Counter::Count; counter++) {
+    counterValues[getCounterName((Counter)counter)] = counters[counter].load();
+  }
+  events.push_back({
+      {"name", "counters"}, {"ph", "C"}, {"ts", toMicroseconds(end)}, 
+      {"pid", pid}, {"tid", 1}, {"args", counterValues}});
+
+  writeJson(path, {{"traceEvents", events}, {"displayTimeUnit", "ms"}});
+}
+
+void writeStats(const std::filesystem::path& path)
+{
+  struct PhaseStats
+  {
+    std::uint64_t count = 0;
+    std::uint64_t total = 0;
+  };
+  std::lock_guard<std::mutex> lock(logMutex);
+  PhaseStats phases[(std::size_t)Phase::Count];
+  for (const auto& log: logs) {
+    for (const auto& event: log->events) {
+      auto& stats = phases[(std::size_t)event.phase];
+      stats.count++;
+      stats.total += event.duration;
+    }
+  }
+
+  // Phases overlap when they run on several threads, so their totals can
+  // add up to more than the wall time.
+  auto phaseJson = nlohmann::ordered_json::object();
+  for (std::size_t phase = 0; phase < (std::size_t)Phase::Count; phase++) {
+    phaseJson[getPhaseName((Phase)phase)] = {
+      {"count", phases[phase].count},
+      {"total_ms", toMilliseconds(phases[phase].total)}};
+  }
+  auto counterJson = nlohmann::ordered_json::object();
+  for (std::size_t counter = 0; counter < (std::size_t)Counter::Count; counter++) {
+    counterJson[getCounterName((Counter)counter)] = counters[counter].load();
+  }
+
+  writeJson(path, {
+      {"wall_ms", toMilliseconds(now())},
+      {"threads", logs.size()},
+      {"phases", phaseJson},
+      {"counters", counterJson}});
+}
+}
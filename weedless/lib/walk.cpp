@@ -0,0 +1,102 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "walk.h"
+
+// stl
+#include <algorithm>
+#include <stdexcept>
+
+// c
+#include <fcntl.h>
+#include <unistd.h>
+
+// weedless
+#include "machodefs.h"
+#include "parallel.h"
+
+namespace weedless {
+namespace {
+
+std::uint32_t readBigEndian32(const std::uint8_t* ptr)
+{
+  return (std::uint32_t(ptr[0]) << 24) | (std::uint32_t(ptr[1]) << 16) |
+         (std::uint32_t(ptr[2]) << 8) | std::uint32_t(ptr[3]);
+}
+}
+
+bool isMachOFile(const std::filesystem::path& path)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  std::uint8_t bytes[8];
+  const auto count = pread(fd, bytes, sizeof(bytes), 0);
+  close(fd);
+  if (count != sizeof(bytes)) {
+    return false;
+  }
+
+  // Fat headers are big endian, so a little endian Mach-O header reads as
+  // MH_CIGAM_64 or MH_CIGAM.
+  const auto magic = readBigEndian32(bytes);
+  if (magic == MH_CIGAM_64 || magic == MH_CIGAM) {
+    return true;
+  }
+
+  // Java class files share FAT_MAGIC, their version takes the place of the
+  // architecture count and is at least 45.
+  const auto archCount = readBigEndian32(bytes + 4);
+  return (magic == FAT_MAGIC || magic == FAT_MAGIC_64) && archCount != 0 && archCount < 45;
+}
+
+std::vector<std::filesystem::path> findMachOs(const std::filesystem::path& directory, std::size_t jobs)
+{
+  if (!std::filesystem::is_directory(directory)) {
+    throw std::runtime_error("Not a directory: " + directory.string());
+  }
+
+  // Walking only reads directory entries, the files are opened in parallel.
+  std::vector<std::filesystem::path> files;
+  for (const auto& entry: std::filesystem::recursive_directory_iterator(
+        directory, std::filesystem::directory_options::skip_permission_denied)) {
+    if (entry.is_regular_file() && !entry.is_symlink()) {
+      files.push_back(entry.path());
+    }
+  }
+
+  std::vector<char> isMachO(files.size());
+  parallelFor(files.size(), jobs, [&](std::size_t index) {
+    isMachO[index] = isMachOFile(files[index]);
+  });
+
+  std::vector<std::filesystem::path> binaries;
+  for (std::size_t index = 0; index < files.size(); index++) {
+    if (isMachO[index]) {
+      binaries.push_back(std::move(files[index]));
+    }
+  }
+  std::sort(binaries.begin(), binaries.end());
+  return binaries;
+}
+}
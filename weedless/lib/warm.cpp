@@ -0,0 +1,232 @@
+// MIT License
+// 
+// Copyright (c) 2021 Leander Hendrikx
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "warm.h"
+
+// weedless
+#include "config.h"
+#include "macho.h"
+
+// stl
+#include <chrono>
+#include <set>
+
+namespace weedless {
+namespace {
+
+// Covers the timestamp granularity of every common filesystem.
+constexpr std::int64_t kSettleTime = 2'000'000'000;
+
+// Checking every stamp is too slow to do on each request.
+constexpr auto kEvictionInterval = std::chrono::minutes(1);
+
+}
+
+bool isStampSettled(const FileStamp& stamp)
+{
+  const std::int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  return stamp.mtime < now - kSettleTime;
+}
+
+bool isStampCurrent(const std::filesystem::path& path, const FileStamp& stamp)
+{
+  try {
+    return FileStamp::of(path) == stamp;
+  } catch (const std::exception&) {
+    return false;
+  }
+}
+
+std::shared_ptr<const config::Config> WarmState::getConfig(
+    const std::filesystem::path& path, 
+    const std::filesystem::path& workingDirectory)
+{
+  // Relative paths in the config depend on the working directory.
+  auto config = configs.get(workingDirectory.string() + '\0' + path.string(), path, [&]() {
+    return std::shared_ptr<const config::Config>(
+        std::make_shared<config::Config>(config::read(path, workingDirectory)));
+  });
+
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto it = loadedConfigs.begin(); it != loadedConfigs.end();) {
+    it = it->second.expired() ? loadedConfigs.erase(it) : std::next(it);
+  }
+  loadedConfigs.emplace(config.get(), config);
+  return config;
+}
+
+ImageIndex WarmState::getIndex(const std::filesystem::path& path)
+{
+  return indexes.get(path.string(), path, [&]() { return indexMachO(path); });
+}
+
+FileDigest WarmState::getDigest(const std::filesystem::path& path)
+{
+  return digests.get(path.string(), path, [&]() { return digestFile(path); });
+}
+
+DylibExports WarmState::getExports(const std::filesystem::path& path)
+{
+  return exports.get(path.string(), path, [&]() { return readExports(path); });
+}
+
+bool WarmState::isKnownPatched(
+    const config::Config& config, 
+    const std::filesystem::path& output, 
+    const FileStamp& stamp)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = patched.find({&config, output.string()});
+  return it != patched.end() && it->second.stamp == stamp;
+}
+
+void WarmState::setPatched(
+    const config::Config& config, 
+    const std::filesystem::path& output, 
+    const FileStamp& stamp)
+{
+  if (!isStampSettled(stamp)) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  auto loaded = loadedConfigs.find(&config);
+  if (loaded == loadedConfigs.end()) {
+    return;
+  }
+  if (auto owner = loaded->second.lock()) {
+    patched.insert_or_assign({&config, output.string()}, PatchedEntry{std::move(owner), stamp});
+  }
+}
+
+bool WarmState::isKnownInstalled(
+    const std::filesystem::path& source, const FileStamp& sourceStamp,
+    const std::filesystem::path& destination, const FileStamp& destinationStamp)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = installed.find({source.string(), destination.string()});
+  return it != installed.end() && 
+    it->second.first == sourceStamp && it->second.second == destinationStamp;
+}
+
+void WarmState::setInstalled(
+    const std::filesystem::path& source, const FileStamp& sourceStamp,
+    const std::filesystem::path& destination, const FileStamp& destinationStamp)
+{
+  if (!isStampSettled(sourceStamp) || !isStampSettled(destinationStamp)) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  installed.insert_or_assign(
+      std::make_pair(source.string(), destination.string()), 
+      std::make_pair(sourceStamp, destinationStamp));
+}
+
+PathLock WarmState::lockPath(const std::filesystem::path& path)
+{
+  std::shared_ptr<std::mutex> pathMutex;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& entry = pathLocks[path.lexically_normal().string()];
+    pathMutex = entry.lock();
+    if (!pathMutex) {
+      pathMutex = std::make_shared<std::mutex>();
+      entry = pathMutex;
+    }
+  }
+  std::unique_lock<std::mutex> lock(*pathMutex);
+  return PathLock{std::move(pathMutex), std::move(lock)};
+}
+
+void WarmState::evictStale()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto now = std::chrono::steady_clock::now();
+    if (now - lastEviction < kEvictionInterval) {
+      return;
+    }
+    lastEviction = now;
+  }
+
+  // Configs go first, so the ones whose file changed are only held by what
+  // was found patched with them below.
+  configs.evictStale();
+  indexes.evictStale();
+  digests.evictStale();
+  exports.evictStale();
+
+  std::vector<std::pair<std::pair<const config::Config*, std::string>, FileStamp>> checkedPatched;
+  std::vector<std::pair<std::pair<std::string, std::string>, std::pair<FileStamp, FileStamp>>> checkedInstalled;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    // A config nobody else holds can't be handed out again, so nothing
+    // will ask whether it patched anything.
+    std::map<const config::Config*, long> entryCounts;
+    for (const auto& [key, entry]: patched) {
+      entryCounts[key.first]++;
+    }
+    std::set<const config::Config*> replaced;
+    for (const auto& [key, entry]: patched) {
+      if (entry.config.use_count() == entryCounts[key.first]) {
+        replaced.insert(key.first);
+      }
+    }
+    for (auto it = patched.begin(); it != patched.end();) {
+      if (replaced.count(it->first.first)) {
+        it = patched.erase(it);
+      } else {
+        checkedPatched.emplace_back(it->first, it->second.stamp);
+        it++;
+      }
+    }
+    checkedInstalled.assign(installed.begin(), installed.end());
+
+    for (auto it = pathLocks.begin(); it != pathLocks.end();) {
+      it = it->second.expired() ? pathLocks.erase(it) : std::next(it);
+    }
+  }
+
+  // Stamping happens unlocked, and only drops entries nobody replaced.
+  for (const auto& [key, stamp]: checkedPatched) {
+    if (isStampCurrent(key.second, stamp)) {
+      continue;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = patched.find(key);
+    if (it != patched.end() && it->second.stamp == stamp) {
+      patched.erase(it);
+    }
+  }
+  for (const auto& [key, stamps]: checkedInstalled) {
+    if (isStampCurrent(key.first, stamps.first) && isStampCurrent(key.second, stamps.second)) {
+      continue;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = installed.find(key);
+    if (it != installed.end() && it->second == stamps) {
+      installed.erase(it);
+    }
+  }
+}
+}
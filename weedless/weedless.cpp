@@ -21,21 +21,611 @@
 // SOFTWARE.
 
 // weedless
-#include "macho.h"
+#include "batch.h"
+#include "cache.h"
 #include "config.h"
-#include "install.h"
+#include "journal.h"
+#include "macho.h"
+#include "parallel.h"
+#include "plan.h"
+#include "server.h"
+#include "trace.h"
+#include "warm.h"
 
 // stl
+#include <algorithm>
+#include <charconv>
+#include <cstdlib>
+#include <filesystem>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
 
-int main(int argc, char* argv[]) {
-  if (argc != 2) {
-    std::cerr << "No hook file provided." << std::endl;
+namespace {
+
+// Where a command runs: locally, or in the server on behalf of a client.
+struct Context
+{
+  std::filesystem::path workingDirectory;
+  std::ostream& out;
+  std::ostream& err;
+  // Only set in the server.
+  weedless::WarmState* warm = nullptr;
+};
+
+void printUsage(std::ostream& err)
+{
+  err << "Usage: weedless [--socket path] [-j jobs] [--arch arch]... [--check] [-o dir] [--io mmap|pread] [--code-signature keep|strip|adhoc] [--journal] [--hardlink] [--trace file] [--stats file] <config.json>..." << std::endl;
+  err << "       weedless [--socket path] query [-j jobs] [--cache dir] <symbol> <binary>..." << std::endl;
+  err << "       weedless [--socket path] unpatch [-j jobs] <binary>..." << std::endl;
+  err << "       weedless [--socket path] plan [--arch arch]... [--code-signature keep|strip|adhoc] <binary> <plan> <config.json>..." << std::endl;
+  err << "       weedless [--socket path] apply [-j jobs] [--journal] <plan> <binary>..." << std::endl;
+  err << "       weedless serve [--socket path]" << std::endl;
+}
+
+// Parses a job count, which has to be a positive number.
+bool parseJobs(const std::string& value, std::size_t& jobs)
+{
+  std::size_t parsed = 0;
+  const auto* end = value.data() + value.size();
+  const auto result = std::from_chars(value.data(), end, parsed);
+  if (result.ec != std::errc() || result.ptr != end || parsed == 0) {
+    return false;
+  }
+  jobs = parsed;
+  return true;
+}
+
+std::string getOrdinalName(const std::vector<std::string_view>& dylibs, std::int32_t dylibIndex)
+{
+  switch (dylibIndex) {
+    case 0: return "self";
+    case -1: return "main-executable";
+    case -2: return "flat-lookup";
+    case -3: return "weak-lookup";
+  }
+  if (dylibIndex > 0 && static_cast<std::size_t>(dylibIndex) <= dylibs.size()) {
+    return std::string(dylibs[dylibIndex - 1]);
+  }
+  return "-";
+}
+
+// Lists which slices of the given binaries import `symbol`, and from where.
+// Indexes are served from the cache when one is configured.
+int query(const std::vector<std::string>& args, const Context& context)
+{
+  std::size_t jobs = weedless::defaultJobs();
+  std::optional<std::filesystem::path> cacheDirectory;
+  if (const char* env = std::getenv("WEEDLESS_CACHE_DIR")) {
+    cacheDirectory = env;
+  }
+  std::vector<std::string> positional;
+
+  for (std::size_t i = 1; i < args.size(); i++) {
+    if (args[i] == "-j" || args[i] == "--jobs") {
+      if (++i == args.size() || !parseJobs(args[i], jobs)) {
+        printUsage(context.err);
+        return 1;
+      }
+    } else if (args[i] == "--cache") {
+      if (++i == args.size()) {
+        printUsage(context.err);
+        return 1;
+      }
+      cacheDirectory = context.workingDirectory / args[i];
+    } else {
+      positional.push_back(args[i]);
+    }
+  }
+
+  if (positional.size() < 2) {
+    printUsage(context.err);
+    return 1;
+  }
+  const std::string& symbol = positional.front();
+  const std::vector<std::string> binaries(positional.begin() + 1, positional.end());
+
+  std::unique_ptr<weedless::IndexCache> cache;
+  if (cacheDirectory.has_value() && !context.warm) {
+    cache = std::make_unique<weedless::IndexCache>(*cacheDirectory);
+  }
+
+  // Output is buffered per binary so it comes out in argument order.
+  std::vector<std::string> outputs(binaries.size());
+  std::vector<std::string> errors(binaries.size());
+  weedless::parallelFor(binaries.size(), jobs, [&](std::size_t i) {
+    try {
+      const auto path = context.workingDirectory / binaries[i];
+      const auto index = context.warm ? context.warm->getIndex(path) 
+        : cache ? cache->get(path) 
+        : weedless::indexMachO(path);
+      std::ostringstream out;
+      for (std::size_t slice = 0; slice < index.getSliceCount(); ++slice) {
+        const auto arch = index.getSlice(slice);
+        const auto dylibs = index.getDylibs(slice);
+        for (const auto& import: index.getImports(slice)) {
+          if (import.symbol != symbol) {
+            continue;
+          }
+          out << binaries[i] << " "
+              << weedless::getArchName(arch.cputype, arch.cpusubtype) << " "
+              << import.symbol << " "
+              << import.dylibIndex << " "
+              << getOrdinalName(dylibs, import.dylibIndex) << " "
+              << weedless::getImportKindName(import.kind) << "\n";
+        }
+      }
+      outputs[i] = out.str();
+    } catch (const std::exception& e) {
+      errors[i] = e.what();
+    }
+  });
+
+  int exitCode = 0;
+  for (std::size_t i = 0; i < binaries.size(); ++i) {
+    if (!errors[i].empty()) {
+      context.err << "FAIL " << binaries[i] << ": " << errors[i] << std::endl;
+      exitCode = 1;
+    }
+    context.out << outputs[i];
+  }
+  return exitCode;
+}
+
+// Reverts the patches recorded in the undo journals of the given binaries.
+int unpatch(const std::vector<std::string>& args, const Context& context)
+{
+  std::size_t jobs = weedless::defaultJobs();
+  std::vector<std::string> binaries;
+
+  for (std::size_t i = 1; i < args.size(); i++) {
+    if (args[i] == "-j" || args[i] == "--jobs") {
+      if (++i == args.size() || !parseJobs(args[i], jobs)) {
+        printUsage(context.err);
+        return 1;
+      }
+    } else {
+      binaries.push_back(args[i]);
+    }
+  }
+
+  if (binaries.empty()) {
+    printUsage(context.err);
+    return 1;
+  }
+
+  std::vector<char> reverted(binaries.size());
+  std::vector<std::string> errors(binaries.size());
+  weedless::parallelFor(binaries.size(), jobs, [&](std::size_t i) {
+    try {
+      const auto path = context.workingDirectory / binaries[i];
+      weedless::PathLock lock;
+      if (context.warm) {
+        lock = context.warm->lockPath(path);
+      }
+      reverted[i] = weedless::unpatch(path);
+    } catch (const std::exception& e) {
+      errors[i] = e.what();
+    }
+  });
+
+  int exitCode = 0;
+  for (std::size_t i = 0; i < binaries.size(); ++i) {
+    if (!errors[i].empty()) {
+      context.err << "FAIL " << binaries[i] << ": " << errors[i] << std::endl;
+      exitCode = 1;
+    } else if (!reverted[i]) {
+      context.out << "no journal " << binaries[i] << std::endl;
+    } else {
+      context.out << "ok   " << binaries[i] << std::endl;
+    }
+  }
+  return exitCode;
+}
+
+// Reads the configs at `paths`, with `archs` and `codeSignature` (when
+// given) replacing what they set. Configs that can't be read are reported
+// and left out, setting `failed`. The server shares its configs between
+// requests, so they are copied before being changed.
+std::vector<std::shared_ptr<const weedless::config::Config>> readConfigs(
+    const std::vector<std::string>& paths,
+    const std::vector<std::string>& archs,
+    const std::optional<weedless::config::CodeSignature>& codeSignature,
+    const Context& context,
+    bool& failed)
+{
+  std::vector<std::shared_ptr<const weedless::config::Config>> configs;
+  for (const auto& path: paths) {
+    try {
+      const auto configPath = context.workingDirectory / path;
+      std::shared_ptr<const weedless::config::Config> config = context.warm 
+        ? context.warm->getConfig(configPath, context.workingDirectory)
+        : std::make_shared<weedless::config::Config>(
+            weedless::config::read(configPath, context.workingDirectory));
+      for (const auto& warning: config->warnings) {
+        context.err << "warning " << path << ": " << warning << std::endl;
+      }
+      if ((!archs.empty() && config->archs != archs) || 
+          (codeSignature.has_value() && config->codeSignature != *codeSignature)) {
+        auto copy = std::make_shared<weedless::config::Config>(*config);
+        if (!archs.empty()) {
+          copy->archs = archs;
+        }
+        copy->codeSignature = codeSignature.value_or(copy->codeSignature);
+        config = std::move(copy);
+      }
+      configs.push_back(std::move(config));
+    } catch (const std::exception& e) {
+      context.err << "FAIL " << path << ": " << e.what() << std::endl;
+      failed = true;
+    }
+  }
+  return configs;
+}
+
+// Records how the given configs patch a binary in a plan file, without
+// touching the binary.
+int plan(const std::vector<std::string>& args, const Context& context)
+{
+  std::vector<std::string> archs;
+  std::optional<weedless::config::CodeSignature> codeSignature;
+  std::vector<std::string> positional;
+
+  for (std::size_t i = 1; i < args.size(); i++) {
+    if (args[i] == "--arch") {
+      if (++i == args.size()) {
+        printUsage(context.err);
+        return 1;
+      }
+      archs.push_back(args[i]);
+    } else if (args[i] == "--code-signature") {
+      if (++i == args.size()) {
+        printUsage(context.err);
+        return 1;
+      }
+      try {
+        codeSignature = weedless::config::getCodeSignature(args[i]);
+      } catch (const std::exception&) {
+        printUsage(context.err);
+        return 1;
+      }
+    } else {
+      positional.push_back(args[i]);
+    }
+  }
+
+  if (positional.size() < 3) {
+    printUsage(context.err);
+    return 1;
+  }
+  const std::string& binary = positional[0];
+  const std::string& planPath = positional[1];
+  const std::vector<std::string> configPaths(positional.begin() + 2, positional.end());
+
+  // A plan without one of its configs would silently patch less.
+  bool failed = false;
+  const auto configs = readConfigs(configPaths, archs, codeSignature, context, failed);
+  if (failed) {
+    return 1;
+  }
+
+  std::vector<const weedless::config::Config*> configPtrs;
+  for (const auto& config: configs) {
+    configPtrs.push_back(config.get());
+  }
+  try {
+    const auto path = context.workingDirectory / binary;
+    weedless::PathLock lock;
+    if (context.warm) {
+      lock = context.warm->lockPath(path);
+    }
+    const auto plan = weedless::makePlan(configPtrs, path);
+    lock = {};
+    weedless::writePlan(context.workingDirectory / planPath, plan);
+    context.out << "ok   " << planPath << " (" << plan.edits.size() << " edits, " 
+                << plan.input.size << " -> " << plan.output.size << " bytes)" << std::endl;
+  } catch (const std::exception& e) {
+    context.err << "FAIL " << binary << ": " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+// Replays a plan onto copies of the binary it was made for.
+int apply(const std::vector<std::string>& args, const Context& context)
+{
+  std::size_t jobs = weedless::defaultJobs();
+  bool journal = false;
+  std::vector<std::string> positional;
+
+  for (std::size_t i = 1; i < args.size(); i++) {
+    if (args[i] == "-j" || args[i] == "--jobs") {
+      if (++i == args.size() || !parseJobs(args[i], jobs)) {
+        printUsage(context.err);
+        return 1;
+      }
+    } else if (args[i] == "--journal") {
+      journal = true;
+    } else {
+      positional.push_back(args[i]);
+    }
+  }
+
+  if (positional.size() < 2) {
+    printUsage(context.err);
+    return 1;
+  }
+  const std::vector<std::string> binaries(positional.begin() + 1, positional.end());
+
+  weedless::PatchPlan plan;
+  try {
+    plan = weedless::readPlan(context.workingDirectory / positional.front());
+  } catch (const std::exception& e) {
+    context.err << "FAIL " << e.what() << std::endl;
+    return 1;
+  }
+
+  std::vector<char> changed(binaries.size());
+  std::vector<std::string> errors(binaries.size());
+  weedless::parallelFor(binaries.size(), jobs, [&](std::size_t i) {
+    try {
+      const auto path = context.workingDirectory / binaries[i];
+      weedless::PathLock lock;
+      if (context.warm) {
+        lock = context.warm->lockPath(path);
+      }
+      changed[i] = weedless::applyPlan(plan, path, nullptr, journal);
+    } catch (const std::exception& e) {
+      errors[i] = e.what();
+    }
+  });
+
+  int exitCode = 0;
+  for (std::size_t i = 0; i < binaries.size(); ++i) {
+    if (!errors[i].empty()) {
+      context.err << "FAIL " << binaries[i] << ": " << errors[i] << std::endl;
+      exitCode = 1;
+    } else if (!changed[i]) {
+      context.out << "up to date " << binaries[i] << std::endl;
+    } else {
+      context.out << "ok   " << binaries[i] << std::endl;
+    }
+  }
+  return exitCode;
+}
+
+int patch(const std::vector<std::string>& args, const Context& context)
+{
+  weedless::BatchOptions options;
+  options.jobs = weedless::defaultJobs();
+  options.warm = context.warm;
+  std::vector<std::string> configPaths;
+  std::vector<std::string> archs;
+  std::optional<weedless::config::CodeSignature> codeSignature;
+  std::string tracePath;
+  std::string statsPath;
+
+  for (std::size_t i = 0; i < args.size(); i++) {
+    if (args[i] == "-j" || args[i] == "--jobs") {
+      if (++i == args.size() || !parseJobs(args[i], options.jobs)) {
+        printUsage(context.err);
+        return 1;
+      }
+    } else if (args[i] == "--io") {
+      if (++i == args.size()) {
+        printUsage(context.err);
+        return 1;
+      }
+      if (args[i] == "pread") {
+        options.io = weedless::IoBackend::Pread;
+      } else if (args[i] == "mmap") {
+        options.io = weedless::IoBackend::Mmap;
+      } else {
+        printUsage(context.err);
+        return 1;
+      }
+    } else if (args[i] == "--code-signature") {
+      if (++i == args.size()) {
+        printUsage(context.err);
+        return 1;
+      }
+      try {
+        codeSignature = weedless::config::getCodeSignature(args[i]);
+      } catch (const std::exception&) {
+        printUsage(context.err);
+        return 1;
+      }
+    } else if (args[i] == "--journal") {
+      options.journal = true;
+    } else if (args[i] == "--hardlink") {
+      options.hardlink = true;
+    } else if (args[i] == "--check") {
+      options.check = true;
+    } else if (args[i] == "-o" || args[i] == "--output") {
+      if (++i == args.size()) {
+        printUsage(context.err);
+        return 1;
+      }
+      options.outputDirectory = context.workingDirectory / args[i];
+    } else if (args[i] == "--arch") {
+      if (++i == args.size()) {
+        printUsage(context.err);
+        return 1;
+      }
+      archs.push_back(args[i]);
+    } else if (args[i] == "--trace") {
+      if (++i == args.size()) {
+        printUsage(context.err);
+        return 1;
+      }
+      tracePath = args[i];
+    } else if (args[i] == "--stats") {
+      if (++i == args.size()) {
+        printUsage(context.err);
+        return 1;
+      }
+      statsPath = args[i];
+    } else {
+      configPaths.push_back(args[i]);
+    }
+  }
+
+  if (configPaths.empty()) {
+    context.err << "No hook file provided." << std::endl;
+    printUsage(context.err);
     return 1;
   }
 
-  auto config = weedless::config::read(argv[1]);
+  if (!tracePath.empty() || !statsPath.empty()) {
+    // Tracing covers the whole process, which the server shares between
+    // clients.
+    if (context.warm) {
+      context.err << "FAIL --trace and --stats aren't supported by the server." << std::endl;
+      return 1;
+    }
+    weedless::trace::enable();
+  }
+
+  // A broken config only fails its own targets.
+  bool failed = false;
+  const auto configs = readConfigs(configPaths, archs, codeSignature, context, failed);
+  int exitCode = failed ? 1 : 0;
+
+  if (!options.check && !options.outputDirectory.empty()) {
+    std::error_code error;
+    std::filesystem::create_directories(options.outputDirectory, error);
+    if (error) {
+      context.err << "FAIL " << options.outputDirectory.string() << ": " << error.message() << std::endl;
+      return 1;
+    }
+  }
+
+  std::vector<const weedless::config::Config*> configPtrs;
+  for (const auto& config: configs) {
+    configPtrs.push_back(config.get());
+  }
+  for (const auto& result: weedless::patchTargets(configPtrs, options)) {
+    std::string ioStats;
+    if (options.io == weedless::IoBackend::Pread && !options.check) {
+      ioStats = " (read " + std::to_string(result.io.bytesRead) + 
+        " bytes, wrote " + std::to_string(result.io.bytesWritten) + " bytes)";
+    }
+    if (!result.ok()) {
+      context.err << "FAIL " << result.target.string() << ": " << result.error << std::endl;
+      exitCode = 1;
+    } else if (options.check && result.changed) {
+      context.out << "out of date " << result.output.string() << std::endl;
+      exitCode = 1;
+    } else if (!result.changed) {
+      context.out << "up to date " << result.output.string() << ioStats << std::endl;
+    } else {
+      context.out << "ok   " << result.output.string() << ioStats << std::endl;
+    }
+  }
+
+  try {
+    if (!tracePath.empty()) {
+      weedless::trace::writeChromeTrace(context.workingDirectory / tracePath);
+    }
+    if (!statsPath.empty()) {
+      weedless::trace::writeStats(context.workingDirectory / statsPath);
+    }
+  } catch (const std::exception& e) {
+    context.err << "FAIL " << e.what() << std::endl;
+    exitCode = 1;
+  }
+  return exitCode;
+}
+
+int run(const std::vector<std::string>& args, const Context& context)
+{
+  if (!args.empty() && args.front() == "query") {
+    return query(args, context);
+  }
+  if (!args.empty() && args.front() == "unpatch") {
+    return unpatch(args, context);
+  }
+  if (!args.empty() && args.front() == "plan") {
+    return plan(args, context);
+  }
+  if (!args.empty() && args.front() == "apply") {
+    return apply(args, context);
+  }
+  return patch(args, context);
+}
+
+// Keeps configs, indexes and digests warm between requests, so repeated
+// runs only pay for what changed.
+int serve(const std::filesystem::path& socketPath)
+{
+  weedless::WarmState warm;
+  weedless::serve(socketPath, [&warm](const weedless::ServerRequest& request) {
+    std::ostringstream out;
+    std::ostringstream err;
+    weedless::ServerResponse response;
+    if (!request.args.empty() && request.args.front() == "serve") {
+      err << "FAIL The server can't start another server." << std::endl;
+      response.exitCode = 1;
+    } else {
+      response.exitCode = run(request.args, {request.workingDirectory, out, err, &warm});
+      warm.evictStale();
+    }
+    response.out = out.str();
+    response.err = err.str();
+    return response;
+  });
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  std::vector<std::string> args;
+  std::filesystem::path socketPath;
+  if (const char* env = std::getenv("WEEDLESS_SOCKET")) {
+    socketPath = env;
+  }
+  for (int i = 1; i < argc; i++) {
+    if (std::string_view(argv[i]) == "--socket") {
+      if (++i == argc) {
+        printUsage(std::cerr);
+        return 1;
+      }
+      socketPath = argv[i];
+    } else {
+      args.push_back(argv[i]);
+    }
+  }
+
+  try {
+    if (!args.empty() && args.front() == "serve") {
+      if (socketPath.empty() || args.size() > 1) {
+        printUsage(std::cerr);
+        return 1;
+      }
+      return serve(std::filesystem::absolute(socketPath));
+    }
+
+    // Tracing only sees the process it runs in, so traced runs stay local.
+    const bool traced = std::find(args.begin(), args.end(), "--trace") != args.end() ||
+      std::find(args.begin(), args.end(), "--stats") != args.end();
+    if (!socketPath.empty() && !traced) {
+      // Without a server listening, the command runs locally instead.
+      if (const auto response = weedless::sendRequest(socketPath, {std::filesystem::current_path(), args})) {
+        std::cout << response->out;
+        std::cerr << response->err;
+        return response->exitCode;
+      }
+    }
+  } catch (const std::exception& e) {
+    std::cerr << "FAIL " << e.what() << std::endl;
+    return 1;
+  }
 
-  weedless::installDylibs(config); 
-  weedless::patchMachO(config); 
-} 
+  return run(args, {std::filesystem::current_path(), std::cout, std::cerr});
+}